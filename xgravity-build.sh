@@ -1,5 +1,5 @@
 #!/bin/bash
 
-gcc xgravity.c -o xgravity -lm -lX11 -lpthread
-gcc xgravity.c -o xgravity-64 -lm -lX11 -m64 -lpthread
-gcc xgravity.c -o xgravity-32 -lm -lX11 -m32 -lpthread
+gcc xgravity.c -o xgravity -lm -lX11 -lXext -lpthread
+gcc xgravity.c -o xgravity-64 -lm -lX11 -lXext -m64 -lpthread
+gcc xgravity.c -o xgravity-32 -lm -lX11 -lXext -m32 -lpthread
@@ -30,8 +30,10 @@ For more information, please refer to <http://unlicense.org/>
  * Date: 2014-10-09
  */
 
+#define _GNU_SOURCE // CPU sets and thread affinity
 #include <X11/Xlib.h> // Every Xlib program must include this
 #include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
 #include <unistd.h>   // So we got the profile for 10 seconds
 #include <stdio.h>
 #include <stdlib.h>
@@ -40,6 +42,17 @@ For more information, please refer to <http://unlicense.org/>
 #include <string.h>
 #include <float.h>
 #include <pthread.h> 
+#include <sched.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include "xgravity.h"
 
 
@@ -47,7 +60,7 @@ For more information, please refer to <http://unlicense.org/>
  * main application method
  * 
  * usage / command line arguments
- * xgravity [planet count] [calculation threads]
+ * xgravity [options] [planet count] [calculation threads]
  * 
  * @param argc
  * @param argv
@@ -56,12 +69,74 @@ int main(int argc, char *argv[]) {
   
   pthread_t calcThreads[MAX_THREADS];
   pthread_barrier_t calcBarrier;
-  pthread_mutex_t calcMutex = PTHREAD_MUTEX_INITIALIZER;
-  calcArgs calcThreadArgs;
+  pthread_barrier_t threadBarrier;
+  calcArgs calcThreadArgs[MAX_THREADS];
   int threads; // number of calculation threads to run
+  double theta; // Barnes-Hut opening angle
+  quadTree *tree;
+  int fmmOrder; // fast multipole expansion order, 0 when not used
+  fmmTree *fmm;
+  int errorSample; // planets to check against the direct sum
+  int integrator; // integrator used to advance the planets
+  int kernel; // direct sum force kernel
+  int mixed; // single precision pair terms in the direct sum
+  mixedTiles *tiles;
+  int affinity; // AFFINITY_ policy for pinning the calculation threads
+  threadPlacement *placement;
+  pthread_attr_t calcAttr;
+  cpu_set_t cpuSet;
+  char kernelLabel[32]; // force kernel name as printed
+  calcSchedule *schedule;
+  collisionGrid *grid;
+  int chunk; // planets per work chunk, 0 for automatic
+  int chunkGiven; // chunk size set on the command line
+  int tune; // pick the threads, chunk size and kernel at startup
+  char *tunePath; // tuning cache file
+  int tuneFd; // pipe to the parent in a tuning run, -1 otherwise
+  tuneChoice choice; // configuration picked by the tuning
+  char solverLabel[32]; // solver options the tuning depends on
+  int steal; // work stealing flag
+  int headless; // run without a display
+  long steps; // number of steps to run headless
+  int bench; // run the benchmark
+  int benchFormat; // BENCH_CSV or BENCH_JSON
+  char *checkpointPath; // file written by the S key and periodic checkpoints
+  long checkpointEvery; // steps between checkpoints, 0 for none
+  char *restorePath; // checkpoint to start from
+  char *recordPath; // trajectory file, NULL for none
+  long recordEvery; // steps between trajectory frames
+  double recordError; // largest error of the recorded positions and velocities
+  char *replayPath; // trajectory to replay, NULL to run the simulation
+  trajectoryReplay *replay; // recorded frames shown instead of the physics, NULL when simulating
+  checkpointHeader header;
+  int opt;
   
-  planet *planets[MAXCOUNT];
-  planet *aPlanet;
+  planetStore *planets;
+  physicsArgs physics;
+  pthread_t physicsThread;
+  snapshotBuffer *snapshots;
+  planetSnapshot *view; // snapshot being displayed
+  int *flashSeen; // merge count of each planet id at the last snapshot
+  int *flashFrames; // frames left in each planet id's flash
+  int flashCapacity; // planet ids the flash arrays cover
+  int redraw; // display needs drawing
+  char *tracePath; // Chrome trace file, NULL for none
+  int xlib; // draw with Xlib requests instead of the shared memory framebuffer
+  drawList *shapes; // shapes of the frame being drawn
+  frameRenderer *renderer; // shared memory renderer, NULL when drawing with Xlib
+  frameRenderer *heatImage; // density map sent with XPutImage when drawing with Xlib, NULL when not available
+  double lodDensity; // visible planets per pixel above which small planets become a density map
+  int lod; // drawing small planets as a density map this frame
+  int lodDrawn; // planets drawn in the last frame
+  Drawable target; // where the framebuffer is put
+  double px, py; // window position of the planet being drawn
+  profileSlot *hudLast; // counters at the last HUD refresh
+  double hudTime; // time of the last HUD refresh
+  char hudText[PROFILE_HUD_LINES][PROFILE_HUD_WIDTH];
+  int hudLines; // lines of HUD text
+  double frameStart; // start of the current frame's draw or flush
+  unsigned long requestStart; // X request number at the start of the frame
+  int drawn; // planets drawn this frame
   
   double minx, maxx, miny, maxy, cx, cy, massMax, massMin, timeFactor, forceMultiplier, radiusScale;
   int pi, count; // planet iterator
@@ -90,21 +165,247 @@ int main(int argc, char *argv[]) {
   XFontStruct *font_info;
   GContext gid;
 
+  struct option longOptions[] = {
+    {"theta", required_argument, NULL, 'b'},
+    {"kernel", required_argument, NULL, 'k'},
+    {"mixed", no_argument, NULL, 'M'},
+    {"fmm", required_argument, NULL, 'm'},
+    {"error-sample", required_argument, NULL, 'e'},
+    {"integrator", required_argument, NULL, 'i'},
+    {"chunk", required_argument, NULL, 'c'},
+    {"steal", no_argument, NULL, 's'},
+    {"tune-cache", required_argument, NULL, 'u'},
+    {"affinity", required_argument, NULL, 'a'},
+    {"headless", no_argument, NULL, 'H'},
+    {"steps", required_argument, NULL, 'n'},
+    {"timestep", required_argument, NULL, 't'},
+    {"checkpoint", required_argument, NULL, 'C'},
+    {"checkpoint-every", required_argument, NULL, 'K'},
+    {"restore", required_argument, NULL, 'R'},
+    {"record", required_argument, NULL, 'r'},
+    {"record-every", required_argument, NULL, 'N'},
+    {"record-error", required_argument, NULL, 'E'},
+    {"replay", required_argument, NULL, 'p'},
+    {"bench", no_argument, NULL, 'B'},
+    {"format", required_argument, NULL, 'f'},
+    {"trace", required_argument, NULL, 'T'},
+    {"xlib", no_argument, NULL, 'x'},
+    {"lod", required_argument, NULL, 'l'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+
+  timeFactor = 0; // calculation time factor in seconds, 0 until set
+  theta = THETA;
+  fmmOrder = 0;
+  errorSample = -1;
+  integrator = INTEGRATOR_EULER;
+  kernel = KERNEL_AUTO;
+  mixed = 0;
+  chunk = CHUNK_SIZE;
+  chunkGiven = 0;
+  tunePath = TUNE_FILE;
+  steal = 0;
+  affinity = AFFINITY_NONE;
+  headless = 0;
+  steps = -1;
+  bench = 0;
+  benchFormat = BENCH_CSV;
+  checkpointPath = CHECKPOINT_FILE;
+  checkpointEvery = 0;
+  restorePath = NULL;
+  recordPath = NULL;
+  recordEvery = TRAJECTORY_EVERY;
+  recordError = TRAJECTORY_ERROR;
+  replayPath = NULL;
+  tracePath = NULL;
+  xlib = 0;
+  lodDensity = LOD_DENSITY;
+
+  // check for options
+  while( (opt = getopt_long(argc, argv, "b:k:Mm:e:i:c:su:a:Hn:t:C:K:R:r:N:E:p:Bf:T:xl:h", longOptions, NULL)) != -1 ) {
+    switch( opt ) {
+      case 'b':
+        theta = atof(optarg);
+        if( theta < 0 ) theta = 0;
+        break;
+
+      case 'm':
+        fmmOrder = atoi(optarg);
+        if( fmmOrder < 1 || fmmOrder > FMM_MAX_ORDER ) {
+          printf("Expansion order must be from 1 to %d\n", FMM_MAX_ORDER);
+          exit(1);
+        }
+        break;
+
+      case 'e':
+        errorSample = atoi(optarg);
+        if( errorSample < 0 ) errorSample = 0;
+        break;
+
+      case 'i':
+        integrator = getIntegratorByName(optarg);
+        if( integrator < 0 ) {
+          printf("Unknown integrator %s\n", optarg);
+          exit(1);
+        }
+        break;
+
+      case 'k':
+        kernel = getForceKernelByName(optarg);
+        if( kernel < KERNEL_AUTO ) {
+          printf("Unknown force kernel %s\n", optarg);
+          exit(1);
+        }
+        if( kernel != KERNEL_AUTO && !isForceKernelSupported(kernel) ) {
+          printf("Force kernel %s is not supported by this CPU\n", optarg);
+          exit(1);
+        }
+        break;
+
+      case 'M':
+        mixed = 1;
+        break;
+
+      case 'c':
+        chunk = atoi(optarg);
+        if( chunk < 0 ) chunk = CHUNK_SIZE;
+        chunkGiven = 1;
+        break;
+
+      case 'u':
+        tunePath = optarg;
+        break;
+
+      case 's':
+        steal = 1;
+        break;
+
+      case 'a':
+        affinity = getAffinityByName(optarg);
+        if( affinity < 0 ) {
+          printf("Unknown affinity %s\n", optarg);
+          exit(1);
+        }
+        break;
+
+      case 'H':
+        headless = 1;
+        break;
+
+      case 'n':
+        steps = atol(optarg);
+        if( steps < 0 ) steps = STEPS;
+        break;
+
+      case 't':
+        timeFactor = atof(optarg);
+        if( timeFactor <= 0 ) timeFactor = 1;
+        break;
+
+      case 'C':
+        checkpointPath = optarg;
+        break;
+
+      case 'K':
+        checkpointEvery = atol(optarg);
+        if( checkpointEvery < 0 ) checkpointEvery = 0;
+        break;
+
+      case 'R':
+        restorePath = optarg;
+        break;
+
+      case 'r':
+        recordPath = optarg;
+        break;
+
+      case 'N':
+        recordEvery = atol(optarg);
+        if( recordEvery < 1 ) recordEvery = TRAJECTORY_EVERY;
+        break;
+
+      case 'E':
+        recordError = atof(optarg);
+        if( recordError <= 0 ) recordError = TRAJECTORY_ERROR;
+        break;
+
+      case 'p':
+        replayPath = optarg;
+        break;
+
+      case 'B':
+        bench = 1;
+        break;
+
+      case 'f':
+        if( strcmp(optarg, "csv") == 0 ) benchFormat = BENCH_CSV;
+        else if( strcmp(optarg, "json") == 0 ) benchFormat = BENCH_JSON;
+        else {
+          printf("Unknown benchmark format %s\n", optarg);
+          exit(1);
+        }
+        break;
+
+      case 'T':
+        tracePath = optarg;
+        break;
+
+      case 'x':
+        xlib = 1;
+        break;
+
+      case 'l':
+        lodDensity = atof(optarg);
+        if( lodDensity < 0 ) lodDensity = 0;
+        break;
+
+      default:
+        printUsage(argv[0]);
+        exit(opt == 'h' ? 0 : 1);
+    }
+  }
+
+  if( fmmOrder > 0 && theta > 0 ) {
+    printf("Use either the Barnes-Hut or the fast multipole solver\n");
+    exit(1);
+  }
+  
+  // the fast multipole passes cover every planet, so each sub-step of the
+  // block integrator would cost a whole force pass
+  if( fmmOrder > 0 && integrator == INTEGRATOR_BLOCK ) {
+    printf("The block integrator cannot be used with the fast multipole solver\n");
+    exit(1);
+  }
+  
+  if( mixed && (fmmOrder > 0 || theta > 0) ) {
+    printf("Mixed precision only applies to the direct sum\n");
+    exit(1);
+  }
   
+  // report the mixed precision error unless told how many planets to check
+  if( errorSample < 0 ) errorSample = mixed ? MIXED_ERROR_SAMPLE : ERROR_SAMPLE;
+
   // check for planet count in arguments
-  if( argc > 1 ) {
+  if( argc > optind ) {
     // first argument is planet count
-    count = atoi(argv[1]);
-    if( count > MAXCOUNT ) count = MAXCOUNT;
+    count = atoi(argv[optind]);
+    if( count < 0 ) count = COUNT;
   }
   else {
     count = COUNT;
   }
   
   // check for thread count in arguments
-  if( argc > 2 ) {
-    // first argument is planet count
-    threads = atoi(argv[2]);
+  tune = 0;
+  if( argc > optind + 1 && strcmp(argv[optind + 1], "auto") == 0 ) {
+    // the threads are picked once the planets exist
+    tune = 1;
+    threads = THREAD_COUNT;
+  }
+  else if( argc > optind + 1 ) {
+    // second argument is thread count
+    threads = atoi(argv[optind + 1]);
     if ( threads < 1 )
     {
       threads = THREAD_COUNT;
@@ -117,9 +418,38 @@ int main(int argc, char *argv[]) {
   else {
     threads = THREAD_COUNT;
   }
+  
+  if( tune && bench ) {
+    printf("The benchmark runs its own thread counts, give a number instead of auto\n");
+    exit(1);
+  }
+  
+  // the benchmark runs each planet and thread count in its own process,
+  // this only returns in the process for one configuration
+  if( bench ) {
+    forkBenchRuns(benchFormat, &count, &threads, argc > optind, argc > optind + 1);
+  }
+  else if( steps < 0 ) {
+    steps = STEPS;
+  }
+  
+  // a replay draws recorded frames, the planet store stays empty and the
+  // physics thread is never started
+  replay = NULL;
+  if( replayPath ) {
+    if( headless || bench ) {
+      printf("Replay needs the window\n");
+      exit(1);
+    }
+    replay = openReplay(replayPath);
+    printf("Replay:%lld frames\r\n", replay->frames);
+    count = 0;
+    restorePath = NULL;
+    recordPath = NULL;
+    tune = 0;
+  }
 
   // set default control values
-  timeFactor = 1; // calculation time factor in seconds
   zoomFactor = 4; // start zoomed out a bit
   forceMultiplier = 1e-8; // need a small multiplier to shrink force lines
   shownum = 0; // do not show numbers
@@ -130,6 +460,200 @@ int main(int argc, char *argv[]) {
   cx = 0;
   cy = 0;
 
+  if( bench ) {
+    // every benchmark run starts from the same planets
+    planets = createPlanetStore(count);
+    seedPlanets(planets, BENCH_SEED);
+  }
+  else if( restorePath ) {
+    // map the planets from a checkpoint, the planet count comes from the file
+    planets = restoreCheckpoint(restorePath, &header);
+    count = planets->capacity;
+    if( timeFactor == 0 ) timeFactor = header.timeFactor;
+    cx = header.cx;
+    cy = header.cy;
+    zoomFactor = header.zoomFactor;
+  }
+  else {
+    // allocate memory for planet data
+    planets = createPlanetStore(count);
+    
+    // initialize planets
+    randomizePlanets(planets);
+  }
+  if( timeFactor == 0 ) timeFactor = 1;
+
+  // time the candidate configurations in child processes unless the cache
+  // has a choice, each child returns here to set up and time its candidate
+  tuneFd = -1;
+  if( tune && planets->count > 0 ) {
+    if( fmmOrder > 0 ) sprintf(solverLabel, "fmm%d", fmmOrder);
+    else if( theta > 0 ) sprintf(solverLabel, "theta%G", theta);
+    else strcpy(solverLabel, mixed ? "mixed" : "direct");
+    choice.chunk = chunk;
+    choice.kernel = kernel == KERNEL_AUTO ? selectForceKernel() : kernel;
+    tuneFd = tuneConfiguration(tunePath, planets->count, solverLabel, kernel == KERNEL_AUTO && fmmOrder == 0 && theta == 0, !chunkGiven, &choice);
+    threads = choice.threads;
+    chunk = choice.chunk;
+    kernel = choice.kernel;
+    
+    if( tuneFd >= 0 ) {
+      // the tuning run only times steps
+      headless = 1;
+      errorSample = 0;
+      recordPath = NULL;
+      tracePath = NULL;
+    }
+    else {
+      printf("%sTuned for %d planets: %d threads, chunk %d, kernel %s, %.3f ms per step%s", headless ? "# " : "", 
+             planets->count, threads, chunk, kernelNames[kernel], 1000 * choice.seconds, headless ? "\n" : "\r\n");
+    }
+  }
+
+  // initialize the thread barrier to thread count plus main
+  pthread_barrier_init(&calcBarrier, NULL, threads + 1);
+  
+  // the phases within a pass only synchronize the calculation threads
+  pthread_barrier_init(&threadBarrier, NULL, threads);
+  
+  // pick the fastest kernel for this CPU unless one was requested
+  if( kernel == KERNEL_AUTO ) {
+    kernel = selectForceKernel();
+  }
+  sprintf(kernelLabel, "%s%s", kernelNames[kernel], mixed ? "+mixed" : "");
+
+  // planets are handed to the threads in chunks
+  schedule = createCalcSchedule(count, threads, chunk, steal);
+
+  // spatial hash for the collision pass
+  grid = createCollisionGrid(count, threads);
+
+  // the quadtree is only needed when using Barnes-Hut or the fast multipole method
+  tree = NULL;
+  if( theta > 0 || fmmOrder > 0 ) {
+    tree = createQuadTree(count, threads);
+  }
+  
+  fmm = NULL;
+  if( fmmOrder > 0 ) {
+    fmm = createFmmTree(fmmOrder);
+  }
+  
+  // single precision copy of the planets for the mixed precision kernels
+  tiles = NULL;
+  if( mixed ) {
+    tiles = createMixedTiles(count, getForceKernel(kernel));
+  }
+  
+  // pin the calculation threads, the direct sum reads a copy of the
+  // positions and masses on each node when they span more than one
+  placement = NULL;
+  if( affinity != AFFINITY_NONE ) {
+    placement = createThreadPlacement(affinity, threads);
+    if( placement->nodes > 1 && tree == NULL ) {
+      createNodeReplicas(placement, count);
+    }
+  }
+
+  // initialize threads
+  for(pi = 0; pi < threads; pi++)
+  {
+    // collect thread arguments into struct
+    calcThreadArgs[pi].planetData = planets;
+    calcThreadArgs[pi].thread = pi;
+    calcThreadArgs[pi].threads = threads;
+    calcThreadArgs[pi].theta = theta;
+    calcThreadArgs[pi].tree = tree;
+    calcThreadArgs[pi].fmm = fmm;
+    calcThreadArgs[pi].grid = grid;
+    calcThreadArgs[pi].kernel = getForceKernel(kernel);
+    calcThreadArgs[pi].tiles = tiles;
+    calcThreadArgs[pi].mixed = getMixedKernel(kernel);
+    calcThreadArgs[pi].placement = placement;
+    calcThreadArgs[pi].placedX = NULL;
+    calcThreadArgs[pi].placedReplica = NULL;
+    calcThreadArgs[pi].placeBuffer = NULL;
+    calcThreadArgs[pi].calcBarrier = &calcBarrier;
+    calcThreadArgs[pi].threadBarrier = &threadBarrier;
+    calcThreadArgs[pi].schedule = schedule;
+    calcThreadArgs[pi].busyTime[PASS_FORCE] = 0;
+    calcThreadArgs[pi].busyTime[PASS_COLLIDE] = 0;
+    
+    pthread_attr_init(&calcAttr);
+    if( placement ) {
+      calcThreadArgs[pi].placeBuffer = (char *) malloc(HUGE_PAGE_SIZE);
+      CPU_ZERO(&cpuSet);
+      CPU_SET(placement->cpu[pi], &cpuSet);
+      pthread_attr_setaffinity_np(&calcAttr, sizeof(cpu_set_t), &cpuSet);
+    }
+    pthread_create(&calcThreads[pi], &calcAttr, &calcWorker, &calcThreadArgs[pi]);
+    pthread_attr_destroy(&calcAttr);
+  }
+  
+  if( placement && !bench ) {
+    printf("%sCalculation threads pinned %s on %d NUMA node%s%s\n", headless ? "# " : "", 
+           affinityNames[affinity], placement->nodes, placement->nodes > 1 ? "s" : "", 
+           placement->replicas ? ", positions and masses copied to each node" : "");
+  }
+  
+  // state for stepping the planets
+  physics.planets = planets;
+  physics.schedule = schedule;
+  physics.calcBarrier = &calcBarrier;
+  physics.timeFactor = timeFactor;
+  physics.integrator = integrator;
+  physics.commandHead = 0;
+  physics.commandCount = 0;
+  pthread_mutex_init(&physics.commandMutex, NULL);
+  physics.cx = cx;
+  physics.cy = cy;
+  physics.zoomFactor = zoomFactor;
+  physics.checkpointPath = checkpointPath;
+  physics.checkpointEvery = checkpointEvery;
+  physics.grid = grid;
+  physics.tree = tree;
+  physics.capacity = count;
+  physics.recorder = NULL;
+  physics.tiles = tiles;
+  physics.placement = placement;
+  
+  // stream timed zones to a trace file for the whole run
+  if( tracePath && !bench ) {
+    openTrace(tracePath, threads);
+  }
+  
+  // record the starting planets and every recordEvery steps after them
+  if( recordPath && !bench ) {
+    physics.recorder = openTrajectory(recordPath, recordEvery, recordError);
+    recordTrajectory(physics.recorder, planets);
+  }
+  
+  // compare the solver with the direct sum before starting
+  if( errorSample > 0 && !bench ) {
+    reportForceError(planets, schedule, &calcBarrier, errorSample);
+  }
+  
+  // time the steps of one tuning candidate and exit
+  if( tuneFd >= 0 ) {
+    runTune(&physics, tuneFd);
+  }
+  
+  // time the steps for one benchmark configuration and exit
+  if( bench ) {
+    runBench(&physics, calcThreadArgs, threads, steps, benchFormat, kernelLabel, theta, fmmOrder);
+    exit(0);
+  }
+  
+  // run the steps without a display and exit
+  if( headless ) {
+    printf("# xgravity headless: %d planets, %d threads, %ld steps, timestep %G s, integrator %s, force kernel %s, theta %G, fmm order %d\n", 
+           count, threads, steps, timeFactor, integratorNames[integrator], kernelLabel, theta, fmmOrder);
+    runHeadless(&physics, steps);
+    exit(0);
+  }
+  
+  printf("Force kernel:%s\r\n", kernelLabel);
+
   // setup Xwindow
   display = XOpenDisplay(NULL);
   if( display == NULL) {
@@ -190,35 +714,51 @@ int main(int argc, char *argv[]) {
   XCopyArea(display, pixmap, window, gc, 0, 0, winw, winh, 0, 0);
   XFlush(display);
 
-  
-  // allocate memory for planet data
-  for ( pi = 0; pi < count; pi++ ) {
-    planets[pi] = (planet *) malloc(sizeof(planet));
+  // planets become a list of shapes each frame, rasterized by the render
+  // threads into shared memory or sent as Xlib requests when that is not
+  // available
+  shapes = createDrawList();
+  renderer = NULL;
+  if( !xlib ) {
+    renderer = createFrameRenderer(display, screen, winw, winh, threads, 1, drawColors, shapes);
   }
+  printf("Drawing:%s\r\n", renderer ? "MIT-SHM" : "Xlib");
   
-  // initialize planets
-  randomizePlanets(planets, count);
+  // without the shared framebuffer the density map is one XPutImage
+  heatImage = NULL;
+  if( !renderer ) {
+    heatImage = createFrameRenderer(display, screen, winw, winh, 0, 0, drawColors, shapes);
+  }
+  lodDrawn = 0;
 
-  // initialize the thread barrier to thread count plus main
-  pthread_barrier_init(&calcBarrier, NULL, threads + 1);
 
-  // collect thread arguments into struct
-  calcThreadArgs.planetData = planets;
-  calcThreadArgs.count = count;
-  calcThreadArgs.calcBarrier = &calcBarrier;
-  calcThreadArgs.calcMutex = &calcMutex;
-  
-  // initialize threads
-  for(pi = 0; pi < threads; pi++)
-  {
-    pthread_create(&calcThreads[pi], NULL, &calcWorker, &calcThreadArgs);
+  // physics runs on its own thread and publishes each completed step
+  snapshots = createSnapshotBuffer(count);
+  physics.snapshots = snapshots;
+  publishSnapshot(snapshots, planets);
+  if( !replay ) {
+    pthread_create(&physicsThread, NULL, &physicsWorker, &physics);
   }
   
+  // display side flash state
+  flashSeen = (int *) calloc(count, sizeof(int));
+  flashFrames = (int *) calloc(count, sizeof(int));
+  flashCapacity = count;
+  view = &snapshots->snapshots[snapshots->front];
+  redraw = 1;
+  
+  // HUD starts hidden
+  hudLast = (profileSlot *) allocateStoreArray(PROFILE_SLOTS, sizeof(profileSlot));
+  hudTime = 0;
+  hudLines = 0;
+
   // main application loop
   while(1) {
 
     // keyboard events
     if( XCheckMaskEvent(display, KeyPressMask, &event) && XLookupString(&event.xkey, text, 255, &key, 0)==1 ) {
+      redraw = 1;
+
       // quit
       if (text[0]=='q') {
         XCloseDisplay(display);
@@ -241,9 +781,21 @@ int main(int argc, char *argv[]) {
         if( shownum > 6 ) shownum = 0;
       }
       
+      // toggle the instrumentation HUD, counting starts from now
+      else if( text[0] == 'i' ) {
+        __atomic_xor_fetch(&profileFlags, PROFILE_HUD, __ATOMIC_RELAXED);
+        sampleProfile(hudLast);
+        hudTime = getSeconds();
+        hudLines = 0;
+      }
+      
+      // playback keys take the place of the commands that change the planets
+      else if( replay && text[0] && strchr(" rtT,.<>0123456789\r", text[0]) ) {
+        controlReplay(replay, text[0], getSeconds());
+      }
+      
       // toggle calculation time factor in seconds
-      else if( text[0] == 't' ) timeFactor = timeFactor / 10;
-      else if( text[0] == 'T' ) timeFactor = timeFactor * 10;
+      else if( text[0] == 't' || text[0] == 'T' ) postCommand(&physics, text[0], cx, cy, zoomFactor);
       
       // zoom in
       else if( text[0] == 'z' ) {
@@ -275,14 +827,12 @@ int main(int argc, char *argv[]) {
         miny = 0;
         maxy = 0;
         
-        // use planets to find minimum and maximum position values for zoom window
-        for(pi = 0; pi < count; pi++) {
-          if( planets[pi]->mass > 0 ) {
-            if( planets[pi]->x < minx ) minx = planets[pi]->x - 500;
-            if( planets[pi]->x > maxx ) maxx = planets[pi]->x + 500;
-            if( planets[pi]->y < miny ) miny = planets[pi]->y - 500;
-            if( planets[pi]->y > maxy ) maxy = planets[pi]->y + 500;
-          }
+        // zoom window from the bounding box the physics thread gathered
+        if( view->stats.count > 0 ) {
+          if( view->stats.minX < minx ) minx = view->stats.minX - 500;
+          if( view->stats.maxX > maxx ) maxx = view->stats.maxX + 500;
+          if( view->stats.minY < miny ) miny = view->stats.minY - 500;
+          if( view->stats.maxY > maxy ) maxy = view->stats.maxY + 500;
         }
         
         // calculate zoom factor
@@ -297,51 +847,16 @@ int main(int argc, char *argv[]) {
         cy = (double)-1.0 * (miny + (maxy - miny) / (double)2.0);
       }
       
-      // re-randomize planets
-      else if( text[0] == 'r' ) {
-        randomizePlanets(planets, count);
-      }
-      
-      // wipe all planets
-      else if( text[0] == 'w' ) {
-        massMax = 0;
-        massMin = DBL_MAX;
-        clearPlanets(planets, count);
-      }
-      
-      else if( text[0] == 's' ) {
-        // create a gravitation well
-        createGravityWell(planets, count, cx, cy);
-      }
-      
-      else if( text[0] == 'b' ) {
-        // create a binary gravitation well
-        createBinaryWell(planets, count, cx, cy);
-      }
-      
-      else if( text[0] == 'h' ) {
-        // create a heliocentric system
-        createHeliocentricSystem(planets, count, cx, cy);
-      }
-      
-      else if( text[0] == 'g' ) {
-        // create some geocentric nonsense
-        createGeocentricSystem(planets, count, cx, cy);
-      }
-      
-      else if( text[0] == 'p' ) {
-        // create Sol planetary system
-        createPlanetarySystem(planets, count, cx, cy);
-      }
-      else if( text[0] == 'm' ) {
-        // create molniya orbit
-        createMolniyaOrbit(planets, count, cx, cy);
+      // changes to the planets are applied by the physics thread between steps
+      else if( !replay && text[0] && strchr("rwsbhgpmS", text[0]) ) {
+        postCommand(&physics, text[0], cx, cy, zoomFactor);
       }
     } // end of keyboard events
 
     // window config events
     if( XCheckMaskEvent(display, StructureNotifyMask, &event) && event.type == ConfigureNotify ) {
       if (event.xconfigure.window == window) {
+        redraw = 1;
         winw = event.xconfigure.width;
         winh = event.xconfigure.height;
         XFreePixmap(display, pixmap);
@@ -349,18 +864,32 @@ int main(int argc, char *argv[]) {
 
         pixmap = XCreatePixmap(display, window, winw, winh, DefaultDepth(display, screen));
         XFlush(display);
+        
+        // the render threads are waiting between frames
+        if( renderer ) {
+          destroyFrameImage(renderer, display);
+          if( !createFrameImage(renderer, display, screen, winw, winh) ) {
+            renderer = NULL;
+            printf("Drawing:Xlib\r\n");
+          }
+        }
+        if( heatImage ) {
+          destroyFrameImage(heatImage, display);
+          if( !createFrameImage(heatImage, display, screen, winw, winh) ) heatImage = NULL;
+        }
       }
     }
 
     // mouse button events
     if( XCheckMaskEvent(display, ButtonPressMask, &event) ) {
+      redraw = 1;
       centerID = -1;
 
       // if clicked on planet then select as centerID for auto centering
-      for(pi = 0; pi < count; pi++) {
-        dist = sqrt(pow((cx + planets[pi]->x) / zoomFactor + (winw / 2) - event.xbutton.x, 2) + pow((cy + planets[pi]->y) / zoomFactor + (winh / 2) - event.xbutton.y, 2));
+      for(pi = 0; pi < view->count; pi++) {
+        dist = sqrt(pow((cx + view->x[pi]) / zoomFactor + (winw / 2) - event.xbutton.x, 2) + pow((cy + view->y[pi]) / zoomFactor + (winh / 2) - event.xbutton.y, 2));
         if( dist < 4 ) {
-          centerID = pi;
+          centerID = view->id[pi];
           continue;
         }
       }
@@ -374,117 +903,162 @@ int main(int argc, char *argv[]) {
     }
 
 
-    // set calculation state on for each planet that has mass
-    for(pi = 0; pi < count; pi++)
-    {
-      if ( planets[pi]->mass > 0 )
-      {
-        planets[pi]->calc = 1;
+    // pick up the latest completed step or the replay frame that is due,
+    // only draw when something changed
+    if( replay ? advanceReplay(replay, getSeconds()) : takeSnapshot(snapshots) ) {
+      view = replay ? &replay->snapshot : &snapshots->snapshots[snapshots->front];
+      redraw = 1;
+      
+      // planets were added past the flash arrays
+      if( view->ids > flashCapacity ) {
+        flashSeen = (int *) realloc(flashSeen, view->ids * sizeof(int));
+        flashFrames = (int *) realloc(flashFrames, view->ids * sizeof(int));
+        memset(flashSeen + flashCapacity, 0, (view->ids - flashCapacity) * sizeof(int));
+        memset(flashFrames + flashCapacity, 0, (view->ids - flashCapacity) * sizeof(int));
+        flashCapacity = view->ids;
+      }
+      
+      // start the flash for planets that merged since the last snapshot
+      for(pi = 0; pi < view->count; pi++) {
+        if( view->flash[pi] != flashSeen[view->id[pi]] ) flashFrames[view->id[pi]] = FLASH_FRAMES;
+        flashSeen[view->id[pi]] = view->flash[pi];
       }
     }
     
-    // wait for all threads to start calculations
-    pthread_barrier_wait(&calcBarrier);
-    
-    // wait for all threads to end calculations
-    pthread_barrier_wait(&calcBarrier);
+    // refresh the HUD figures every so often
+    if( (profileFlags & PROFILE_HUD) && getSeconds() - hudTime >= PROFILE_HUD_USEC / 1e6 ) {
+      hudLines = updateProfileHud(hudLast, &hudTime, threads, &view->stats, hudText);
+      redraw = 1;
+    }
     
-    // move planets after calculations
-    movePlanets(timeFactor, planets, count);
+    if( !redraw ) {
+      usleep(RENDER_IDLE_USEC);
+      continue;
+    }
+    redraw = 0;
+    massMax = view->stats.massMax;
+    massMin = view->stats.massMin;
+    frameStart = startProfile();
+    requestStart = NextRequest(display);
+    drawn = 0;
+    shapes->count = 0;
+    shapes->heatCount = 0;
     
-    // calculate collisions
-    calculateCollisions(planets, count);
-    massMax = getMassMax(planets, count);
-    massMin = getMassMin(planets, count);
+    // when the last frame had more planets than the window can show apart,
+    // small planets are summed into a density map instead of drawn as discs
+    lod = (renderer || heatImage) && lodDensity > 0 && lodDrawn > lodDensity * winw * winh;
+    shapes->heatUnit = massMin > 0 && massMin < DBL_MAX ? massMin : 1;
         
-    // clear display
-    XSetForeground(display, gc, drawColors[COLOR_BACKGROUND].pixel);
-    XFillRectangle(display, pixmap, gc, 0, 0, winw, winh);
+    // clear display, the render threads clear the framebuffer
+    if( !renderer ) {
+      XSetForeground(display, gc, drawColors[COLOR_BACKGROUND].pixel);
+      XFillRectangle(display, pixmap, gc, 0, 0, winw, winh);
+    }
 
-    // if following a planet then recenter display on the planet
+    // if following a planet then recenter display on the planet, planets
+    // move between slots so look for its id
     if( centerID > -1 ) {
-      cx = -1 * planets[centerID]->x;
-      cy = -1 * planets[centerID]->y;
+      for(pi = 0; pi < view->count && view->id[pi] != centerID; pi++);
+      if( pi < view->count ) {
+        cx = -1 * view->x[pi];
+        cy = -1 * view->y[pi];
+      }
+      else {
+        // merged into another planet
+        centerID = -1;
+      }
     }
 
     // set radius scale of kg per pixel
     radiusScale = (massMax - massMin) / (MAX_PIXEL_RADIUS - MIN_PIXEL_RADIUS);
   
     // draw each planet
-    for(pi = 0; pi < count; pi++) {
+    for(pi = 0; pi < view->count; pi++) {
       // if planet has mass and is within the display area then we draw
-      if( planets[pi]->mass > 0 && 
-          (cx + planets[pi]->x) / zoomFactor > -1 * (winw / 2) && (cx + planets[pi]->x) / zoomFactor < (winw / 2) && 
-          (cy + planets[pi]->y) / zoomFactor > -1 * (winh / 2) && (cy + planets[pi]->y) / zoomFactor < (winh / 2) ) {
+      if( view->mass[pi] > 0 && 
+          (cx + view->x[pi]) / zoomFactor > -1 * (winw / 2) && (cx + view->x[pi]) / zoomFactor < (winw / 2) && 
+          (cy + view->y[pi]) / zoomFactor > -1 * (winh / 2) && (cy + view->y[pi]) / zoomFactor < (winh / 2) ) {
         // calculate radius relative to mass and other planets
-        radius = (int)(planets[pi]->mass / radiusScale) + MIN_PIXEL_RADIUS;
+        radius = (int)(view->mass[pi] / radiusScale) + MIN_PIXEL_RADIUS;
+        px = (cx + view->x[pi]) / zoomFactor + (winw / 2);
+        py = (cy + view->y[pi]) / zoomFactor + (winh / 2);
+        drawn++;
+
+        // small planets other than the followed one go on the density map
+        if( lod && radius <= LOD_DISC_SIZE && !flashFrames[view->id[pi]] && view->id[pi] != centerID ) {
+          addHeatPoint(shapes, px, py, view->mass[pi]);
+          continue;
+        }
 
-        // determine color by flash or radius divisions
-        if( planets[pi]->flash ) {
-            XSetForeground(display, gc, drawColors[COLOR_FLASH].pixel);
-            radius = radius * planets[pi]->flash;
-            planets[pi]->flash -= 1;
+        // determine color by flash or radius divisions, the disc gets a
+        // black border
+        if( flashFrames[view->id[pi]] ) {
+            radius = radius * flashFrames[view->id[pi]];
+            flashFrames[view->id[pi]] -= 1;
+            addDrawDisc(shapes, COLOR_FLASH, px - radius / 2, py - radius / 2, radius);
         }
         else if( radius > 16 ) {
           // size is color for a star
-          XSetForeground(display, gc, drawColors[COLOR_STAR].pixel);
+          addDrawDisc(shapes, COLOR_STAR, px - radius / 2, py - radius / 2, radius);
         }
         else if( radius <= 16 && radius > 12 ) {
           // size is color of blue planet
-          XSetForeground(display, gc, drawColors[COLOR_BLUE].pixel);
+          addDrawDisc(shapes, COLOR_BLUE, px - radius / 2, py - radius / 2, radius);
         }
         else {
           // default color for smallest is green
-          XSetForeground(display, gc, drawColors[COLOR_GREEN].pixel);
+          addDrawDisc(shapes, COLOR_GREEN, px - radius / 2, py - radius / 2, radius);
         }
 
-        // draw planet dot
-        XFillArc(display, pixmap, gc, 
-                 ((cx + planets[pi]->x) / zoomFactor + (winw / 2) - radius / 2), 
-                 ((cy + planets[pi]->y) / zoomFactor + (winh / 2) - radius / 2), 
-                 radius, radius, 0, 360 * 64);
-
-        // draw black border
-        XSetForeground(display, gc, drawColors[COLOR_BLACK].pixel);
-        XDrawArc(display, pixmap, gc, 
-                 ((cx + planets[pi]->x) / zoomFactor + (winw / 2) - radius / 2), 
-                 ((cy + planets[pi]->y) / zoomFactor + (winh / 2) - radius / 2), 
-                 radius, radius, 0, 360 * 64);
-
         // show force vectors
         if( showforce > 0 ) {
           switch( showforce ) {
             case 1:
               //draw gravitational force
-              XSetForeground(display, gc, drawColors[COLOR_RED].pixel);
-              XDrawLine(display, pixmap, gc, 
-                 ((cx + planets[pi]->x) / zoomFactor + (winw / 2)),
-                 ((cy + planets[pi]->y) / zoomFactor + (winh / 2)),
-                 ((cx + planets[pi]->x + (planets[pi]->mass * planets[pi]->acceleration.accelerationX) * forceMultiplier) / zoomFactor + (winw / 2)),
-                 ((cy + planets[pi]->y + (planets[pi]->mass * planets[pi]->acceleration.accelerationY) * forceMultiplier) / zoomFactor + (winh / 2)));
-
-              XSetForeground(display, gc, drawColors[COLOR_BLUE].pixel);
-              XDrawLine(display, pixmap, gc,
-                 ((cx + planets[pi]->x) / zoomFactor + (winw / 2)),
-                 ((cy + planets[pi]->y) / zoomFactor + (winh / 2)),
-                 ((cx + planets[pi]->x + (planets[pi]->mass * planets[pi]->velocityX * forceMultiplier / 10)) / zoomFactor + (winw / 2)),
-                 ((cy + planets[pi]->y + (planets[pi]->mass * planets[pi]->velocityY * forceMultiplier / 10)) / zoomFactor + (winh / 2)));
+              addDrawLine(shapes, COLOR_RED, px, py, 
+                 ((cx + view->x[pi] + (view->mass[pi] * view->accelerationX[pi]) * forceMultiplier) / zoomFactor + (winw / 2)),
+                 ((cy + view->y[pi] + (view->mass[pi] * view->accelerationY[pi]) * forceMultiplier) / zoomFactor + (winh / 2)));
+
+              addDrawLine(shapes, COLOR_BLUE, px, py,
+                 ((cx + view->x[pi] + (view->mass[pi] * view->velocityX[pi] * forceMultiplier / 10)) / zoomFactor + (winw / 2)),
+                 ((cy + view->y[pi] + (view->mass[pi] * view->velocityY[pi] * forceMultiplier / 10)) / zoomFactor + (winh / 2)));
 
               break;
 
             case 2:
              //draw gravitational acceleration
-              XSetForeground(display, gc, drawColors[COLOR_WHITE].pixel);
-              XDrawLine(display, pixmap, gc,
-                 ((cx + planets[pi]->x) / zoomFactor + (winw / 2)),
-                 ((cy + planets[pi]->y) / zoomFactor + (winh / 2)),
-                 ((cx + planets[pi]->x + (planets[pi]->acceleration.accelerationX) * forceMultiplier) / zoomFactor + (winw / 2)),
-                 ((cy + planets[pi]->y + (planets[pi]->acceleration.accelerationY) * forceMultiplier) / zoomFactor + (winh / 2)));
+              addDrawLine(shapes, COLOR_WHITE, px, py,
+                 ((cx + view->x[pi] + (view->accelerationX[pi]) * forceMultiplier) / zoomFactor + (winw / 2)),
+                 ((cy + view->y[pi] + (view->accelerationY[pi]) * forceMultiplier) / zoomFactor + (winh / 2)));
 
               break;
           }
         }
+      }
+    }
+    
+    // rasterize into the framebuffer and put it on the window, or on the
+    // pixmap when there is text to draw over it
+    target = window;
+    if( renderer ) {
+      renderFrame(renderer);
+      if( shownum > 0 || (profileFlags & PROFILE_HUD) || replay ) target = pixmap;
+      XShmPutImage(display, target, gc, renderer->image, 0, 0, 0, 0, winw, winh, False);
+    }
+    else {
+      if( shapes->heatCount > 0 ) {
+        renderFrame(heatImage);
+        XPutImage(display, pixmap, gc, heatImage->image, 0, 0, 0, 0, winw, winh);
+      }
+      drawXlibShapes(display, pixmap, gc, drawColors, shapes, winw, winh);
+      target = pixmap;
+    }
 
+    // label each planet over the shapes
+    for(pi = 0; pi < view->count && shownum > 0; pi++) {
+      if( view->mass[pi] > 0 && 
+          (cx + view->x[pi]) / zoomFactor > -1 * (winw / 2) && (cx + view->x[pi]) / zoomFactor < (winw / 2) && 
+          (cy + view->y[pi]) / zoomFactor > -1 * (winh / 2) && (cy + view->y[pi]) / zoomFactor < (winh / 2) ) {
         // show stat values
         if( shownum > 0 ) {
           // set text color
@@ -493,46 +1067,46 @@ int main(int argc, char *argv[]) {
           switch( shownum ) {
             // show planet id number
             case 1:
-              sprintf(text, "ID:%d", pi);
+              sprintf(text, "ID:%d", view->id[pi]);
               break;
 
             // show planet mass
             case 2:
-              sprintf(text, "%2.2E kg", planets[pi]->mass);
+              sprintf(text, "%2.2E kg", view->mass[pi]);
               break;
 
             // show planet velocity
             case 3:
-              fg = sqrt(pow(planets[pi]->velocityX, 2) + pow(planets[pi]->velocityY, 2));
-              td = atan2(planets[pi]->velocityY, planets[pi]->velocityX);
+              fg = sqrt(pow(view->velocityX[pi], 2) + pow(view->velocityY[pi], 2));
+              td = atan2(view->velocityY[pi], view->velocityX[pi]);
               if( isinf(td) ) td = M_PI / 2;
-              if( isnan(td) && (planets[pi]->velocityX - planets[pi]->velocityX) > 0 ) td = 0;
-              if( isnan(td) && (planets[pi]->velocityX - planets[pi]->velocityX) < 0 ) td = M_PI;
+              if( isnan(td) && (view->velocityX[pi] - view->velocityX[pi]) > 0 ) td = 0;
+              if( isnan(td) && (view->velocityX[pi] - view->velocityX[pi]) < 0 ) td = M_PI;
               td = td * 180 / M_PI + 180;
               sprintf(text, "%2.2G m/s %3.0f degrees", fg, td);
               break;
 
             // show planet coordinates
             case 4:
-              sprintf(text, "%G, %G", planets[pi]->x, planets[pi]->y);
+              sprintf(text, "%G, %G", view->x[pi], view->y[pi]);
               break;
 
             // show mass and velocity
             case 5:
-              fg = sqrt(pow(planets[pi]->velocityX, 2) + pow(planets[pi]->velocityY, 2));
-              td = atan2(planets[pi]->velocityY, planets[pi]->velocityX);
+              fg = sqrt(pow(view->velocityX[pi], 2) + pow(view->velocityY[pi], 2));
+              td = atan2(view->velocityY[pi], view->velocityX[pi]);
               if( isinf(td) ) td = M_PI / 2;
-              if( isnan(td) && (planets[pi]->velocityX - planets[pi]->velocityX) > 0 ) td = 0;
-              if( isnan(td) && (planets[pi]->velocityX - planets[pi]->velocityX) < 0 ) td = M_PI;
+              if( isnan(td) && (view->velocityX[pi] - view->velocityX[pi]) > 0 ) td = 0;
+              if( isnan(td) && (view->velocityX[pi] - view->velocityX[pi]) < 0 ) td = M_PI;
               td = td * 180 / M_PI + 180;
   //font_info
   //font_height = font_info->max_bounds.ascent +
   //font_info->max_bounds.descent;
 
-              sprintf(text, "%2.2E kg", planets[pi]->mass);
+              sprintf(text, "%2.2E kg", view->mass[pi]);
               XDrawString(display, pixmap, gc, 
-                          (cx + planets[pi]->x) / zoomFactor + (winw / 2), 
-                          (cy + planets[pi]->y) / zoomFactor + (winh / 2) + 
+                          (cx + view->x[pi]) / zoomFactor + (winw / 2), 
+                          (cy + view->y[pi]) / zoomFactor + (winh / 2) + 
                             font_info->max_bounds.ascent +
                             font_info->max_bounds.descent, 
                           text, strlen(text));
@@ -542,27 +1116,27 @@ int main(int argc, char *argv[]) {
 
             // show inertia and acting gravitational force
             case 6:
-              fg = planets[pi]->mass * sqrt(pow(planets[pi]->velocityX, 2) + pow(planets[pi]->velocityY, 2));
-              td = atan2(planets[pi]->velocityY, planets[pi]->velocityX);
+              fg = view->mass[pi] * sqrt(pow(view->velocityX[pi], 2) + pow(view->velocityY[pi], 2));
+              td = atan2(view->velocityY[pi], view->velocityX[pi]);
               if( isinf(td) ) td = M_PI / 2;
-              if( isnan(td) && (planets[pi]->velocityX - planets[pi]->velocityX) > 0 ) td = 0;
-              if( isnan(td) && (planets[pi]->velocityX - planets[pi]->velocityX) < 0 ) td = M_PI;
+              if( isnan(td) && (view->velocityX[pi] - view->velocityX[pi]) > 0 ) td = 0;
+              if( isnan(td) && (view->velocityX[pi] - view->velocityX[pi]) < 0 ) td = M_PI;
               td = td * 180 / M_PI + 180;
 
               sprintf(text, "   P = %2.2G Ns %3.0f degrees", fg, td);
               XDrawString(display, pixmap, gc,
-                          (cx + planets[pi]->x) / zoomFactor + (winw / 2),
-                          (cy + planets[pi]->y) / zoomFactor + (winh / 2) +
+                          (cx + view->x[pi]) / zoomFactor + (winw / 2),
+                          (cy + view->y[pi]) / zoomFactor + (winh / 2) +
                             font_info->max_bounds.ascent +
                             font_info->max_bounds.descent,
                           text, strlen(text));
 
 
-              fg = planets[pi]->mass * sqrt(pow(planets[pi]->acceleration.accelerationX, 2) + pow(planets[pi]->acceleration.accelerationY, 2));
-              td = atan2(planets[pi]->acceleration.accelerationY, planets[pi]->acceleration.accelerationX);
+              fg = view->mass[pi] * sqrt(pow(view->accelerationX[pi], 2) + pow(view->accelerationY[pi], 2));
+              td = atan2(view->accelerationY[pi], view->accelerationX[pi]);
               if( isinf(td) ) td = M_PI / 2;
-              if( isnan(td) && (planets[pi]->velocityX - planets[pi]->velocityX) > 0 ) td = 0;
-              if( isnan(td) && (planets[pi]->velocityX - planets[pi]->velocityX) < 0 ) td = M_PI;
+              if( isnan(td) && (view->velocityX[pi] - view->velocityX[pi]) > 0 ) td = 0;
+              if( isnan(td) && (view->velocityX[pi] - view->velocityX[pi]) < 0 ) td = M_PI;
               td = td * 180 / M_PI + 180;
               sprintf(text, "   Fg = %2.2G N %3.0f degrees", fg, td);
 
@@ -570,14 +1144,40 @@ int main(int argc, char *argv[]) {
 
           }
           
-          XDrawString(display, pixmap, gc, (cx + planets[pi]->x) / zoomFactor + (winw / 2), (cy + planets[pi]->y) / zoomFactor + (winh / 2), text, strlen(text));
+          XDrawString(display, pixmap, gc, (cx + view->x[pi]) / zoomFactor + (winw / 2), (cy + view->y[pi]) / zoomFactor + (winh / 2), text, strlen(text));
         }
       }
     }
 
-    // apply drawn bitmap
-    XCopyArea(display, pixmap, window, gc, 0, 0, winw, winh, 0, 0);
-    XFlush(display);
+    // instrumentation overlay
+    if( profileFlags & PROFILE_HUD ) {
+      XSetForeground(display, gc, drawColors[COLOR_WHITE].pixel);
+      for(pi = 0; pi < hudLines; pi++) {
+        XDrawString(display, pixmap, gc, 10, 10 + (pi + 1) * (font_info->max_bounds.ascent + font_info->max_bounds.descent), 
+                    hudText[pi], strlen(hudText[pi]));
+      }
+    }
+    
+    // playback position
+    if( replay ) {
+      XSetForeground(display, gc, drawColors[COLOR_WHITE].pixel);
+      describeReplay(replay, text);
+      XDrawString(display, pixmap, gc, 10, winh - 10, text, strlen(text));
+    }
+    endProfile(PROFILE_DISPLAY, ZONE_DRAW, frameStart);
+
+    // apply drawn bitmap, the framebuffer can only be reused once the
+    // server has read it
+    frameStart = startProfile();
+    if( target == pixmap ) XCopyArea(display, pixmap, window, gc, 0, 0, winw, winh, 0, 0);
+    if( renderer ) XSync(display, False);
+    else XFlush(display);
+    endProfile(PROFILE_DISPLAY, ZONE_FLUSH, frameStart);
+    
+    addProfileCount(PROFILE_DISPLAY, COUNTER_FRAMES, 1);
+    addProfileCount(PROFILE_DISPLAY, COUNTER_DRAWN, drawn);
+    lodDrawn = drawn;
+    addProfileCount(PROFILE_DISPLAY, COUNTER_REQUESTS, NextRequest(display) - requestStart);
 
   }
 
@@ -587,627 +1187,7412 @@ int main(int argc, char *argv[]) {
 
 
 /**
- * Randomize the location, velocity, and mass of all planets.
+ * Physics thread, steps the planets as fast as possible and publishes a
+ * snapshot after each step for the display.
+ * 
+ * @param args A pointer to a physicsArgs struct.
+ * @return 
  */
-void randomizePlanets(planet *planetData[], int count)
+void * physicsWorker(void *args)
 {
-  int i;
-  double r, a;
+  physicsArgs *physics;
+  double start;
   
-  // seed
-  srand((unsigned int)time((time_t *)NULL));
-//  massMax = 0;
-//  massMin = DBL_MAX;
-
-  // loop through all planets
-  for(i = 0; i < count; i++) {
-    // randomize polar coordinates from center
-    r = MAXPOS * (rand() / (RAND_MAX + 1.0));
-    a = (2 * M_PI) * (rand() / (RAND_MAX + 1.0));
-    
-    // convert polar coordinates into rectangular
-    planetData[i]->x = (r * cos(a));
-    if( isnan(planetData[i]->x) )
-    {
-      planetData[i]->x = 0;
-    }
-    else if( isinf(planetData[i]->x) )
-    {
-      planetData[i]->x = r;
-    }
-
-    planetData[i]->y = (r * sin(a));
-    if( isnan(planetData[i]->y) )
-    {
-      planetData[i]->y = 0;
-    }
-    else if( isinf(planetData[i]->y) )
-    {
-      planetData[i]->y = r;
-    }
-      
-    // random planet velocity
-    planetData[i]->velocityX = (2 * MAXV * (rand() / (RAND_MAX + 1.0))) - MAXV;
-    planetData[i]->velocityY = (2 * MAXV * (rand() / (RAND_MAX + 1.0))) - MAXV;
+  physics = (physicsArgs *) args;
+  
+  while (1)
+  {
+    // apply keyboard commands between steps
+    applyCommands(physics);
     
-    // random mass
-    planetData[i]->mass = MAXKG * (pow(1/sqrt(M_PI), -1 * pow(rand() / (RAND_MAX + 1.0), 2) / 0.75) - 1);
+    stepPhysics(physics);
     
-    // reset flash and calculating flags
-    planetData[i]->flash = 0;
-    planetData[i]->calc = 0;
+    start = startProfile();
+    publishSnapshot(physics->snapshots, physics->planets);
+    endProfile(PROFILE_PHYSICS, ZONE_SNAPSHOT, start);
   }
+  
+  return NULL;
 }
 
 
 /**
- * Clear the planet settings.
+ * Run one step and write a checkpoint or trajectory frame when one is due.
  * 
- * @param planetData
- * @param count
+ * @param physics
  */
-void clearPlanets(planet *planetData[], int count)
+void stepPhysics(physicsArgs *physics)
 {
-  int i;
-
-  for(i = 0; i < count; i++) {
-    planetData[i]->x = 0;
-    planetData[i]->y = 0;
-    planetData[i]->velocityX = 0;
-    planetData[i]->velocityY = 0;
-    planetData[i]->mass = 0;
+  double start;
+  
+  // calculate, move and collide
+  start = startProfile();
+  stepPlanets(physics->planets, physics->schedule, physics->calcBarrier, physics->timeFactor, physics->integrator, NULL);
+  endProfile(PROFILE_PHYSICS, ZONE_STEP, start);
+  addProfileCount(PROFILE_PHYSICS, COUNTER_STEPS, 1);
+  if ( profileFlags & PROFILE_TRACE ) traceProfileCounters();
+  
+  if ( physics->checkpointEvery > 0 && physics->planets->step % physics->checkpointEvery == 0 )
+  {
+    writeCheckpoint(physics->checkpointPath, physics->planets, physics->timeFactor, 
+                    physics->cx, physics->cy, physics->zoomFactor);
+  }
+  
+  if ( physics->recorder && physics->planets->step % physics->recorder->every == 0 )
+  {
+    recordTrajectory(physics->recorder, physics->planets);
   }
 }
 
 
 /**
- * Create a large gravity well.
+ * Queue a keyboard command for the physics thread.
  * 
- * @param planetData
- * @param count
+ * @param physics
+ * @param key The key that was pressed.
+ * @param cx The view center when the key was pressed.
+ * @param cy
+ * @param zoomFactor The view zoom when the key was pressed.
  */
-void createGravityWell(planet *planetData[], int count, int cx, int cy)
+void postCommand(physicsArgs *physics, char key, double cx, double cy, double zoomFactor)
 {
-  int pi = count * (rand() / (RAND_MAX + 1.0));
-  planetData[pi]->x = 0 - cx;
-  planetData[pi]->y = 0 - cy;
-  planetData[pi]->mass = MAXKG * (int)(1000 * (rand() / (RAND_MAX + 1.0)));
-  planetData[pi]->velocityX = 0;
-  planetData[pi]->velocityY = 0;
+  simCommand *command;
   
+  pthread_mutex_lock(&physics->commandMutex);
+  
+  // drop keys when the queue is full
+  if ( physics->commandCount < COMMAND_QUEUE )
+  {
+    command = &physics->commands[(physics->commandHead + physics->commandCount) % COMMAND_QUEUE];
+    command->key = key;
+    command->cx = cx;
+    command->cy = cy;
+    command->zoomFactor = zoomFactor;
+    physics->commandCount++;
+  }
+  
+  pthread_mutex_unlock(&physics->commandMutex);
 }
 
 
 /**
- * Create a binary orbiting gravity well.
+ * Apply the queued keyboard commands that change the planets.
  * 
- * @param planetData
- * @param count
- * @param cx
- * @param cy
+ * @param physics
  */
-void createBinaryWell(planet *planetData[], int count, int cx, int cy)
+void applyCommands(physicsArgs *physics)
 {
-  int pi;
+  simCommand command;
+  planetStore *planets;
+  int applied;
   
-  pi = count * (rand() / (RAND_MAX + 1.0));
-  planetData[pi]->x = 0 - cx;
-  planetData[pi]->y = 500 - cy;
-  planetData[pi]->mass = MAXKG * (int)(1000 * (rand() / (RAND_MAX + 1.0)));
-  planetData[pi]->velocityX = 2;
-  planetData[pi]->velocityY = 0;
-
-  pi = count * (rand() / (RAND_MAX + 1.0));
-  planetData[pi]->x = 0 - cx;
-  planetData[pi]->y = -500 - cy;
-  planetData[pi]->mass = MAXKG * (int)(1000 * (rand() / (RAND_MAX + 1.0)));
-  planetData[pi]->velocityX = -2;
-  planetData[pi]->velocityY = 0;
+  planets = physics->planets;
+  applied = 0;
+  
+  // unlocked peek, a command posted now is picked up next step
+  while ( physics->commandCount > 0 )
+  {
+    pthread_mutex_lock(&physics->commandMutex);
+    command = physics->commands[physics->commandHead];
+    physics->commandHead = (physics->commandHead + 1) % COMMAND_QUEUE;
+    physics->commandCount--;
+    pthread_mutex_unlock(&physics->commandMutex);
+    
+    // scenario keys move planets, the leapfrog needs new accelerations
+    planets->accelerationCurrent = 0;
+    applied = 1;
+    
+    // remember the view for checkpoints
+    physics->cx = command.cx;
+    physics->cy = command.cy;
+    physics->zoomFactor = command.zoomFactor;
+    
+    switch ( command.key )
+    {
+      // toggle calculation time factor in seconds
+      case 't':
+        physics->timeFactor = physics->timeFactor / 10;
+        break;
+      case 'T':
+        physics->timeFactor = physics->timeFactor * 10;
+        break;
+        
+      // re-randomize planets
+      case 'r':
+        randomizePlanets(planets);
+        break;
+        
+      // wipe all planets
+      case 'w':
+        clearPlanets(planets);
+        break;
+        
+      // create a gravitation well
+      case 's':
+        createGravityWell(planets, command.cx, command.cy);
+        break;
+        
+      // create a binary gravitation well
+      case 'b':
+        createBinaryWell(planets, command.cx, command.cy);
+        break;
+        
+      // create a heliocentric system
+      case 'h':
+        createHeliocentricSystem(planets, command.cx, command.cy);
+        break;
+        
+      // create some geocentric nonsense
+      case 'g':
+        createGeocentricSystem(planets, command.cx, command.cy);
+        break;
+        
+      // create Sol planetary system
+      case 'p':
+        createPlanetarySystem(planets, command.cx, command.cy);
+        break;
+        
+      // create molniya orbit
+      case 'm':
+        createMolniyaOrbit(planets, command.cx, command.cy);
+        break;
+        
+      // save a checkpoint
+      case 'S':
+        if ( writeCheckpoint(physics->checkpointPath, planets, physics->timeFactor, 
+                             command.cx, command.cy, command.zoomFactor) == 0 )
+        {
+          printf("Checkpoint saved to %s at step %ld\r\n", physics->checkpointPath, planets->step);
+        }
+        break;
+    }
+  }
+  
+  // a scenario can place a planet with no mass or grow the planet store
+  if ( applied )
+  {
+    compactPlanets(planets);
+    updatePlanetStats(planets);
+    fitCalcStorage(physics);
+  }
 }
 
 
 /**
- * Create a heliocentric system.
+ * Grow the calculation thread storage to fit the planet store, called
+ * between steps while the calculation threads are waiting.
  * 
- * @param planetData
- * @param count
- * @param cx
- * @param cy
+ * @param physics
  */
-void createHeliocentricSystem(planet *planetData[], int count, int cx, int cy)
+void fitCalcStorage(physicsArgs *physics)
 {
-  int pi;
-
-  pi = count * (rand() / (RAND_MAX + 1.0));
-  planetData[pi]->x = 0 - cx;
-  planetData[pi]->y = 0 - cy;
-  planetData[pi]->mass = 2e14;
-  planetData[pi]->velocityX = 0;
-  planetData[pi]->velocityY = 0;
-
-  pi = count * (rand() / (RAND_MAX + 1.0));
-  planetData[pi]->x = 0 - cx;
-  planetData[pi]->y = -200 - cy;
-  planetData[pi]->mass = 5e8;
-  planetData[pi]->velocityX = -8;
-  planetData[pi]->velocityY = 0;
-
-  pi = count * (rand() / (RAND_MAX + 1.0));
-  planetData[pi]->x = -500 - cx;
-  planetData[pi]->y = 0 - cy;
-  planetData[pi]->mass = 5e8;
-  planetData[pi]->velocityX = 0;
-  planetData[pi]->velocityY = 5;
-
-  pi = count * (rand() / (RAND_MAX + 1.0));
-  planetData[pi]->x = 800 - cx;
-  planetData[pi]->y = 0 - cy;
-  planetData[pi]->mass = 5e8;
-  planetData[pi]->velocityX = 0;
-  planetData[pi]->velocityY = -4.5;
-
-  pi = count * (rand() / (RAND_MAX + 1.0));
-  planetData[pi]->x = 0 - cx;
-  planetData[pi]->y = 1200 - cy;
-  planetData[pi]->mass = 5e8;
-  planetData[pi]->velocityX = 3.8;
-  planetData[pi]->velocityY = 0;
+  int capacity;
+  
+  capacity = physics->planets->capacity;
+  if ( capacity <= physics->capacity )
+  {
+    return;
+  }
+  
+  physics->schedule->active = (int *) realloc(physics->schedule->active, capacity * sizeof(int));
+  physics->schedule->regroup = (int *) realloc(physics->schedule->regroup, capacity * sizeof(int));
+  sizeCollisionGrid(physics->grid, capacity);
+  if ( physics->tree )
+  {
+    physics->tree->next = (int *) realloc(physics->tree->next, capacity * sizeof(int));
+  }
+  if ( physics->tiles )
+  {
+    growMixedTiles(physics->tiles, capacity);
+  }
+  if ( physics->placement && physics->placement->replicas )
+  {
+    growNodeReplicas(physics->placement, capacity);
+  }
+  physics->capacity = capacity;
 }
 
 
 /**
- * Create a geocentric system.
+ * Allocate the three snapshots shared by the physics and display threads.
  * 
- * @param planetData
- * @param count
- * @param cx
- * @param cy
+ * @param count The planet count.
+ * @return 
  */
-void createGeocentricSystem(planet *planetData[], int count, int cx, int cy)
+snapshotBuffer * createSnapshotBuffer(int count)
 {
-  int pi;
-
-  pi = count * (rand() / (RAND_MAX + 1.0));
-  planetData[pi]->x = 0 - cx;
-  planetData[pi]->y = 0 - cy;
-  planetData[pi]->mass = 5e8;
-  planetData[pi]->velocityX = 0;
-  planetData[pi]->velocityY = 0;
-
-  pi = count * (rand() / (RAND_MAX + 1.0));
-  planetData[pi]->x = 0 - cx;
-  planetData[pi]->y = -200 - cy;
-  planetData[pi]->mass = 5e8;
-  planetData[pi]->velocityX = -8;
-  planetData[pi]->velocityY = 0;
-
-  pi = count * (rand() / (RAND_MAX + 1.0));
-  planetData[pi]->x = -500 - cx;
-  planetData[pi]->y = 0 - cy;
-  planetData[pi]->mass = 5e8;
-  planetData[pi]->velocityX = 0;
-  planetData[pi]->velocityY = 5;
+  snapshotBuffer *buffer;
+  planetSnapshot *snapshot;
+  int i;
+  
+  buffer = (snapshotBuffer *) malloc(sizeof(snapshotBuffer));
+  for(i = 0; i < 3; i++)
+  {
+    snapshot = &buffer->snapshots[i];
+    allocateSnapshot(snapshot, count);
+    snapshot->count = 0;
+    snapshot->ids = 0;
+    clearPlanetStats(&snapshot->stats);
+  }
+  
+  // the physics thread writes the back snapshot, the display reads the front
+  buffer->back = 0;
+  buffer->ready = 1;
+  buffer->front = 2;
+  
+  return buffer;
+}
 
-  pi = count * (rand() / (RAND_MAX + 1.0));
-  planetData[pi]->x = 800 - cx;
-  planetData[pi]->y = 0 - cy;
-  planetData[pi]->mass = 2e14;
-  planetData[pi]->velocityX = 0;
-  planetData[pi]->velocityY = -4.5;
 
-  pi = count * (rand() / (RAND_MAX + 1.0));
-  planetData[pi]->x = 0 - cx;
-  planetData[pi]->y = 1200 - cy;
-  planetData[pi]->mass = 5e8;
-  planetData[pi]->velocityX = 3.25;
-  planetData[pi]->velocityY = 0;
+/**
+ * Allocate the arrays of a snapshot.
+ * 
+ * @param snapshot
+ * @param size The number of planets it can hold.
+ */
+void allocateSnapshot(planetSnapshot *snapshot, int size)
+{
+  snapshot->x = (double *) allocateStoreArray(size, sizeof(double));
+  snapshot->y = (double *) allocateStoreArray(size, sizeof(double));
+  snapshot->mass = (double *) allocateStoreArray(size, sizeof(double));
+  snapshot->velocityX = (double *) allocateStoreArray(size, sizeof(double));
+  snapshot->velocityY = (double *) allocateStoreArray(size, sizeof(double));
+  snapshot->accelerationX = (double *) allocateStoreArray(size, sizeof(double));
+  snapshot->accelerationY = (double *) allocateStoreArray(size, sizeof(double));
+  snapshot->flash = (int *) allocateStoreArray(size, sizeof(int));
+  snapshot->id = (int *) allocateStoreArray(size, sizeof(int));
+  snapshot->size = size;
 }
 
 
 /**
- * Create Sol planetary system out to Saturn.
+ * Free the arrays of a snapshot.
  * 
- * @param planetData
- * @param count
- * @param cx
- * @param cy
+ * @param snapshot
  */
-void createPlanetarySystem(planet *planetData[], int count, int cx, int cy)
+void freeSnapshot(planetSnapshot *snapshot)
 {
-  int pi;
+  free(snapshot->x);
+  free(snapshot->y);
+  free(snapshot->mass);
+  free(snapshot->velocityX);
+  free(snapshot->velocityY);
+  free(snapshot->accelerationX);
+  free(snapshot->accelerationY);
+  free(snapshot->flash);
+  free(snapshot->id);
+}
 
-  // sol
-  pi =  0; //count * (rand() / (RAND_MAX + 1.0));
-  planetData[pi]->x = 0 - cx;
-  planetData[pi]->y = 0 - cy;
-  planetData[pi]->mass = 1.9891e30;
-  planetData[pi]->velocityX = 0;
-  planetData[pi]->velocityY = 0;
 
-  // mercury
-  pi = 1; //count * (rand() / (RAND_MAX + 1.0));
-  planetData[pi]->x = 0 - cx;
-  planetData[pi]->y = 57909050e3 - cy;
-  planetData[pi]->mass = 3.3022e23;
-  planetData[pi]->velocityX = 47.87e3;
-  planetData[pi]->velocityY = 0;
+/**
+ * Copy the planets into the back snapshot and swap it with the ready one.
+ * 
+ * @param buffer
+ * @param planets
+ */
+void publishSnapshot(snapshotBuffer *buffer, planetStore *planets)
+{
+  planetSnapshot *snapshot;
+  size_t size;
+  
+  snapshot = &buffer->snapshots[buffer->back];
+  
+  // the back snapshot belongs to this thread, so it can grow in place
+  if ( planets->count > snapshot->size )
+  {
+    freeSnapshot(snapshot);
+    allocateSnapshot(snapshot, planets->capacity);
+  }
+  
+  size = planets->count * sizeof(double);
+  memcpy(snapshot->x, planets->x, size);
+  memcpy(snapshot->y, planets->y, size);
+  memcpy(snapshot->mass, planets->mass, size);
+  memcpy(snapshot->velocityX, planets->velocityX, size);
+  memcpy(snapshot->velocityY, planets->velocityY, size);
+  memcpy(snapshot->accelerationX, planets->accelerationX, size);
+  memcpy(snapshot->accelerationY, planets->accelerationY, size);
+  memcpy(snapshot->flash, planets->flash, planets->count * sizeof(int));
+  memcpy(snapshot->id, planets->id, planets->count * sizeof(int));
+  snapshot->count = planets->count;
+  snapshot->ids = planets->idCount;
+  snapshot->stats = planets->stats;
+  
+  // publish, the fresh bit tells the display there is a new step
+  buffer->back = __atomic_exchange_n(&buffer->ready, buffer->back | SNAPSHOT_FRESH, __ATOMIC_ACQ_REL) & ~SNAPSHOT_FRESH;
+}
 
-  // venus
-  pi = 2; //count * (rand() / (RAND_MAX + 1.0));
-  planetData[pi]->x = -108209184e3 - cx;
-  planetData[pi]->y = 0 - cy;
-  planetData[pi]->mass = 4.8685e24;
-  planetData[pi]->velocityX = 0;
-  planetData[pi]->velocityY = 35.02e3;
 
-  //earth
-  pi = 3; //count * (rand() / (RAND_MAX + 1.0));
-  planetData[pi]->x = 149597887e3 - cx;
-  planetData[pi]->y = 0 - cy;
-  planetData[pi]->mass = 5.9736e24;
-  planetData[pi]->velocityX = 0;
-  planetData[pi]->velocityY = -29.783e3;
+/**
+ * Swap the latest published snapshot to the front if there is a new one.
+ * 
+ * @param buffer
+ * @return 1 when the front snapshot changed.
+ */
+int takeSnapshot(snapshotBuffer *buffer)
+{
+  if ( !(__atomic_load_n(&buffer->ready, __ATOMIC_ACQUIRE) & SNAPSHOT_FRESH) )
+  {
+    return 0;
+  }
+  
+  buffer->front = __atomic_exchange_n(&buffer->ready, buffer->front, __ATOMIC_ACQ_REL) & ~SNAPSHOT_FRESH;
+  
+  return 1;
+}
 
-  //moon
-  pi = 4; //count * (rand() / (RAND_MAX + 1.0));
-  planetData[pi]->x = 149597887e3 + 384400e3 - cx; // + 384400e3
-  planetData[pi]->y = 0 - cy;
-  planetData[pi]->mass = 7.3477e22;
-  planetData[pi]->velocityX = 0;
-  planetData[pi]->velocityY = -29.783e3 - 1.022e3;
 
-  // mars
-  pi = 5; //count * (rand() / (RAND_MAX + 1.0));
-  planetData[pi]->x = 0 - cx;
-  planetData[pi]->y = 227939150e3 - cy;
-  planetData[pi]->mass = 6.4185e23;
-  planetData[pi]->velocityX = 24.077e3;
-  planetData[pi]->velocityY = 0;
+/**
+ * Create an empty draw list.
+ * 
+ * @return 
+ */
+drawList * createDrawList(void)
+{
+  drawList *list;
+  
+  list = (drawList *) malloc(sizeof(drawList));
+  list->capacity = DRAW_LIST_SIZE;
+  list->shapes = (drawShape *) malloc(list->capacity * sizeof(drawShape));
+  list->count = 0;
+  list->heatCapacity = DRAW_LIST_SIZE;
+  list->heat = (heatPoint *) malloc(list->heatCapacity * sizeof(heatPoint));
+  list->heatCount = 0;
+  list->heatUnit = 1;
+  list->arcs = NULL;
+  list->segments = NULL;
+  list->batchCapacity = 0;
+  
+  return list;
+}
 
-  // jupiter
-  pi = 6; //count * (rand() / (RAND_MAX + 1.0));
-  planetData[pi]->x = 0 - cx;
-  planetData[pi]->y = -778547200e3 - cy;
-  planetData[pi]->mass = 1.8986e27;
-  planetData[pi]->velocityX = -13.07e3;
-  planetData[pi]->velocityY = 0;
 
-  // saturn
-  pi = 7; //count * (rand() / (RAND_MAX + 1.0));
-  planetData[pi]->x = 0 - cx;
-  planetData[pi]->y = 1433449369.5e3 - cy;
-  planetData[pi]->mass = 5.6846e26;
-  planetData[pi]->velocityX = 9.69e3;
-  planetData[pi]->velocityY = 0;
+/**
+ * Append a shape to the draw list, growing it when full.
+ * 
+ * @param list
+ * @param shape The SHAPE_ constant.
+ * @param color The COLOR_ constant.
+ * @return The new shape.
+ */
+drawShape * addDrawShape(drawList *list, int shape, int color)
+{
+  drawShape *added;
+  
+  if ( list->count == list->capacity )
+  {
+    list->capacity *= 2;
+    list->shapes = (drawShape *) realloc(list->shapes, list->capacity * sizeof(drawShape));
+  }
+  
+  added = &list->shapes[list->count++];
+  added->shape = shape;
+  added->color = color;
+  
+  return added;
 }
 
 
 /**
- * Create molniya orbit around earth.
+ * Add a filled disc with a black border.
  * 
- * @param planetData
- * @param count
- * @param cx
- * @param cy
+ * @param list
+ * @param color The COLOR_ constant of the fill.
+ * @param x Left edge in window pixels.
+ * @param y Top edge in window pixels.
+ * @param size Width of the disc in pixels.
  */
-void createMolniyaOrbit(planet *planetData[], int count, int cx, int cy)
+void addDrawDisc(drawList *list, int color, double x, double y, int size)
 {
-  int pi;
+  drawShape *disc;
+  
+  // whole pixels as Xlib would take them
+  disc = addDrawShape(list, SHAPE_DISC, color);
+  disc->x0 = (int) x;
+  disc->y0 = (int) y;
+  disc->size = size;
+}
 
-  pi = 3; //count * (rand() / (RAND_MAX + 1.0));
-  planetData[pi]->x = 0 - cx;
-  planetData[pi]->y = 0 - cy;
-  planetData[pi]->mass = 5.9736e24;
-  planetData[pi]->velocityX = 0;
-  planetData[pi]->velocityY = 0;
 
-  //satellite in molniya orbit
-  pi = 4; //count * (rand() / (RAND_MAX + 1.0));
-  planetData[pi]->x = 6929e3 - cx; // + 384400e3
-  planetData[pi]->y = 0 - cy;
-  planetData[pi]->mass = 11000;
-  planetData[pi]->velocityX = 0;
-  planetData[pi]->velocityY = -10.0125e3;
+/**
+ * Add a line, the ends can be far outside the window.
+ * 
+ * @param list
+ * @param color The COLOR_ constant.
+ * @param x0
+ * @param y0
+ * @param x1
+ * @param y1
+ */
+void addDrawLine(drawList *list, int color, double x0, double y0, double x1, double y1)
+{
+  drawShape *line;
+  
+  line = addDrawShape(list, SHAPE_LINE, color);
+  line->x0 = x0;
+  line->y0 = y0;
+  line->x1 = x1;
+  line->y1 = y1;
 }
 
 
 /**
- * calculate the distance between two planets
+ * Add a planet to the density map.
  * 
- * @param p1
- * @param p2
- * @return 
+ * @param list
+ * @param x Window position.
+ * @param y
+ * @param mass
  */
-void calculateDistance(int p1, int p2, planet *planetData[])
+void addHeatPoint(drawList *list, double x, double y, double mass)
 {
-  planetData[p1]->calcDistance = sqrt(pow(planetData[p1]->x - planetData[p2]->x, 2) + pow(planetData[p1]->y - planetData[p2]->y, 2));
+  if ( list->heatCount == list->heatCapacity )
+  {
+    list->heatCapacity *= 2;
+    list->heat = (heatPoint *) realloc(list->heat, list->heatCapacity * sizeof(heatPoint));
+  }
+  
+  list->heat[list->heatCount].x = (int) x;
+  list->heat[list->heatCount].y = (int) y;
+  list->heat[list->heatCount].mass = mass;
+  list->heatCount++;
 }
 
 
+// order the Xlib batches are drawn in, large discs first so small planets
+// stay visible on top of stars, and flashes last so a merge shows over
+// everything
+int batchOrder[COLOR_COUNT] = {
+  COLOR_STAR,
+  COLOR_BLUE,
+  COLOR_GREEN,
+  COLOR_RED,
+  COLOR_WHITE,
+  COLOR_BLACK,
+  COLOR_BACKGROUND,
+  COLOR_FLASH
+};
+
+
 /**
- * calculate the gravitational acceleration between two planets
+ * Draw the list with Xlib requests, used when the shared memory
+ * framebuffer is not available. The shapes are sorted into one batch per
+ * color, so a color costs two XSetForeground, one XFillArcs and one
+ * XDrawArcs for the black borders, or one XDrawSegments, however many
+ * planets it has. Each color's borders follow its discs, so a disc drawn
+ * over another hides its border as it does in the framebuffer.
  * 
- * @param p1
- * @param p2
- * @return 
+ * @param display
+ * @param drawable
+ * @param gc
+ * @param colors The allocated COLOR_ colors.
+ * @param list
+ * @param width Window width, lines are clipped to the window to fit the
+ *              16 bit coordinates of the requests.
+ * @param height Window height.
  */
-void calculateGravitationalAcceleration(int p1, int p2, planet *planetData[])
+void drawXlibShapes(Display *display, Drawable drawable, GC gc, XColor *colors, drawList *list, int width, int height)
 {
-  calculateDistance(p1, p2, planetData);
+  drawShape *shape;
+  double x0, y0, x1, y1;
+  int i, r, n, first;
   
-  if ( planetData[p1]->calcDistance < planetData[p1]->nearestDistance )
+  if ( list->batchCapacity < list->count )
   {
-    planetData[p1]->nearestDistance = planetData[p1]->calcDistance;
+    list->batchCapacity = list->capacity;
+    list->arcs = (XArc *) realloc(list->arcs, list->batchCapacity * sizeof(XArc));
+    list->segments = (XSegment *) realloc(list->segments, list->batchCapacity * sizeof(XSegment));
+  }
+  
+  // discs of each color, keeping list order within a color
+  n = 0;
+  for(r = 0; r < COLOR_COUNT; r++)
+  {
+    first = n;
+    for(i = 0; i < list->count; i++)
+    {
+      shape = &list->shapes[i];
+      if ( shape->shape == SHAPE_DISC && shape->color == batchOrder[r] )
+      {
+        list->arcs[n].x = shape->x0;
+        list->arcs[n].y = shape->y0;
+        list->arcs[n].width = shape->size;
+        list->arcs[n].height = shape->size;
+        list->arcs[n].angle1 = 0;
+        list->arcs[n].angle2 = 360 * 64;
+        n++;
+      }
+    }
+    
+    if ( n > first )
+    {
+      XSetForeground(display, gc, colors[batchOrder[r]].pixel);
+      XFillArcs(display, drawable, gc, list->arcs + first, n - first);
+      XSetForeground(display, gc, colors[COLOR_BLACK].pixel);
+      XDrawArcs(display, drawable, gc, list->arcs + first, n - first);
+    }
   }
   
-  planetData[p1]->calcGravity = G * (planetData[p1]->mass * planetData[p2]->mass / pow(planetData[p1]->calcDistance, 2));
+  // lines of each color
+  for(r = 0; r < COLOR_COUNT; r++)
+  {
+    n = 0;
+    for(i = 0; i < list->count; i++)
+    {
+      shape = &list->shapes[i];
+      if ( shape->shape != SHAPE_LINE || shape->color != batchOrder[r] ) continue;
+      
+      x0 = shape->x0;
+      y0 = shape->y0;
+      x1 = shape->x1;
+      y1 = shape->y1;
+      if ( !isfinite(x0) || !isfinite(y0) || !isfinite(x1) || !isfinite(y1) ) continue;
+      if ( !clipLine(&x0, &y0, &x1, &y1, width, height) ) continue;
+      
+      list->segments[n].x1 = x0;
+      list->segments[n].y1 = y0;
+      list->segments[n].x2 = x1;
+      list->segments[n].y2 = y1;
+      n++;
+    }
+    
+    if ( n > 0 )
+    {
+      XSetForeground(display, gc, colors[batchOrder[r]].pixel);
+      XDrawSegments(display, drawable, gc, list->segments, n);
+    }
+  }
 }
 
 
+// set by handleShmError when attaching the shared memory fails
+int shmError = 0;
+
+
 /**
- * calculate the polar direction of the gravitational force between two planets
+ * X error handler used while attaching shared memory, a display on
+ * another machine refuses the segment.
  * 
- * @param p1
- * @param p2
+ * @param display
+ * @param error
  * @return 
  */
-void calculateGravitationalDirection(int p1, int p2, planet *planetData[])
+int handleShmError(Display *display, XErrorEvent *error)
+{
+  (void) display;
+  (void) error;
+  shmError = 1;
+  
+  return 0;
+}
+
+
+/**
+ * Create a software framebuffer and start its render threads.
+ * 
+ * @param display
+ * @param screen
+ * @param width Window width.
+ * @param height Window height.
+ * @param threads The number of render threads, 0 to draw on the caller.
+ * @param shared Put the framebuffer in MIT-SHM shared memory.
+ * @param colors The allocated COLOR_ colors.
+ * @param list Draw list to rasterize each frame.
+ * @return The renderer, NULL when the display cannot take the framebuffer.
+ */
+frameRenderer * createFrameRenderer(Display *display, int screen, int width, int height, int threads, int shared, XColor *colors, drawList *list)
 {
-  planetData[p1]->calcDirection = atan2(planetData[p2]->y - planetData[p1]->y, planetData[p2]->x - planetData[p1]->x);
-  if( isinf(planetData[p1]->calcDirection) )
+  frameRenderer *renderer;
+  renderArgs *threadArgs;
+  pthread_t thread;
+  int i;
+  
+  if ( shared && !XShmQueryExtension(display) )
+  {
+    return NULL;
+  }
+  
+  // pixels are composed from the color masks of the visual
+  if ( DefaultVisual(display, screen)->class != TrueColor )
+  {
+    return NULL;
+  }
+  
+  renderer = (frameRenderer *) malloc(sizeof(frameRenderer));
+  renderer->shared = shared;
+  renderer->heat = NULL;
+  if ( !createFrameImage(renderer, display, screen, width, height) )
   {
-    planetData[p1]->calcDirection = M_PI / 2;
+    free(renderer);
+    return NULL;
   }
-  else if( isnan(planetData[p1]->calcDirection) && (planetData[p2]->x - planetData[p1]->x) > 0 )
+  
+  for(i = 0; i < COLOR_COUNT; i++)
   {
-    planetData[p1]->calcDirection = 0;
+    renderer->colors[i] = colors[i].pixel;
   }
-  else if( isnan(planetData[p1]->calcDirection) && (planetData[p2]->x - planetData[p1]->x) < 0 )
+  createHeatRamp(renderer, colors);
+  renderer->list = list;
+  renderer->threads = threads;
+  
+  if ( threads > 0 )
   {
-    planetData[p1]->calcDirection = M_PI;
+    // render threads wait on the barrier with the display thread and on
+    // their own barrier between the density map passes
+    pthread_barrier_init(&renderer->barrier, NULL, threads + 1);
+    pthread_barrier_init(&renderer->bandBarrier, NULL, threads);
+    renderer->bandMax = (float *) malloc(threads * sizeof(float));
+    threadArgs = (renderArgs *) malloc(threads * sizeof(renderArgs));
+    for(i = 0; i < threads; i++)
+    {
+      threadArgs[i].renderer = renderer;
+      threadArgs[i].thread = i;
+      pthread_create(&thread, NULL, &renderWorker, &threadArgs[i]);
+    }
   }
+  
+  return renderer;
 }
 
 
 /**
- * add the gravitational acceleration from planet 2 on planet 1 parameters
+ * Create the framebuffer image, in a new shared memory segment attached
+ * to the X server for a shared renderer, and the density map behind it.
  * 
- * @param p1
- * @param p2
+ * @param renderer
+ * @param display
+ * @param screen
+ * @param width
+ * @param height
+ * @return 1 when the image was created.
  */
-void addGravitationalAcceleration(int p1, int p2, planet *planetData[])
+int createFrameImage(frameRenderer *renderer, Display *display, int screen, int width, int height)
 {
-  // calculate the polar acceleration between two planets
-  calculateGravitationalAcceleration(p1, p2, planetData);
-  calculateGravitationalDirection(p1, p2, planetData);
+  XImage *image;
+  XErrorHandler handler;
+  unsigned int one;
   
-  planetData[p1]->calcAccelerationX = (planetData[p1]->calcGravity / planetData[p1]->mass) * cos(planetData[p1]->calcDirection);
-  if( isnan(planetData[p1]->calcAccelerationX) )
+  if ( renderer->shared )
+  {
+    image = XShmCreateImage(display, DefaultVisual(display, screen), DefaultDepth(display, screen), 
+                            ZPixmap, NULL, &renderer->segment, width, height);
+  }
+  else
+  {
+    image = XCreateImage(display, DefaultVisual(display, screen), DefaultDepth(display, screen), 
+                         ZPixmap, 0, NULL, width, height, 32, 0);
+  }
+  if ( image == NULL )
   {
-    planetData[p1]->calcAccelerationX = 0;
+    return 0;
   }
-  else if( isinf(planetData[p1]->calcAccelerationX) )
+  
+  // pixels are written as native 32 bit words
+  one = 1;
+  if ( image->bits_per_pixel != 32 || image->byte_order != (*(char *)&one ? LSBFirst : MSBFirst) )
   {
-    planetData[p1]->calcAccelerationX = planetData[p1]->calcGravity / planetData[p1]->mass;
+    XDestroyImage(image);
+    return 0;
   }
   
-  planetData[p1]->calcAccelerationY = (planetData[p1]->calcGravity / planetData[p1]->mass) * sin(planetData[p1]->calcDirection);
-  if( isnan(planetData[p1]->calcAccelerationY) )
+  if ( !renderer->shared )
   {
-    planetData[p1]->calcAccelerationY = 0;
+    // XDestroyImage frees the pixels
+    image->data = (char *) malloc(image->bytes_per_line * image->height);
   }
-  else if( isinf(planetData[p1]->calcAccelerationY) )
+  else
   {
-    planetData[p1]->calcAccelerationY = planetData[p1]->calcGravity / planetData[p1]->mass;
+    renderer->segment.shmid = shmget(IPC_PRIVATE, image->bytes_per_line * image->height, IPC_CREAT | 0600);
+    if ( renderer->segment.shmid < 0 )
+    {
+      XDestroyImage(image);
+      return 0;
+    }
+    renderer->segment.shmaddr = image->data = shmat(renderer->segment.shmid, NULL, 0);
+    renderer->segment.readOnly = False;
+    if ( image->data == (char *) -1 )
+    {
+      shmctl(renderer->segment.shmid, IPC_RMID, NULL);
+      image->data = NULL;
+      XDestroyImage(image);
+      return 0;
+    }
+    
+    // wait for the server's answer so a refusal lands in our handler
+    shmError = 0;
+    handler = XSetErrorHandler(handleShmError);
+    XShmAttach(display, &renderer->segment);
+    XSync(display, False);
+    XSetErrorHandler(handler);
+    
+    // the segment goes away once both sides detach
+    shmctl(renderer->segment.shmid, IPC_RMID, NULL);
+    if ( shmError )
+    {
+      shmdt(renderer->segment.shmaddr);
+      image->data = NULL;
+      XDestroyImage(image);
+      return 0;
+    }
   }
   
-  planetData[p1]->acceleration.accelerationX += planetData[p1]->calcAccelerationX;
-  planetData[p1]->acceleration.accelerationY += planetData[p1]->calcAccelerationY;
+  renderer->image = image;
+  renderer->heat = (float *) realloc(renderer->heat, (size_t)width * height * sizeof(float));
+  
+  return 1;
 }
 
 
 /**
- * Adjust planet velocity and move based on time factor.
+ * Detach and free the framebuffer image.
+ * 
+ * @param renderer
+ * @param display
  */
-void movePlanets(double timeFactor, planet *planetData[], int count)
+void destroyFrameImage(frameRenderer *renderer, Display *display)
 {
-  int pi;
-  
-  // move planets
-  for(pi = 0; pi < count; pi++) {
-    if( planetData[pi]->mass > 0 ) {
-      // update planet's velocity with new acceleration
-      planetData[pi]->velocityX += planetData[pi]->acceleration.accelerationX * timeFactor;
-      planetData[pi]->velocityY += planetData[pi]->acceleration.accelerationY * timeFactor;
-
-      // move planet position
-      planetData[pi]->x += planetData[pi]->velocityX * timeFactor;
-      planetData[pi]->y += planetData[pi]->velocityY * timeFactor;
-    }
+  if ( renderer->shared )
+  {
+    XShmDetach(display, &renderer->segment);
+    XSync(display, False);
+    shmdt(renderer->segment.shmaddr);
+    renderer->image->data = NULL;
   }
+  XDestroyImage(renderer->image);
+  renderer->image = NULL;
 }
 
 
 /**
- * Calculate collisions between planets.
+ * Fill the density map color ramp, it runs from the background through
+ * the green of small planets and the star yellow to white.
+ * 
+ * @param renderer
+ * @param colors The allocated COLOR_ colors.
  */
-void calculateCollisions(planet *planetData[], int count)
+void createHeatRamp(frameRenderer *renderer, XColor *colors)
 {
-  int pi, vi;
-  double dist, massMax;
+  int stops[4] = {COLOR_BACKGROUND, COLOR_GREEN, COLOR_STAR, COLOR_WHITE};
+  unsigned long masks[3], mask, pixel;
+  double rgb[3], v, f;
+  int i, j, s, shift;
+  XColor *from, *to;
   
-  massMax = getMassMax(planetData, count);
+  masks[0] = renderer->image->red_mask;
+  masks[1] = renderer->image->green_mask;
+  masks[2] = renderer->image->blue_mask;
   
-  // calculate collisions
-  for(pi = 0; pi < count; pi++) {
-    // only need to process if this planet not consumed and worst case planet came too close
-    if ( planetData[pi]->mass > 0 && inCollisionRange(planetData[pi]->mass, massMax, planetData[pi]->nearestDistance) )
-    {
-       // check all planets to find collisions
-      for(vi = 0; vi < count; vi++) {
-        // not self, other planet has mass, and other planet mass is less than or equal
-        if ( vi != pi && planetData[vi]->mass > 0 && planetData[vi]->mass <= planetData[pi]->mass )
-        {
-          calculateDistance(pi, vi, planetData);
-          dist = planetData[pi]->calcDistance;
-
-          // simple collision
-          if( inCollisionRange(planetData[pi]->mass, planetData[vi]->mass, dist) ) {
-            // collision
-            planetData[pi]->velocityX = (planetData[pi]->velocityX * planetData[pi]->mass + planetData[vi]->velocityX * planetData[vi]->mass) / (planetData[pi]->mass + planetData[vi]->mass);
-            planetData[pi]->velocityY = (planetData[pi]->velocityY * planetData[pi]->mass + planetData[vi]->velocityY * planetData[vi]->mass) / (planetData[pi]->mass + planetData[vi]->mass);
-            planetData[pi]->mass += planetData[vi]->mass;
-            
-            planetData[vi]->mass = 0;
-            planetData[pi]->flash = 10;
-          }
-        }
-      }
+  for(i = 0; i < HEAT_LEVELS; i++)
+  {
+    // position between the two stops around this level
+    v = 3.0 * i / (HEAT_LEVELS - 1);
+    s = v >= 3 ? 2 : (int) v;
+    f = v - s;
+    from = &colors[stops[s]];
+    to = &colors[stops[s + 1]];
+    rgb[0] = (from->red + f * (to->red - from->red)) / 65535;
+    rgb[1] = (from->green + f * (to->green - from->green)) / 65535;
+    rgb[2] = (from->blue + f * (to->blue - from->blue)) / 65535;
+    
+    pixel = 0;
+    for(j = 0; j < 3; j++)
+    {
+      mask = masks[j];
+      if ( mask == 0 ) continue;
+      for(shift = 0; !(mask & 1); shift++) mask >>= 1;
+      pixel |= (unsigned long)(rgb[j] * mask + 0.5) << shift;
     }
+    renderer->heatColors[i] = pixel;
   }
 }
 
 
 /**
- * determine if the two given masses within the given distance are considered to be in a collision
+ * Rasterize the draw list into the framebuffer on the render threads and
+ * wait for them to finish.
  * 
- * @param mass1
- * @param mass2
- * @param distance
- * @return 
+ * @param renderer
  */
-int inCollisionRange(double mass1, double mass2, double distance)
+void renderFrame(frameRenderer *renderer)
 {
-  double sphereradc; // calculated constant for sphere radius formula
-  sphereradc = (4 / 3 * M_PI) * 5000000000; // multiplied by constant for dirty density calc
-
-  if ( cbrt(mass1 / sphereradc) + cbrt(mass2 / sphereradc) >= distance )
+  float max;
+  
+  // without render threads only the density map is drawn here
+  if ( renderer->threads == 0 )
   {
-    // collision
-    return 1;
+    max = accumulateHeat(renderer, 0, renderer->image->height);
+    toneMapHeat(renderer, 0, renderer->image->height, max);
+    return;
   }
   
-  return 0;
+  // wait for all threads to start drawing
+  pthread_barrier_wait(&renderer->barrier);
+  
+  // wait for all threads to finish drawing
+  pthread_barrier_wait(&renderer->barrier);
 }
 
 
 /**
- * Get the mass maximum in the group of planets.
+ * Render thread, rasterizes its own band of rows each frame.
  * 
- * @param planetData
- * @param count
+ * @param args A pointer to a renderArgs struct.
  * @return 
  */
-double getMassMax(planet *planetData[], int count)
+void * renderWorker(void *args)
 {
-  int pi;
-  double massMax = 0;
+  renderArgs *threadArgs;
+  frameRenderer *renderer;
+  int i, top, bottom;
+  float max;
+  
+  threadArgs = (renderArgs *) args;
+  renderer = (*threadArgs).renderer;
   
-  // find mass max
-  for(pi = 0; pi < count; pi++) {
-    if( planetData[pi]->mass > massMax ) massMax = planetData[pi]->mass;
+  while (1)
+  {
+    pthread_barrier_wait(&renderer->barrier);
+    
+    top = (long)renderer->image->height * (*threadArgs).thread / renderer->threads;
+    bottom = (long)renderer->image->height * ((*threadArgs).thread + 1) / renderer->threads;
+    
+    // the density map is scaled to the densest pixel of every band
+    if ( renderer->list->heatCount > 0 )
+    {
+      renderer->bandMax[(*threadArgs).thread] = accumulateHeat(renderer, top, bottom);
+      pthread_barrier_wait(&renderer->bandBarrier);
+      
+      max = 0;
+      for(i = 0; i < renderer->threads; i++)
+      {
+        if ( renderer->bandMax[i] > max ) max = renderer->bandMax[i];
+      }
+      toneMapHeat(renderer, top, bottom, max);
+    }
+    else
+    {
+      clearBand(renderer, top, bottom);
+    }
+    rasterizeBand(renderer, top, bottom);
+    
+    pthread_barrier_wait(&renderer->barrier);
   }
   
-  return massMax;
+  return NULL;
 }
 
 
 /**
- * Get the mass minimum in the group of planets.
+ * Fill a band of rows with the background.
  * 
- * @param planetData
- * @param count
- * @return 
+ * @param renderer
+ * @param top First row of the band.
+ * @param bottom One past the last row.
  */
-double getMassMin(planet *planetData[], int count)
+void clearBand(frameRenderer *renderer, int top, int bottom)
 {
-  int pi;
-  double massMin = DBL_MAX;
+  XImage *image;
+  unsigned int *row;
+  int x, y;
   
-  // find mass max
-  for(pi = 0; pi < count; pi++) {
-    if( planetData[pi]->mass < massMin ) massMin = planetData[pi]->mass;
+  image = renderer->image;
+  for(y = top; y < bottom; y++)
+  {
+    row = (unsigned int *) (image->data + (long)y * image->bytes_per_line);
+    for(x = 0; x < image->width; x++)
+    {
+      row[x] = renderer->colors[COLOR_BACKGROUND];
+    }
   }
-  
-  return massMin;
 }
 
 
 /**
- * worker thread
- * 
- * performs gravitational calculations in a multi-thread safe environment
+ * Add up the mass of the density map planets landing on each pixel of a
+ * band of rows.
  * 
- * @param args A pointer to arguments, in this case a calcArgs struct.
- * @return 
+ * @param renderer
+ * @param top First row of the band.
+ * @param bottom One past the last row.
+ * @return The largest pixel mass in the band.
  */
-void * calcWorker(void * args)
+float accumulateHeat(frameRenderer *renderer, int top, int bottom)
 {
-  calcArgs *threadArgs;
-  planet **planetData;  
-  int p, i;
+  drawList *list;
+  float *heat, max;
+  int i, width;
   
-  threadArgs = (calcArgs *) args;
-  planetData = (*threadArgs).planetData;
+  list = renderer->list;
+  width = renderer->image->width;
+  heat = renderer->heat;
+  memset(heat + (long)top * width, 0, (long)(bottom - top) * width * sizeof(float));
   
-  while (1)
+  for(i = 0; i < list->heatCount; i++)
   {
-    p = 0;
-    
-    // wait for for all calculation ready
-    pthread_barrier_wait((*threadArgs).calcBarrier);
+    if ( list->heat[i].y >= top && list->heat[i].y < bottom && list->heat[i].x >= 0 && list->heat[i].x < width )
+    {
+      heat[(long)list->heat[i].y * width + list->heat[i].x] += list->heat[i].mass;
+    }
+  }
+  
+  max = 0;
+  for(i = top * width; i < bottom * width; i++)
+  {
+    if ( heat[i] > max ) max = heat[i];
+  }
+  
+  return max;
+}
+
+
+/**
+ * Color a band of rows from the density map on a log scale, so a pixel
+ * holding a single small planet still shows next to a dense core.
+ * 
+ * @param renderer
+ * @param top First row of the band.
+ * @param bottom One past the last row.
+ * @param max The largest pixel mass in the whole map.
+ */
+void toneMapHeat(frameRenderer *renderer, int top, int bottom, float max)
+{
+  XImage *image;
+  unsigned int *row;
+  float *heat;
+  double unit, scale;
+  int x, y, level;
+  
+  image = renderer->image;
+  unit = renderer->list->heatUnit;
+  scale = max > 0 ? (HEAT_LEVELS - 1) / log1p(max / unit) : 0;
   
-    while (p < (*threadArgs).count)
+  for(y = top; y < bottom; y++)
+  {
+    row = (unsigned int *) (image->data + (long)y * image->bytes_per_line);
+    heat = renderer->heat + (long)y * image->width;
+    for(x = 0; x < image->width; x++)
     {
-      p = getNextCalcIndex(p, threadArgs);
-      
-      if ( p < (*threadArgs).count )
+      if ( heat[x] > 0 )
       {
-        // reset gravity values for our planet
-        planetData[p]->acceleration.accelerationX = 0;
-        planetData[p]->acceleration.accelerationY = 0;
-        planetData[p]->nearestDistance = DBL_MAX;
-        
-        // calculate acceleration between individual planets and our planet
-        for(i = 0; i < (*threadArgs).count; i++) {
-          if( i != p && planetData[i]->mass > 0 ) {
-            addGravitationalAcceleration(p, i, planetData);
-          }
-        }
+        level = (int) (log1p(heat[x] / unit) * scale);
+        if ( level < 1 ) level = 1;
+        if ( level >= HEAT_LEVELS ) level = HEAT_LEVELS - 1;
+        row[x] = renderer->heatColors[level];
       }
-    } // planet gravitational calculation loop
-    
-    // wait for for all calculations finished
-    pthread_barrier_wait((*threadArgs).calcBarrier);
-    
-  } // main loop
+      else
+      {
+        row[x] = renderer->colors[COLOR_BACKGROUND];
+      }
+    }
+  }
 }
 
 
 /**
- * thread safe method to lock a specific planet index for calculations
+ * Draw every shape that reaches into a band of rows, in list order so
+ * later shapes cover earlier ones as with Xlib.
  * 
- * @param p The starting index to use for the look up.
- * @param planetData Pointer to the planet data array.
- * @return 
+ * @param renderer
+ * @param top First row of the band.
+ * @param bottom One past the last row.
  */
-int getNextCalcIndex(int p, calcArgs *calcThreadArgs)
+void rasterizeBand(frameRenderer *renderer, int top, int bottom)
 {
+  drawShape *shape;
   int i;
   
-  pthread_mutex_lock((*calcThreadArgs).calcMutex);
-  
-  for(i = p; i < (*calcThreadArgs).count; i++)
+  for(i = 0; i < renderer->list->count; i++)
   {
-    if ( (*calcThreadArgs).planetData[i]->calc )
+    shape = &renderer->list->shapes[i];
+    if ( shape->shape == SHAPE_DISC )
     {
-      (*calcThreadArgs).planetData[i]->calc = 0;
-      pthread_mutex_unlock((*calcThreadArgs).calcMutex);
-      return i;
+      rasterizeDisc(renderer, shape, top, bottom);
     }
+    else
+    {
+      rasterizeLine(renderer, shape, top, bottom);
+    }
+  }
+}
+
+
+/**
+ * Draw the rows of a disc and its one pixel black border that fall in the
+ * band. Pixels are inside when their centers are, like XFillArc.
+ * 
+ * @param renderer
+ * @param shape
+ * @param top First row of the band.
+ * @param bottom One past the last row.
+ */
+void rasterizeDisc(frameRenderer *renderer, drawShape *shape, int top, int bottom)
+{
+  XImage *image;
+  unsigned int *row;
+  double r, cx, cy, dx, dy, inner, outer;
+  int x, y, first, last, left, right;
+  
+  image = renderer->image;
+  r = shape->size / 2.0;
+  cx = shape->x0 + r;
+  cy = shape->y0 + r;
+  
+  first = (int) floor(cy - r - 0.5);
+  last = (int) ceil(cy + r + 0.5);
+  if ( first < top ) first = top;
+  if ( last > bottom ) last = bottom;
+  
+  for(y = first; y < last; y++)
+  {
+    dy = y + 0.5 - cy;
+    if ( fabs(dy) > r + 0.5 ) continue;
+    
+    // half widths of the outline and of the fill on this row
+    outer = sqrt((r + 0.5) * (r + 0.5) - dy * dy);
+    inner = fabs(dy) < r - 0.5 ? sqrt((r - 0.5) * (r - 0.5) - dy * dy) : -1;
+    
+    left = (int) ceil(cx - outer - 0.5);
+    right = (int) floor(cx + outer - 0.5);
+    if ( left < 0 ) left = 0;
+    if ( right >= image->width ) right = image->width - 1;
+    
+    row = (unsigned int *) (image->data + (long)y * image->bytes_per_line);
+    for(x = left; x <= right; x++)
+    {
+      dx = fabs(x + 0.5 - cx);
+      row[x] = dx <= inner ? renderer->colors[shape->color] : renderer->colors[COLOR_BLACK];
+    }
+  }
+}
+
+
+/**
+ * Draw the pixels of a line that fall in the band. The line is clipped to
+ * the whole framebuffer first so every band steps along the same pixels.
+ * 
+ * @param renderer
+ * @param shape
+ * @param top First row of the band.
+ * @param bottom One past the last row.
+ */
+void rasterizeLine(frameRenderer *renderer, drawShape *shape, int top, int bottom)
+{
+  XImage *image;
+  double x0, y0, x1, y1, dx, dy, a, b, t;
+  int x, y, i, steps, first, last;
+  
+  image = renderer->image;
+  x0 = shape->x0;
+  y0 = shape->y0;
+  x1 = shape->x1;
+  y1 = shape->y1;
+  if ( !isfinite(x0) || !isfinite(y0) || !isfinite(x1) || !isfinite(y1) ) return;
+  if ( !clipLine(&x0, &y0, &x1, &y1, image->width, image->height) ) return;
+  
+  dx = x1 - x0;
+  dy = y1 - y0;
+  steps = (int) ceil(fmax(fabs(dx), fabs(dy)));
+  if ( steps == 0 ) steps = 1;
+  
+  // only step through the part of the line in our band
+  first = 0;
+  last = steps;
+  if ( dy != 0 )
+  {
+    a = (top - 0.5 - y0) / dy * steps;
+    b = (bottom - 0.5 - y0) / dy * steps;
+    if ( a > b )
+    {
+      t = a;
+      a = b;
+      b = t;
+    }
+    if ( a > first ) first = (int) floor(a);
+    if ( b < last ) last = (int) ceil(b);
+  }
+  
+  for(i = first; i <= last; i++)
+  {
+    x = (int) floor(x0 + dx * i / steps + 0.5);
+    y = (int) floor(y0 + dy * i / steps + 0.5);
+    if ( y >= top && y < bottom && x >= 0 && x < image->width )
+    {
+      ((unsigned int *) (image->data + (long)y * image->bytes_per_line))[x] = renderer->colors[shape->color];
+    }
+  }
+}
+
+
+/**
+ * Clip a line to the pixels of a width by height framebuffer.
+ * 
+ * @param x0 Updated to the clipped start.
+ * @param y0
+ * @param x1 Updated to the clipped end.
+ * @param y1
+ * @param width
+ * @param height
+ * @return 0 when none of the line is inside.
+ */
+int clipLine(double *x0, double *y0, double *x1, double *y1, double width, double height)
+{
+  double p[4], q[4], t, t0, t1, dx, dy;
+  int i;
+  
+  dx = *x1 - *x0;
+  dy = *y1 - *y0;
+  p[0] = -dx;
+  q[0] = *x0;
+  p[1] = dx;
+  q[1] = width - 1 - *x0;
+  p[2] = -dy;
+  q[2] = *y0;
+  p[3] = dy;
+  q[3] = height - 1 - *y0;
+  
+  // parameters where the line enters and leaves each edge
+  t0 = 0;
+  t1 = 1;
+  for(i = 0; i < 4; i++)
+  {
+    if ( p[i] == 0 )
+    {
+      if ( q[i] < 0 ) return 0;
+      continue;
+    }
+    
+    t = q[i] / p[i];
+    if ( p[i] < 0 )
+    {
+      if ( t > t1 ) return 0;
+      if ( t > t0 ) t0 = t;
+    }
+    else
+    {
+      if ( t < t0 ) return 0;
+      if ( t < t1 ) t1 = t;
+    }
+  }
+  
+  *x1 = *x0 + t1 * dx;
+  *y1 = *y0 + t1 * dy;
+  *x0 = *x0 + t0 * dx;
+  *y0 = *y0 + t0 * dy;
+  
+  return 1;
+}
+
+
+/**
+ * Run one simulation step, the calculation threads find the accelerations
+ * then the planets are moved and collided.
+ * 
+ * @param planets
+ * @param schedule
+ * @param calcBarrier
+ * @param timeFactor
+ * @param integrator The INTEGRATOR_ constant to advance the planets with.
+ * @param times Phase times to add to, NULL when not timing.
+ */
+void stepPlanets(planetStore *planets, calcSchedule *schedule, pthread_barrier_t *calcBarrier, double timeFactor, int integrator, benchTimes *times)
+{
+  double start;
+  double w1, w0;
+  
+  start = 0;
+  switch ( integrator )
+  {
+    case INTEGRATOR_LEAPFROG:
+      stepLeapfrog(planets, schedule, calcBarrier, timeFactor, times);
+      break;
+      
+    case INTEGRATOR_BLOCK:
+      stepBlock(planets, schedule, calcBarrier, timeFactor, times);
+      break;
+      
+    case INTEGRATOR_YOSHIDA:
+      // fourth order composition of three leapfrog steps, the middle one backwards
+      w1 = 1 / (2 - cbrt(2));
+      w0 = 1 - 2 * w1;
+      stepLeapfrog(planets, schedule, calcBarrier, w1 * timeFactor, times);
+      stepLeapfrog(planets, schedule, calcBarrier, w0 * timeFactor, times);
+      stepLeapfrog(planets, schedule, calcBarrier, w1 * timeFactor, times);
+      break;
+      
+    default:
+      // calculate accelerations
+      if ( times ) start = getSeconds();
+      runCalcPass(schedule, calcBarrier, PASS_FORCE, planets->count);
+      if ( times ) times->force += getSeconds() - start;
+      
+      // move planets after calculations
+      if ( times ) start = getSeconds();
+      movePlanets(timeFactor, planets);
+      if ( times ) times->move += getSeconds() - start;
+      
+      // the accelerations were for the old positions
+      planets->accelerationCurrent = 0;
+      break;
+  }
+  
+  // calculate collisions
+  if ( times ) start = getSeconds();
+  runCalcPass(schedule, calcBarrier, PASS_COLLIDE, planets->count);
+  if ( times ) times->collide += getSeconds() - start;
+  
+  // pack the survivors so the next step only covers live planets
+  if ( planets->dead > 0 )
+  {
+    if ( times ) start = getSeconds();
+    compactPlanets(planets);
+    if ( times ) times->move += getSeconds() - start;
+  }
+  
+  planets->step++;
+  planets->time += timeFactor;
+}
+
+
+/**
+ * Advance the planets with one kick-drift-kick leapfrog step. The force
+ * pass at the end leaves the accelerations current for the next step, so
+ * each step costs one force pass.
+ * 
+ * @param planets
+ * @param schedule
+ * @param calcBarrier
+ * @param timeFactor
+ * @param times Phase times to add to, NULL when not timing.
+ */
+void stepLeapfrog(planetStore *planets, calcSchedule *schedule, pthread_barrier_t *calcBarrier, double timeFactor, benchTimes *times)
+{
+  double start;
+  
+  start = 0;
+  
+  // the first step after a change to the planets needs fresh accelerations
+  if ( !planets->accelerationCurrent )
+  {
+    if ( times ) start = getSeconds();
+    runCalcPass(schedule, calcBarrier, PASS_FORCE, planets->count);
+    if ( times ) times->force += getSeconds() - start;
+  }
+  
+  if ( times ) start = getSeconds();
+  kickPlanets(timeFactor / 2, planets);
+  driftPlanets(timeFactor, planets);
+  if ( times ) times->move += getSeconds() - start;
+  
+  if ( times ) start = getSeconds();
+  runCalcPass(schedule, calcBarrier, PASS_FORCE, planets->count);
+  if ( times ) times->force += getSeconds() - start;
+  
+  if ( times ) start = getSeconds();
+  kickPlanets(timeFactor / 2, planets);
+  if ( times ) times->move += getSeconds() - start;
+  
+  planets->accelerationCurrent = 1;
+}
+
+
+/**
+ * Advance the planets with leapfrog steps of individual power of two
+ * fractions of the timestep. Every planet drifts each sub-step, on the
+ * calculation threads, but only the planets at the end of their own step
+ * get new accelerations, the rest act from their drifted positions. The
+ * active list is kept ordered from the shortest step to the longest, so
+ * the planets due at a sub-step are always at its front. The levels are
+ * picked again at the end of each planet's step, down to BLOCK_MAX_LEVEL.
+ * 
+ * @param planets
+ * @param schedule
+ * @param calcBarrier
+ * @param timeFactor
+ * @param times Phase times to add to, NULL when not timing.
+ */
+void stepBlock(planetStore *planets, calcSchedule *schedule, pthread_barrier_t *calcBarrier, double timeFactor, benchTimes *times)
+{
+  double start, dt, step;
+  long substeps, s, span;
+  int i, p, top, level, live, active;
+  int levelCount[BLOCK_MAX_LEVEL + 1];
+  
+  start = 0;
+  
+  if ( !planets->accelerationCurrent )
+  {
+    if ( times ) start = getSeconds();
+    runCalcPass(schedule, calcBarrier, PASS_FORCE, planets->count);
+    if ( times ) times->force += getSeconds() - start;
+  }
+  
+  if ( times ) start = getSeconds();
+  
+  // every planet is in step at the start, pick the levels and give each
+  // planet its opening half kick
+  top = 0;
+  live = 0;
+  memset(levelCount, 0, sizeof(levelCount));
+  for(p = 0; p < planets->count; p++)
+  {
+    if ( planets->mass[p] > 0 )
+    {
+      planets->stepLevel[p] = getBlockLevel(planets, p, timeFactor);
+      if ( planets->stepLevel[p] > top ) top = planets->stepLevel[p];
+      levelCount[planets->stepLevel[p]]++;
+      schedule->active[live++] = p;
+    }
+  }
+  substeps = 1L << top;
+  dt = timeFactor / substeps;
+  
+  for(i = 0; i < live; i++)
+  {
+    p = schedule->active[i];
+    step = dt * (1L << (top - planets->stepLevel[p]));
+    planets->velocityX[p] += planets->accelerationX[p] * step / 2;
+    planets->velocityY[p] += planets->accelerationY[p] * step / 2;
+  }
+  groupBlockLevels(planets, schedule->active, live, schedule->regroup);
+  
+  if ( times ) times->move += getSeconds() - start;
+  
+  for(s = 0; s < substeps; s++)
+  {
+    // planets ending their step now are the levels whose span divides the
+    // sub-steps done, all of them on the last sub-step
+    active = 0;
+    for(level = top; level >= 0 && (s + 1) % (1L << (top - level)) == 0; level--)
+    {
+      active += levelCount[level];
+    }
+    
+    // drift everyone and calculate the planets due
+    if ( times ) start = getSeconds();
+    
+    schedule->drift = dt;
+    schedule->activeOnly = 1;
+    runCalcPass(schedule, calcBarrier, PASS_FORCE, active);
+    schedule->activeOnly = 0;
+    schedule->drift = 0;
+    
+    if ( times ) times->force += getSeconds() - start;
+    if ( times ) start = getSeconds();
+    
+    // closing half kick, the level for the next step and its opening half
+    // kick, a planet can move to a longer step only where that step lines
+    // up with the sub-steps, and a planet needing a shorter step than any
+    // so far splits the remaining sub-steps
+    for(i = 0; i < active; i++)
+    {
+      p = schedule->active[i];
+      span = 1L << (top - planets->stepLevel[p]);
+      step = dt * span;
+      planets->velocityX[p] += planets->accelerationX[p] * step / 2;
+      planets->velocityY[p] += planets->accelerationY[p] * step / 2;
+      
+      level = getBlockLevel(planets, p, timeFactor);
+      if ( level > top )
+      {
+        substeps <<= level - top;
+        dt = timeFactor / substeps;
+        s = ((s + 1) << (level - top)) - 1;
+        top = level;
+      }
+      while ( (s + 1) % (1L << (top - level)) != 0 )
+      {
+        level++;
+      }
+      levelCount[planets->stepLevel[p]]--;
+      levelCount[level]++;
+      planets->stepLevel[p] = level;
+      
+      if ( s + 1 < substeps )
+      {
+        step = dt * (1L << (top - level));
+        planets->velocityX[p] += planets->accelerationX[p] * step / 2;
+        planets->velocityY[p] += planets->accelerationY[p] * step / 2;
+      }
+    }
+    
+    // only the planets just kicked changed level, and none went below the
+    // levels that were due, so the rest of the list stays behind them
+    groupBlockLevels(planets, schedule->active, active, schedule->regroup);
+    
+    if ( times ) times->move += getSeconds() - start;
+  }
+  
+  planets->accelerationCurrent = 1;
+}
+
+
+/**
+ * Pick the block timestep level of a planet from how close its nearest
+ * neighbor is and how hard it is being pulled.
+ * 
+ * @param planets
+ * @param p
+ * @param timeFactor
+ * @return 
+ */
+int getBlockLevel(planetStore *planets, int p, double timeFactor)
+{
+  double acceleration, dt;
+  int level;
+  
+  acceleration = sqrt(planets->accelerationX[p] * planets->accelerationX[p] + planets->accelerationY[p] * planets->accelerationY[p]);
+  if ( acceleration <= 0 || planets->nearestDistance[p] >= DBL_MAX )
+  {
+    return 0;
+  }
+  
+  dt = BLOCK_ETA * sqrt(planets->nearestDistance[p] / acceleration);
+  for(level = 0; level < BLOCK_MAX_LEVEL && timeFactor / (1L << level) > dt; level++);
+  
+  return level;
+}
+
+
+/**
+ * Order a list of planets by step level, highest level first, keeping the
+ * order of planets on the same level.
+ * 
+ * @param planets
+ * @param list
+ * @param count
+ * @param scratch Room for count planets.
+ */
+void groupBlockLevels(planetStore *planets, int *list, int count, int *scratch)
+{
+  int levelStart[BLOCK_MAX_LEVEL + 2];
+  int i, level;
+  
+  memset(levelStart, 0, sizeof(levelStart));
+  for(i = 0; i < count; i++)
+  {
+    levelStart[BLOCK_MAX_LEVEL - planets->stepLevel[list[i]] + 1]++;
+  }
+  for(level = 1; level <= BLOCK_MAX_LEVEL + 1; level++)
+  {
+    levelStart[level] += levelStart[level - 1];
+  }
+  
+  for(i = 0; i < count; i++)
+  {
+    scratch[levelStart[BLOCK_MAX_LEVEL - planets->stepLevel[list[i]]]++] = list[i];
+  }
+  memcpy(list, scratch, count * sizeof(int));
+}
+
+
+/**
+ * Run one pass on the calculation threads and wait for it to finish.
+ * 
+ * @param schedule
+ * @param calcBarrier
+ * @param pass The PASS_ constant for the threads to run.
+ * @param count The planet count.
+ */
+void runCalcPass(calcSchedule *schedule, pthread_barrier_t *calcBarrier, int pass, int count)
+{
+  // rewind the work ranges for the next pass
+  schedule->pass = pass;
+  resetCalcSchedule(schedule, count);
+  
+  // wait for all threads to start calculations
+  pthread_barrier_wait(calcBarrier);
+  
+  // wait for all threads to end calculations
+  pthread_barrier_wait(calcBarrier);
+}
+
+
+/**
+ * Run the simulation without a display for a number of steps, then print
+ * the final planet state and timing.
+ * 
+ * @param physics
+ * @param steps
+ */
+void runHeadless(physicsArgs *physics, long steps)
+{
+  struct timespec start, end;
+  planetStore *planets;
+  long step;
+  int pi;
+  double elapsed;
+  
+  planets = physics->planets;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  
+  for(step = 0; step < steps; step++)
+  {
+    stepPhysics(physics);
+  }
+  
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  
+  // final state of each remaining planet
+  printf("# id x y velocityX velocityY mass\n");
+  for(pi = 0; pi < planets->count; pi++)
+  {
+    if ( planets->mass[pi] > 0 )
+    {
+      printf("%d %.17G %.17G %.17G %.17G %.17G\n", planets->id[pi], planets->x[pi], planets->y[pi], 
+             planets->velocityX[pi], planets->velocityY[pi], planets->mass[pi]);
+    }
+  }
+  
+  printf("# simulated time %G s, %d planets remaining, total mass %G kg, momentum %G, %G Ns, center of mass %G, %G m\n", 
+         planets->time, planets->stats.count, planets->stats.mass, planets->stats.momentumX, planets->stats.momentumY, 
+         planets->stats.centerX, planets->stats.centerY);
+  printf("# elapsed %.3f s, %.3f ms per step\n", elapsed, steps > 0 ? 1000 * elapsed / steps : 0);
+}
+
+
+/**
+ * Run a force pass and print how far the solver is from the direct sum for
+ * a sample of planets spread through the store.
+ * 
+ * @param planets
+ * @param schedule
+ * @param calcBarrier
+ * @param sample Number of planets to check.
+ */
+void reportForceError(planetStore *planets, calcSchedule *schedule, pthread_barrier_t *calcBarrier, int sample)
+{
+  accelerationVector acceleration;
+  double nearestDistance, dx, dy, exact, error, sum, max;
+  int i, p, checked;
+  
+  // the first pass finds the nearest distances the mixed precision kernels
+  // check before using single precision
+  runCalcPass(schedule, calcBarrier, PASS_FORCE, planets->count);
+  runCalcPass(schedule, calcBarrier, PASS_FORCE, planets->count);
+  
+  checked = 0;
+  sum = 0;
+  max = 0;
+  for(i = 0; i < sample && i < planets->count; i++)
+  {
+    p = (long)planets->count * i / (sample < planets->count ? sample : planets->count);
+    if ( planets->mass[p] <= 0 )
+    {
+      continue;
+    }
+    
+    acceleration.accelerationX = 0;
+    acceleration.accelerationY = 0;
+    nearestDistance = DBL_MAX;
+    forceKernelGeneric(planets, p, 0, p, &acceleration, &nearestDistance);
+    forceKernelGeneric(planets, p, p + 1, planets->count, &acceleration, &nearestDistance);
+    
+    // error relative to the size of the exact acceleration
+    dx = planets->accelerationX[p] - acceleration.accelerationX;
+    dy = planets->accelerationY[p] - acceleration.accelerationY;
+    exact = sqrt(acceleration.accelerationX * acceleration.accelerationX + acceleration.accelerationY * acceleration.accelerationY);
+    if ( exact <= 0 )
+    {
+      continue;
+    }
+    error = sqrt(dx * dx + dy * dy) / exact;
+    
+    sum += error * error;
+    if ( error > max ) max = error;
+    checked++;
+  }
+  
+  printf("# force error against the direct sum for %d planets: rms %.3G, max %.3G\n", 
+         checked, checked > 0 ? sqrt(sum / checked) : 0, max);
+}
+
+
+/**
+ * Monotonic clock in seconds.
+ * 
+ * @return 
+ */
+double getSeconds(void)
+{
+  struct timespec now;
+  
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+// instrumentation state, each thread only writes its own slot
+int profileFlags = 0;
+profileSlot profileSlots[PROFILE_SLOTS];
+char *zoneNames[ZONE_COUNT] = {"force", "collide", "barrier", "step", "snapshot", "draw", "flush"};
+char *counterNames[COUNTER_COUNT] = {"pairs", "collision_tests", "merges", "steps", "frames", "drawn", "x_requests"};
+FILE *traceFile = NULL;
+pthread_mutex_t traceMutex = PTHREAD_MUTEX_INITIALIZER;
+double traceStart;
+
+
+/**
+ * Start timing a zone. When nothing is being collected this is a single
+ * load and branch.
+ * 
+ * @return The start time, 0 when not collecting.
+ */
+double startProfile(void)
+{
+  if ( !__atomic_load_n(&profileFlags, __ATOMIC_RELAXED) )
+  {
+    return 0;
+  }
+  
+  return getSeconds();
+}
+
+
+/**
+ * Finish timing a zone, add it to the thread's slot and write it to the
+ * trace.
+ * 
+ * @param slot The calculation thread, PROFILE_PHYSICS or PROFILE_DISPLAY.
+ * @param zone The ZONE_ constant.
+ * @param start Time from startProfile.
+ */
+void endProfile(int slot, int zone, double start)
+{
+  long long *total;
+  double end;
+  
+  if ( start == 0 || !__atomic_load_n(&profileFlags, __ATOMIC_RELAXED) )
+  {
+    return;
+  }
+  
+  end = getSeconds();
+  total = &profileSlots[slot].zoneTime[zone];
+  __atomic_store_n(total, *total + (long long)(1e9 * (end - start)), __ATOMIC_RELAXED);
+  
+  if ( profileFlags & PROFILE_TRACE )
+  {
+    pthread_mutex_lock(&traceMutex);
+    if ( traceFile )
+    {
+      fprintf(traceFile, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}", 
+              zoneNames[zone], slot, 1e6 * (start - traceStart), 1e6 * (end - start));
+    }
+    pthread_mutex_unlock(&traceMutex);
+  }
+}
+
+
+/**
+ * Add to one of the thread's event counters.
+ * 
+ * @param slot The calculation thread, PROFILE_PHYSICS or PROFILE_DISPLAY.
+ * @param counter The COUNTER_ constant.
+ * @param count
+ */
+void addProfileCount(int slot, int counter, long long count)
+{
+  long long *total;
+  
+  if ( !__atomic_load_n(&profileFlags, __ATOMIC_RELAXED) )
+  {
+    return;
+  }
+  
+  total = &profileSlots[slot].counter[counter];
+  __atomic_store_n(total, *total + count, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Wait for the other calculation threads and time the wait.
+ * 
+ * @param threadArgs
+ */
+void waitThreadBarrier(calcArgs *threadArgs)
+{
+  double start;
+  
+  start = startProfile();
+  pthread_barrier_wait((*threadArgs).threadBarrier);
+  endProfile((*threadArgs).thread, ZONE_BARRIER, start);
+}
+
+
+/**
+ * Start streaming timed zones and per step counters to a Chrome trace
+ * event file, it is closed when the program exits.
+ * 
+ * @param path
+ * @param threads The number of calculation threads.
+ */
+void openTrace(char *path, int threads)
+{
+  int t;
+  
+  traceFile = fopen(path, "w");
+  if ( traceFile == NULL )
+  {
+    printf("Cannot write trace %s\n", path);
+    exit(1);
+  }
+  
+  // name the threads so the viewer labels each track
+  fprintf(traceFile, "[\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"xgravity\"}}");
+  for(t = 0; t < threads; t++)
+  {
+    fprintf(traceFile, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"calc %d\"}}", t, t);
+  }
+  fprintf(traceFile, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"physics\"}}", PROFILE_PHYSICS);
+  fprintf(traceFile, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"display\"}}", PROFILE_DISPLAY);
+  
+  traceStart = getSeconds();
+  atexit(closeTrace);
+  __atomic_or_fetch(&profileFlags, PROFILE_TRACE, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Finish the trace file, threads still running drop their events.
+ */
+void closeTrace(void)
+{
+  __atomic_and_fetch(&profileFlags, ~PROFILE_TRACE, __ATOMIC_RELAXED);
+  
+  pthread_mutex_lock(&traceMutex);
+  if ( traceFile )
+  {
+    fprintf(traceFile, "\n]\n");
+    fclose(traceFile);
+    traceFile = NULL;
+  }
+  pthread_mutex_unlock(&traceMutex);
+}
+
+
+/**
+ * Write the counts since the last call as trace counter events, called by
+ * the physics thread after each step.
+ */
+void traceProfileCounters(void)
+{
+  static long long last[COUNTER_COUNT];
+  long long total[COUNTER_COUNT];
+  double now;
+  int slot, counter;
+  
+  memset(total, 0, sizeof(total));
+  for(slot = 0; slot < PROFILE_SLOTS; slot++)
+  {
+    for(counter = 0; counter < COUNTER_COUNT; counter++)
+    {
+      total[counter] += __atomic_load_n(&profileSlots[slot].counter[counter], __ATOMIC_RELAXED);
+    }
+  }
+  
+  now = getSeconds();
+  pthread_mutex_lock(&traceMutex);
+  if ( traceFile )
+  {
+    fprintf(traceFile, ",\n{\"name\": \"step counts\", \"ph\": \"C\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"args\": {", 
+            PROFILE_PHYSICS, 1e6 * (now - traceStart));
+    for(counter = COUNTER_PAIRS; counter <= COUNTER_MERGES; counter++)
+    {
+      fprintf(traceFile, "%s\"%s\": %lld", counter > COUNTER_PAIRS ? ", " : "", counterNames[counter], total[counter] - last[counter]);
+    }
+    fprintf(traceFile, "}}");
+  }
+  pthread_mutex_unlock(&traceMutex);
+  
+  memcpy(last, total, sizeof(total));
+}
+
+
+/**
+ * Copy every thread's slot.
+ * 
+ * @param sample
+ */
+void sampleProfile(profileSlot *sample)
+{
+  int slot, i;
+  
+  for(slot = 0; slot < PROFILE_SLOTS; slot++)
+  {
+    for(i = 0; i < ZONE_COUNT; i++)
+    {
+      sample[slot].zoneTime[i] = __atomic_load_n(&profileSlots[slot].zoneTime[i], __ATOMIC_RELAXED);
+    }
+    for(i = 0; i < COUNTER_COUNT; i++)
+    {
+      sample[slot].counter[i] = __atomic_load_n(&profileSlots[slot].counter[i], __ATOMIC_RELAXED);
+    }
+  }
+}
+
+
+/**
+ * Format the HUD lines from the change since the last refresh. Frame and
+ * step figures are per frame and per step, thread figures are the share
+ * of wall time spent in each zone.
+ * 
+ * @param last The slots at the last refresh, updated to now.
+ * @param lastTime Time of the last refresh, updated to now.
+ * @param threads The number of calculation threads.
+ * @param stats Live planet totals to show.
+ * @param text Filled in with the lines.
+ * @return The number of lines.
+ */
+int updateProfileHud(profileSlot *last, double *lastTime, int threads, planetStats *stats, char text[][PROFILE_HUD_WIDTH])
+{
+  profileSlot *now, *display, *physics;
+  long long frames, steps, pairs, tests, merges;
+  double seconds, wall;
+  int t, i, lines;
+  
+  now = (profileSlot *) malloc(PROFILE_SLOTS * sizeof(profileSlot));
+  sampleProfile(now);
+  wall = getSeconds();
+  seconds = wall - *lastTime;
+  if ( seconds <= 0 ) seconds = 1;
+  
+  // change since the last refresh, kept in the display and physics slots
+  for(t = 0; t < PROFILE_SLOTS; t++)
+  {
+    if ( t >= threads && t < PROFILE_PHYSICS ) continue;
+    
+    for(i = 0; i < ZONE_COUNT; i++)
+    {
+      last[t].zoneTime[i] = now[t].zoneTime[i] - last[t].zoneTime[i];
+    }
+    for(i = 0; i < COUNTER_COUNT; i++)
+    {
+      last[t].counter[i] = now[t].counter[i] - last[t].counter[i];
+    }
+  }
+  
+  display = &last[PROFILE_DISPLAY];
+  physics = &last[PROFILE_PHYSICS];
+  frames = display->counter[COUNTER_FRAMES];
+  steps = physics->counter[COUNTER_STEPS];
+  pairs = 0;
+  tests = 0;
+  merges = 0;
+  for(t = 0; t < threads; t++)
+  {
+    pairs += last[t].counter[COUNTER_PAIRS];
+    tests += last[t].counter[COUNTER_COLLISION_TESTS];
+    merges += last[t].counter[COUNTER_MERGES];
+  }
+  
+  lines = 0;
+  snprintf(text[lines++], PROFILE_HUD_WIDTH, "display %.1f fps, draw %.2f ms, flush %.2f ms, %lld planets, %lld X requests per frame", 
+           frames / seconds, frames ? display->zoneTime[ZONE_DRAW] / 1e6 / frames : 0, 
+           frames ? display->zoneTime[ZONE_FLUSH] / 1e6 / frames : 0, 
+           frames ? display->counter[COUNTER_DRAWN] / frames : 0, frames ? display->counter[COUNTER_REQUESTS] / frames : 0);
+  snprintf(text[lines++], PROFILE_HUD_WIDTH, "physics %.1f steps/s, step %.2f ms, snapshot %.2f ms", 
+           steps / seconds, steps ? physics->zoneTime[ZONE_STEP] / 1e6 / steps : 0, 
+           steps ? physics->zoneTime[ZONE_SNAPSHOT] / 1e6 / steps : 0);
+  snprintf(text[lines++], PROFILE_HUD_WIDTH, "%.3G interactions/s, %.3G collision tests/s, %lld merges", 
+           pairs / seconds, tests / seconds, merges);
+  snprintf(text[lines++], PROFILE_HUD_WIDTH, "%d planets, %.4G kg, momentum %.4G, %.4G Ns, center of mass %.4G, %.4G m", 
+           stats->count, stats->mass, stats->momentumX, stats->momentumY, stats->centerX, stats->centerY);
+  for(t = 0; t < threads && t < PROFILE_HUD_THREADS; t++)
+  {
+    snprintf(text[lines++], PROFILE_HUD_WIDTH, "calc %d: force %.0f%%, collide %.0f%%, barrier wait %.0f%%", t, 
+             last[t].zoneTime[ZONE_FORCE] / 1e7 / seconds, last[t].zoneTime[ZONE_COLLIDE] / 1e7 / seconds, 
+             last[t].zoneTime[ZONE_BARRIER] / 1e7 / seconds);
+  }
+  if ( threads > PROFILE_HUD_THREADS )
+  {
+    snprintf(text[lines++], PROFILE_HUD_WIDTH, "%d more calculation threads", threads - PROFILE_HUD_THREADS);
+  }
+  
+  memcpy(last, now, PROFILE_SLOTS * sizeof(profileSlot));
+  free(now);
+  *lastTime = wall;
+  
+  return lines;
+}
+
+
+// planet counts run by the benchmark when no count is given
+int benchCounts[BENCH_COUNTS] = {1000, 10000, 100000};
+
+// chunk sizes tried by the startup tuning besides the automatic one
+int tuneChunks[TUNE_CHUNKS] = {16, 64, 256, 1024};
+
+
+/**
+ * Run every benchmark configuration in a child process so each one gets
+ * fresh calculation threads and memory. The parent prints the table around
+ * the rows written by the children and exits when they are done, so this
+ * only returns in a child.
+ * 
+ * @param format BENCH_CSV or BENCH_JSON.
+ * @param count Planet count, set to the configuration in the child.
+ * @param threads Thread count, set to the configuration in the child.
+ * @param countGiven Only run the given planet count.
+ * @param threadsGiven Run thread counts up to the given one instead of the CPU count.
+ */
+void forkBenchRuns(int format, int *count, int *threads, int countGiven, int threadsGiven)
+{
+  int ci, counts, maxThreads, runThreads, runs, status;
+  pid_t pid;
+  
+  counts = countGiven ? 1 : BENCH_COUNTS;
+  maxThreads = threadsGiven ? *threads : (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if ( maxThreads < 1 ) maxThreads = 1;
+  if ( maxThreads > MAX_THREADS ) maxThreads = MAX_THREADS;
+  
+  if ( format == BENCH_JSON ) printf("[\n");
+  else printf("bodies,threads,steps,kernel,theta,fmm_order,wall_s,pairs_per_s,ns_per_body_step,force_s,barrier_s,move_s,collide_s\n");
+  
+  runs = 0;
+  for(ci = 0; ci < counts; ci++)
+  {
+    // thread counts double up to the maximum, which is always run
+    for(runThreads = 1; runThreads <= maxThreads; runThreads = (runThreads < maxThreads && runThreads * 2 > maxThreads ? maxThreads : runThreads * 2))
+    {
+      if ( format == BENCH_JSON && runs > 0 ) printf(",\n");
+      runs++;
+      
+      // the child must not repeat anything left in the buffer
+      fflush(stdout);
+      pid = fork();
+      if ( pid < 0 )
+      {
+        printf("Cannot start benchmark run\n");
+        exit(1);
+      }
+      if ( pid == 0 )
+      {
+        if ( !countGiven ) *count = benchCounts[ci];
+        *threads = runThreads;
+        return;
+      }
+      
+      waitpid(pid, &status, 0);
+      if ( !WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+      {
+        fprintf(stderr, "Benchmark run with %d planets and %d threads failed\n", 
+                countGiven ? *count : benchCounts[ci], runThreads);
+      }
+    }
+  }
+  
+  if ( format == BENCH_JSON ) printf("\n]\n");
+  exit(0);
+}
+
+
+/**
+ * Time the steps of one benchmark configuration and print its row. The
+ * barrier time is how long the calculation threads wait on average, taken
+ * out of the force and collision passes.
+ * 
+ * @param physics
+ * @param threadArgs The calculation thread arguments.
+ * @param threads
+ * @param steps Number of timed steps, less than 0 to pick from BENCH_PAIRS.
+ * @param format BENCH_CSV or BENCH_JSON.
+ * @param kernelName
+ * @param theta
+ * @param fmmOrder Fast multipole expansion order, 0 when not used.
+ */
+void runBench(physicsArgs *physics, calcArgs *threadArgs, int threads, long steps, int format, char *kernelName, double theta, int fmmOrder)
+{
+  benchTimes times;
+  planetStore *planets;
+  double start, wall, pairs, force, collide, barrier;
+  long step;
+  int ti, bodies;
+  
+  planets = physics->planets;
+  bodies = planets->capacity;
+  
+  // the calculation threads count the interactions they evaluate
+  __atomic_or_fetch(&profileFlags, PROFILE_BENCH, __ATOMIC_RELAXED);
+  if ( steps < 0 )
+  {
+    steps = (long) (BENCH_PAIRS / ((double) bodies * bodies));
+    if ( steps < 1 ) steps = 1;
+    if ( steps > BENCH_MAX_STEPS ) steps = BENCH_MAX_STEPS;
+  }
+  
+  // one untimed step to fault in the memory and start the threads
+  stepPlanets(planets, physics->schedule, physics->calcBarrier, physics->timeFactor, physics->integrator, NULL);
+  for(ti = 0; ti < threads; ti++)
+  {
+    threadArgs[ti].busyTime[PASS_FORCE] = 0;
+    threadArgs[ti].busyTime[PASS_COLLIDE] = 0;
+    profileSlots[ti].counter[COUNTER_PAIRS] = 0;
+  }
+  
+  memset(&times, 0, sizeof(benchTimes));
+  start = getSeconds();
+  for(step = 0; step < steps; step++)
+  {
+    stepPlanets(planets, physics->schedule, physics->calcBarrier, physics->timeFactor, physics->integrator, &times);
+  }
+  wall = getSeconds() - start;
+  
+  // average time each thread spent working in the passes
+  force = 0;
+  collide = 0;
+  for(ti = 0; ti < threads; ti++)
+  {
+    force += threadArgs[ti].busyTime[PASS_FORCE] / threads;
+    collide += threadArgs[ti].busyTime[PASS_COLLIDE] / threads;
+  }
+  barrier = times.force - force + times.collide - collide;
+  
+  // pairs and cell interactions the threads evaluated in every force pass,
+  // fewer than the direct sum for the tree solvers and once planets merge
+  pairs = 0;
+  for(ti = 0; ti < threads; ti++)
+  {
+    pairs += profileSlots[ti].counter[COUNTER_PAIRS];
+  }
+  
+  if ( format == BENCH_JSON )
+  {
+    printf("  {\"bodies\": %d, \"threads\": %d, \"steps\": %ld, \"kernel\": \"%s\", \"theta\": %G, \"fmm_order\": %d, "
+           "\"wall_s\": %.6f, \"pairs_per_s\": %.6G, \"ns_per_body_step\": %.3f, "
+           "\"force_s\": %.6f, \"barrier_s\": %.6f, \"move_s\": %.6f, \"collide_s\": %.6f}", 
+           bodies, threads, steps, kernelName, theta, fmmOrder, wall, pairs / wall, 
+           1e9 * wall / ((double) bodies * steps), force, barrier, times.move, collide);
+  }
+  else
+  {
+    printf("%d,%d,%ld,%s,%G,%d,%.6f,%.6G,%.3f,%.6f,%.6f,%.6f,%.6f\n", 
+           bodies, threads, steps, kernelName, theta, fmmOrder, wall, pairs / wall, 
+           1e9 * wall / ((double) bodies * steps), force, barrier, times.move, collide);
+  }
+}
+
+
+/**
+ * Pick the thread count, work chunk size and force kernel for this machine
+ * and planet count. A choice cached for the same machine, planet count
+ * range and options is used when there is one. Otherwise each candidate is
+ * timed in a child process over a few steps of the current planets: the
+ * kernels at the CPU count, then thread counts doubling up to the CPU count
+ * with the fastest kernel, then chunk sizes. The fastest is cached.
+ * 
+ * @param path Cache file.
+ * @param count The planet count.
+ * @param solver Label of the solver options the timings depend on.
+ * @param tuneKernel Try the supported vector kernels, otherwise keep choice->kernel.
+ * @param tuneChunk Try the TUNE_CHUNKS chunk sizes, otherwise keep choice->chunk.
+ * @param choice Holds the fixed kernel and chunk, set to the fastest configuration.
+ * @return The pipe to report the step time to in a child process, -1 in the parent.
+ */
+int tuneConfiguration(char *path, int count, char *solver, int tuneKernel, int tuneChunk, tuneChoice *choice)
+{
+  tuneChoice candidate, best;
+  char key[TUNE_KEY_SIZE], machine[TUNE_KEY_SIZE / 2], chunkName[16];
+  int bucket, cpus, kernel, threads, ci, fd;
+  
+  // planet counts within a power of two share a choice
+  for(bucket = 0; (count >> (bucket + 1)) > 0; bucket++);
+  if ( tuneChunk ) strcpy(chunkName, "auto");
+  else sprintf(chunkName, "%d", choice->chunk);
+  getMachineName(machine, sizeof(machine));
+  snprintf(key, sizeof(key), "%d %s %s %s %s", bucket, solver, 
+           tuneKernel ? "auto" : kernelNames[choice->kernel], chunkName, machine);
+  
+  if ( readTuneCache(path, key, choice) )
+  {
+    return -1;
+  }
+  
+  cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if ( cpus < 1 ) cpus = 1;
+  if ( cpus > MAX_THREADS ) cpus = MAX_THREADS;
+  
+  best = *choice;
+  best.threads = cpus;
+  if ( tuneChunk ) best.chunk = 0;
+  best.seconds = DBL_MAX;
+  
+  // the kernels with every CPU busy, or only the one asked for, the scalar
+  // kernel is only there for reference
+  candidate = best;
+  for(kernel = 0; kernel < KERNEL_COUNT; kernel++)
+  {
+    if ( tuneKernel ? kernel == KERNEL_SCALAR || !isForceKernelSupported(kernel) : kernel != choice->kernel ) continue;
+    candidate.kernel = kernel;
+    fd = timeTuneCandidate(&candidate, &best);
+    if ( fd >= 0 )
+    {
+      *choice = candidate;
+      return fd;
+    }
+  }
+  
+  // thread counts doubling up to the CPU count, which is already timed
+  candidate = best;
+  for(threads = 1; threads < cpus; threads *= 2)
+  {
+    candidate.threads = threads;
+    fd = timeTuneCandidate(&candidate, &best);
+    if ( fd >= 0 )
+    {
+      *choice = candidate;
+      return fd;
+    }
+  }
+  
+  // chunk sizes other than the automatic one
+  candidate = best;
+  for(ci = 0; tuneChunk && ci < TUNE_CHUNKS; ci++)
+  {
+    candidate.chunk = tuneChunks[ci];
+    fd = timeTuneCandidate(&candidate, &best);
+    if ( fd >= 0 )
+    {
+      *choice = candidate;
+      return fd;
+    }
+  }
+  
+  if ( best.seconds == DBL_MAX )
+  {
+    printf("Tuning runs failed\n");
+    exit(1);
+  }
+  
+  *choice = best;
+  writeTuneCache(path, key, choice);
+  
+  return -1;
+}
+
+
+/**
+ * Time one tuning candidate in a child process. The child returns at once
+ * with the write end of a pipe, the parent reads the step time back and
+ * keeps the candidate when it is the fastest so far.
+ * 
+ * @param candidate
+ * @param best
+ * @return The pipe in the child process, -1 in the parent.
+ */
+int timeTuneCandidate(tuneChoice *candidate, tuneChoice *best)
+{
+  int fds[2], status;
+  double seconds;
+  pid_t pid;
+  
+  if ( pipe(fds) )
+  {
+    printf("Cannot start tuning run\n");
+    exit(1);
+  }
+  
+  // the child must not repeat anything left in the buffer
+  fflush(stdout);
+  pid = fork();
+  if ( pid < 0 )
+  {
+    printf("Cannot start tuning run\n");
+    exit(1);
+  }
+  if ( pid == 0 )
+  {
+    close(fds[0]);
+    if ( freopen("/dev/null", "w", stdout) == NULL ) exit(1);
+    return fds[1];
+  }
+  
+  close(fds[1]);
+  if ( read(fds[0], &seconds, sizeof(double)) != sizeof(double) )
+  {
+    seconds = DBL_MAX;
+  }
+  close(fds[0]);
+  waitpid(pid, &status, 0);
+  if ( !WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+  {
+    seconds = DBL_MAX;
+  }
+  
+  candidate->seconds = seconds;
+  if ( seconds < best->seconds )
+  {
+    *best = *candidate;
+  }
+  
+  return -1;
+}
+
+
+/**
+ * Time the steps of a tuning run after one untimed step and send the wall
+ * time per step to the parent.
+ * 
+ * @param physics
+ * @param fd
+ */
+void runTune(physicsArgs *physics, int fd)
+{
+  planetStore *planets;
+  double start, seconds;
+  long step, steps;
+  
+  planets = physics->planets;
+  steps = (long) (TUNE_PAIRS / ((double) planets->count * planets->count + 1));
+  if ( steps < 1 ) steps = 1;
+  if ( steps > TUNE_MAX_STEPS ) steps = TUNE_MAX_STEPS;
+  
+  stepPlanets(planets, physics->schedule, physics->calcBarrier, physics->timeFactor, physics->integrator, NULL);
+  start = getSeconds();
+  for(step = 0; step < steps; step++)
+  {
+    stepPlanets(planets, physics->schedule, physics->calcBarrier, physics->timeFactor, physics->integrator, NULL);
+  }
+  seconds = (getSeconds() - start) / steps;
+  
+  if ( write(fd, &seconds, sizeof(double)) != sizeof(double) )
+  {
+    exit(1);
+  }
+  exit(0);
+}
+
+
+/**
+ * Look up a tuned configuration. The cache has one line per tuning, the
+ * choice and step time followed by the key, a later line for the same key
+ * replaces an earlier one.
+ * 
+ * @param path
+ * @param key
+ * @param choice Set to the cached configuration when found.
+ * @return 1 when the key was found.
+ */
+int readTuneCache(char *path, char *key, tuneChoice *choice)
+{
+  FILE *file;
+  char line[TUNE_KEY_SIZE + 128], kernelName[32];
+  tuneChoice cached;
+  int found, offset, kernel;
+  
+  file = fopen(path, "r");
+  if ( file == NULL )
+  {
+    return 0;
+  }
+  
+  found = 0;
+  while ( fgets(line, sizeof(line), file) )
+  {
+    line[strcspn(line, "\n")] = 0;
+    offset = 0;
+    if ( sscanf(line, "%d %d %31s %lf %n", &cached.threads, &cached.chunk, kernelName, &cached.seconds, &offset) < 4 || offset == 0 ) continue;
+    if ( strcmp(line + offset, key) != 0 ) continue;
+    
+    // a kernel this build or CPU lacks means the machine changed
+    kernel = getForceKernelByName(kernelName);
+    if ( kernel <= KERNEL_AUTO || !isForceKernelSupported(kernel) || cached.threads < 1 || cached.threads > MAX_THREADS ) continue;
+    cached.kernel = kernel;
+    *choice = cached;
+    found = 1;
+  }
+  fclose(file);
+  
+  return found;
+}
+
+
+/**
+ * Append a tuned configuration to the cache.
+ * 
+ * @param path
+ * @param key
+ * @param choice
+ */
+void writeTuneCache(char *path, char *key, tuneChoice *choice)
+{
+  FILE *file;
+  
+  file = fopen(path, "a");
+  if ( file == NULL )
+  {
+    printf("Cannot write tuning cache %s\n", path);
+    return;
+  }
+  fprintf(file, "%d %d %s %.6G %s\n", choice->threads, choice->chunk, kernelNames[choice->kernel], choice->seconds, key);
+  fclose(file);
+}
+
+
+/**
+ * Describe the machine for the tuning cache key, the CPU count and model.
+ * 
+ * @param name
+ * @param size
+ */
+void getMachineName(char *name, int size)
+{
+  FILE *file;
+  char line[256], *model;
+  int cpus;
+  
+  cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  snprintf(name, size, "%d cpus unknown", cpus);
+  
+  file = fopen("/proc/cpuinfo", "r");
+  if ( file == NULL )
+  {
+    return;
+  }
+  while ( fgets(line, sizeof(line), file) )
+  {
+    if ( strncmp(line, "model name", 10) == 0 && (model = strchr(line, ':')) != NULL )
+    {
+      model[strcspn(model, "\n")] = 0;
+      snprintf(name, size, "%d cpus%s", cpus, model + 1);
+      break;
+    }
+  }
+  fclose(file);
+}
+
+
+/**
+ * Print the command line usage.
+ * 
+ * @param name
+ */
+void printUsage(char *name)
+{
+  printf("usage: %s [options] [planet count] [calculation threads or auto]\n", name);
+  printf("  -b, --theta THETA  use the Barnes-Hut solver with the given opening angle, 0 for direct sum\n");
+  printf("  -m, --fmm ORDER    use the fast multipole solver with the given expansion order (1 to %d)\n", FMM_MAX_ORDER);
+  printf("  -e, --error-sample N  report the force error against the direct sum for N planets at startup\n");
+  printf("  -k, --kernel NAME  direct sum force kernel: auto, scalar, generic, sse2, avx2 or avx512\n");
+  printf("  -M, --mixed        single precision pair terms with double sums in the direct sum, reports the error at startup\n");
+  printf("  -c, --chunk N      planets per work chunk, 0 sizes chunks automatically\n");
+  printf("  -s, --steal        give each thread its own range and let idle threads steal chunks\n");
+  printf("  -u, --tune-cache FILE  configurations picked for auto threads (default %s)\n", TUNE_FILE);
+  printf("  -a, --affinity POLICY  pin the calculation threads: none, compact or scatter over the NUMA nodes\n");
+  printf("  -H, --headless     run without a display and print the final state\n");
+  printf("  -n, --steps N      number of steps to run headless\n");
+  printf("  -t, --timestep T   calculation time factor in seconds\n");
+  printf("  -i, --integrator NAME  euler, leapfrog (kick-drift-kick), yoshida (4th order) or block (leapfrog with per planet timesteps)\n");
+  printf("  -C, --checkpoint FILE  checkpoint file written by the S key and -K (default %s)\n", CHECKPOINT_FILE);
+  printf("  -K, --checkpoint-every K  write a checkpoint every K steps\n");
+  printf("  -R, --restore FILE     start from a checkpoint instead of random planets\n");
+  printf("  -r, --record FILE      record a compressed trajectory, with a seek index in FILE.idx\n");
+  printf("  -N, --record-every K   steps between trajectory frames (default %d)\n", TRAJECTORY_EVERY);
+  printf("  -E, --record-error E   largest error of recorded positions in m and velocities in m/s (default %G)\n", TRAJECTORY_ERROR);
+  printf("  -p, --replay FILE      play back a recorded trajectory in the window\n");
+  printf("  -B, --bench        time seeded runs over several planet and thread counts and exit\n");
+  printf("  -f, --format FMT   benchmark output format: csv or json\n");
+  printf("  -T, --trace FILE   stream timed zones and counters to a Chrome trace event file\n");
+  printf("  -x, --xlib         draw with Xlib requests instead of the MIT-SHM framebuffer\n");
+  printf("  -l, --lod DENSITY  draw small planets as a density map above DENSITY planets per pixel, 0 for never\n");
+  printf("  -h, --help         show this help\n");
+}
+
+
+/**
+ * Allocate a cache line aligned array for the planet store. Large arrays
+ * are aligned to a huge page and marked for transparent huge pages before
+ * they are first touched, which cuts TLB misses with millions of planets.
+ * 
+ * @param count Number of elements.
+ * @param size Size of each element.
+ * @return 
+ */
+void * allocateStoreArray(size_t count, size_t size)
+{
+  void *data;
+  size_t align;
+  
+  align = count * size >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : STORE_ALIGN;
+  if ( posix_memalign(&data, align, count * size) )
+  {
+    printf("Cannot allocate planet memory\n");
+    exit(1);
+  }
+#ifdef MADV_HUGEPAGE
+  if ( align == HUGE_PAGE_SIZE )
+  {
+    madvise(data, count * size, MADV_HUGEPAGE);
+  }
+#endif
+  memset(data, 0, count * size);
+  
+  return data;
+}
+
+
+/**
+ * Move an array of the planet store to a larger allocation.
+ * 
+ * @param data
+ * @param used Elements to keep.
+ * @param capacity Elements in the new array.
+ * @param size Size of each element.
+ * @param owned Free the old array, 0 when it is part of a mapping.
+ * @return The new array.
+ */
+void * moveStoreArray(void *data, size_t used, size_t capacity, size_t size, int owned)
+{
+  void *moved;
+  
+  moved = allocateStoreArray(capacity, size);
+  memcpy(moved, data, used * size);
+  if ( owned )
+  {
+    free(data);
+  }
+  
+  return moved;
+}
+
+
+/**
+ * Allocate the planet store with a separate array for each field.
+ * 
+ * @param count
+ * @return 
+ */
+planetStore * createPlanetStore(int count)
+{
+  planetStore *planetData;
+  
+  planetData = (planetStore *) malloc(sizeof(planetStore));
+  planetData->x = (double *) allocateStoreArray(count, sizeof(double));
+  planetData->y = (double *) allocateStoreArray(count, sizeof(double));
+  planetData->mass = (double *) allocateStoreArray(count, sizeof(double));
+  planetData->velocityX = (double *) allocateStoreArray(count, sizeof(double));
+  planetData->velocityY = (double *) allocateStoreArray(count, sizeof(double));
+  planetData->accelerationX = (double *) allocateStoreArray(count, sizeof(double));
+  planetData->accelerationY = (double *) allocateStoreArray(count, sizeof(double));
+  planetData->nearestDistance = (double *) allocateStoreArray(count, sizeof(double));
+  planetData->flash = (int *) allocateStoreArray(count, sizeof(int));
+  planetData->id = (int *) allocateStoreArray(count, sizeof(int));
+  planetData->freeIds = (int *) allocateStoreArray(count, sizeof(int));
+  planetData->count = 0;
+  planetData->capacity = count;
+  planetData->idCount = 0;
+  planetData->freeCount = 0;
+  planetData->randomCount = count;
+  planetData->dead = 0;
+  planetData->mapping = NULL;
+  planetData->mappingSize = 0;
+  planetData->step = 0;
+  planetData->time = 0;
+  planetData->seed = 0;
+  seedRandom(planetData, 0);
+  planetData->accelerationCurrent = 0;
+  planetData->stepLevel = (int *) allocateStoreArray(count, sizeof(int));
+  clearPlanetStats(&planetData->stats);
+  
+  return planetData;
+}
+
+
+/**
+ * Move the planet arrays to larger ones. Arrays mapped from a checkpoint
+ * are copied out and the mapping is released.
+ * 
+ * @param planetData
+ * @param capacity The new number of slots.
+ */
+void growPlanetStore(planetStore *planetData, int capacity)
+{
+  int owned;
+  size_t used;
+  
+  owned = planetData->mapping == NULL;
+  used = planetData->count;
+  planetData->x = (double *) moveStoreArray(planetData->x, used, capacity, sizeof(double), owned);
+  planetData->y = (double *) moveStoreArray(planetData->y, used, capacity, sizeof(double), owned);
+  planetData->mass = (double *) moveStoreArray(planetData->mass, used, capacity, sizeof(double), owned);
+  planetData->velocityX = (double *) moveStoreArray(planetData->velocityX, used, capacity, sizeof(double), owned);
+  planetData->velocityY = (double *) moveStoreArray(planetData->velocityY, used, capacity, sizeof(double), owned);
+  planetData->accelerationX = (double *) moveStoreArray(planetData->accelerationX, used, capacity, sizeof(double), owned);
+  planetData->accelerationY = (double *) moveStoreArray(planetData->accelerationY, used, capacity, sizeof(double), owned);
+  planetData->flash = (int *) moveStoreArray(planetData->flash, used, capacity, sizeof(int), owned);
+  planetData->id = (int *) moveStoreArray(planetData->id, used, capacity, sizeof(int), owned);
+  planetData->nearestDistance = (double *) moveStoreArray(planetData->nearestDistance, used, capacity, sizeof(double), 1);
+  planetData->stepLevel = (int *) moveStoreArray(planetData->stepLevel, used, capacity, sizeof(int), 1);
+  planetData->freeIds = (int *) moveStoreArray(planetData->freeIds, planetData->freeCount, capacity, sizeof(int), 1);
+  
+  if ( planetData->mapping )
+  {
+    munmap(planetData->mapping, planetData->mappingSize);
+    planetData->mapping = NULL;
+  }
+  planetData->capacity = capacity;
+}
+
+
+/**
+ * Add a planet after the ones in use. It gets an id that has never been
+ * used while there are any, then a free one, and the store doubles when
+ * neither is left. The caller sets its position, velocity and mass.
+ * 
+ * @param planetData
+ * @return The slot of the new planet.
+ */
+int addPlanet(planetStore *planetData)
+{
+  int s, id;
+  
+  if ( planetData->idCount == planetData->capacity && planetData->freeCount == 0 )
+  {
+    growPlanetStore(planetData, 2 * planetData->capacity + STORE_GROW_MIN);
+  }
+  
+  if ( planetData->idCount < planetData->capacity )
+  {
+    id = planetData->idCount++;
+  }
+  else
+  {
+    id = planetData->freeIds[--planetData->freeCount];
+  }
+  
+  s = planetData->count++;
+  planetData->id[s] = id;
+  planetData->flash[s] = 0;
+  planetData->accelerationX[s] = 0;
+  planetData->accelerationY[s] = 0;
+  planetData->nearestDistance[s] = DBL_MAX;
+  
+  return s;
+}
+
+
+/**
+ * Move the planets that still have mass to the front of the arrays, in
+ * slot order so the results stay the same for any thread count, and drop
+ * the rest.
+ * 
+ * @param planetData
+ */
+void compactPlanets(planetStore *planetData)
+{
+  int s, live;
+  
+  live = 0;
+  for(s = 0; s < planetData->count; s++)
+  {
+    if ( !(planetData->mass[s] > 0) )
+    {
+      planetData->freeIds[planetData->freeCount++] = planetData->id[s];
+      continue;
+    }
+    
+    if ( s != live )
+    {
+      planetData->x[live] = planetData->x[s];
+      planetData->y[live] = planetData->y[s];
+      planetData->mass[live] = planetData->mass[s];
+      planetData->velocityX[live] = planetData->velocityX[s];
+      planetData->velocityY[live] = planetData->velocityY[s];
+      planetData->accelerationX[live] = planetData->accelerationX[s];
+      planetData->accelerationY[live] = planetData->accelerationY[s];
+      planetData->nearestDistance[live] = planetData->nearestDistance[s];
+      planetData->flash[live] = planetData->flash[s];
+      planetData->id[live] = planetData->id[s];
+    }
+    live++;
+  }
+  
+  planetData->count = live;
+  planetData->dead = 0;
+}
+
+
+/**
+ * Fill in the field offsets and file size of a checkpoint, each field array
+ * starts on a page boundary so it can be mapped in place.
+ * 
+ * @param header
+ * @param capacity The number of planet ids.
+ */
+void getCheckpointLayout(checkpointHeader *header, int capacity)
+{
+  long long offset;
+  int field;
+  
+  offset = (sizeof(checkpointHeader) + CHECKPOINT_ALIGN - 1) / CHECKPOINT_ALIGN * CHECKPOINT_ALIGN;
+  for(field = 0; field < CHECKPOINT_FIELDS; field++)
+  {
+    header->fieldOffset[field] = offset;
+    
+    // the flash counters and ids are int fields
+    offset += (long long)capacity * (field >= CHECKPOINT_FIELDS - CHECKPOINT_INT_FIELDS ? sizeof(int) : sizeof(double));
+    offset = (offset + CHECKPOINT_ALIGN - 1) / CHECKPOINT_ALIGN * CHECKPOINT_ALIGN;
+  }
+  header->size = offset;
+}
+
+
+/**
+ * Write the planets and view to a checkpoint file. The file is written
+ * beside the target and renamed over it so a crash never leaves a partial
+ * checkpoint.
+ * 
+ * @param path
+ * @param planets
+ * @param timeFactor
+ * @param cx The view center.
+ * @param cy
+ * @param zoomFactor
+ * @return 0 on success, -1 on failure.
+ */
+int writeCheckpoint(char *path, planetStore *planets, double timeFactor, double cx, double cy, double zoomFactor)
+{
+  checkpointHeader header;
+  FILE *file;
+  char *temp;
+  void *fields[CHECKPOINT_FIELDS];
+  size_t size;
+  int field, failed;
+  
+  memset(&header, 0, sizeof(checkpointHeader));
+  memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+  header.version = CHECKPOINT_VERSION;
+  header.count = planets->count;
+  header.capacity = planets->capacity;
+  header.step = planets->step;
+  header.time = planets->time;
+  header.timeFactor = timeFactor;
+  header.cx = cx;
+  header.cy = cy;
+  header.zoomFactor = zoomFactor;
+  header.seed = planets->seed;
+  header.random = planets->random;
+  getCheckpointLayout(&header, planets->capacity);
+  
+  fields[0] = planets->x;
+  fields[1] = planets->y;
+  fields[2] = planets->mass;
+  fields[3] = planets->velocityX;
+  fields[4] = planets->velocityY;
+  fields[5] = planets->accelerationX;
+  fields[6] = planets->accelerationY;
+  fields[7] = planets->flash;
+  fields[8] = planets->id;
+  
+  temp = (char *) malloc(strlen(path) + 5);
+  sprintf(temp, "%s.tmp", path);
+  
+  file = fopen(temp, "wb");
+  if ( file == NULL )
+  {
+    fprintf(stderr, "Cannot write checkpoint %s\n", temp);
+    free(temp);
+    return -1;
+  }
+  
+  failed = fwrite(&header, sizeof(checkpointHeader), 1, file) != 1;
+  for(field = 0; field < CHECKPOINT_FIELDS && !failed; field++)
+  {
+    size = (field >= CHECKPOINT_FIELDS - CHECKPOINT_INT_FIELDS ? sizeof(int) : sizeof(double));
+    failed = fseek(file, header.fieldOffset[field], SEEK_SET) != 0 || 
+             fwrite(fields[field], size, planets->count, file) != (size_t)planets->count;
+  }
+  
+  // pad out the last field and make sure the data is on disk before the rename
+  failed = failed || fflush(file) != 0 || ftruncate(fileno(file), header.size) != 0 || fsync(fileno(file)) != 0;
+  failed = fclose(file) != 0 || failed;
+  failed = failed || rename(temp, path) != 0;
+  
+  if ( failed )
+  {
+    fprintf(stderr, "Cannot write checkpoint %s\n", path);
+    remove(temp);
+  }
+  free(temp);
+  
+  return failed ? -1 : 0;
+}
+
+
+/**
+ * Map a checkpoint file and use its arrays as the planet store. The mapping
+ * is private so the simulation writes to its own copy of each page and only
+ * the pages that are touched get read from disk.
+ * 
+ * @param path
+ * @param header Filled in with the checkpoint header.
+ * @return 
+ */
+planetStore * restoreCheckpoint(char *path, checkpointHeader *header)
+{
+  planetStore *planetData;
+  checkpointHeader expected;
+  struct stat status;
+  char *data, *used;
+  int fd, s;
+  
+  fd = open(path, O_RDONLY);
+  if ( fd < 0 || fstat(fd, &status) != 0 )
+  {
+    printf("Cannot open checkpoint %s\n", path);
+    exit(1);
+  }
+  
+  if ( status.st_size < (off_t)sizeof(checkpointHeader) )
+  {
+    printf("Checkpoint %s is too short\n", path);
+    exit(1);
+  }
+  
+  data = (char *) mmap(NULL, status.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if ( data == MAP_FAILED )
+  {
+    printf("Cannot map checkpoint %s\n", path);
+    exit(1);
+  }
+  memcpy(header, data, sizeof(checkpointHeader));
+  
+  // check the header against the layout this build would write
+  if ( memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0 || header->version != CHECKPOINT_VERSION )
+  {
+    printf("%s is not a version %d checkpoint\n", path, CHECKPOINT_VERSION);
+    exit(1);
+  }
+  if ( header->count < 0 || header->capacity < header->count )
+  {
+    printf("Checkpoint %s is corrupt\n", path);
+    exit(1);
+  }
+  getCheckpointLayout(&expected, header->capacity);
+  if ( header->size != status.st_size || header->size != expected.size || 
+       memcmp(header->fieldOffset, expected.fieldOffset, sizeof(expected.fieldOffset)) != 0 )
+  {
+    printf("Checkpoint %s is corrupt\n", path);
+    exit(1);
+  }
+  
+  // start reading the whole file in the background
+  madvise(data, status.st_size, MADV_WILLNEED);
+  
+  planetData = (planetStore *) malloc(sizeof(planetStore));
+  planetData->x = (double *) (data + header->fieldOffset[0]);
+  planetData->y = (double *) (data + header->fieldOffset[1]);
+  planetData->mass = (double *) (data + header->fieldOffset[2]);
+  planetData->velocityX = (double *) (data + header->fieldOffset[3]);
+  planetData->velocityY = (double *) (data + header->fieldOffset[4]);
+  planetData->accelerationX = (double *) (data + header->fieldOffset[5]);
+  planetData->accelerationY = (double *) (data + header->fieldOffset[6]);
+  planetData->flash = (int *) (data + header->fieldOffset[7]);
+  planetData->id = (int *) (data + header->fieldOffset[8]);
+  planetData->nearestDistance = (double *) allocateStoreArray(header->capacity, sizeof(double));
+  planetData->count = header->count;
+  planetData->capacity = header->capacity;
+  planetData->randomCount = header->capacity;
+  planetData->dead = 0;
+  planetData->mapping = data;
+  planetData->mappingSize = status.st_size;
+  planetData->step = header->step;
+  planetData->time = header->time;
+  planetData->seed = header->seed;
+  planetData->random = header->random;
+  planetData->accelerationCurrent = 0;
+  planetData->stepLevel = (int *) allocateStoreArray(header->capacity, sizeof(int));
+  
+  // the ids not in use below the highest one are free
+  used = (char *) calloc(header->capacity, 1);
+  planetData->idCount = 0;
+  for(s = 0; s < header->count; s++)
+  {
+    if ( planetData->id[s] < 0 || planetData->id[s] >= header->capacity || used[planetData->id[s]] )
+    {
+      printf("Checkpoint %s is corrupt\n", path);
+      exit(1);
+    }
+    used[planetData->id[s]] = 1;
+    if ( planetData->id[s] >= planetData->idCount ) planetData->idCount = planetData->id[s] + 1;
+  }
+  planetData->freeIds = (int *) allocateStoreArray(header->capacity, sizeof(int));
+  planetData->freeCount = 0;
+  for(s = 0; s < planetData->idCount; s++)
+  {
+    if ( !used[s] ) planetData->freeIds[planetData->freeCount++] = s;
+  }
+  free(used);
+  updatePlanetStats(planetData);
+  
+  return planetData;
+}
+
+
+// trajectory being recorded, finished when the program exits
+trajectoryRecorder *activeTrajectory = NULL;
+
+
+/**
+ * Start recording a trajectory, the frames are appended by a writer thread
+ * and the file is finished when the program exits. A seek index holding
+ * the offset of each frame is written beside it as path.idx.
+ * 
+ * @param path
+ * @param every Steps between frames.
+ * @param error Largest error of the recorded positions in m and velocities in m/s.
+ * @return 
+ */
+trajectoryRecorder * openTrajectory(char *path, long every, double error)
+{
+  trajectoryRecorder *recorder;
+  trajectoryHeader header;
+  char *indexPath;
+  
+  recorder = (trajectoryRecorder *) calloc(1, sizeof(trajectoryRecorder));
+  recorder->path = path;
+  recorder->every = every;
+  recorder->quantum = 2 * error;
+  
+  indexPath = (char *) malloc(strlen(path) + 5);
+  sprintf(indexPath, "%s.idx", path);
+  recorder->file = fopen(path, "wb");
+  recorder->index = fopen(indexPath, "wb");
+  if ( recorder->file == NULL || recorder->index == NULL )
+  {
+    printf("Cannot write trajectory %s\n", recorder->file == NULL ? path : indexPath);
+    exit(1);
+  }
+  free(indexPath);
+  
+  memset(&header, 0, sizeof(trajectoryHeader));
+  memcpy(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic));
+  header.version = TRAJECTORY_VERSION;
+  header.quantum = recorder->quantum;
+  header.every = every;
+  header.keyInterval = TRAJECTORY_KEY_INTERVAL;
+  if ( fwrite(&header, sizeof(trajectoryHeader), 1, recorder->file) != 1 )
+  {
+    printf("Cannot write trajectory %s\n", path);
+    exit(1);
+  }
+  recorder->offset = sizeof(trajectoryHeader);
+  
+  pthread_mutex_init(&recorder->mutex, NULL);
+  pthread_cond_init(&recorder->filled, NULL);
+  pthread_cond_init(&recorder->emptied, NULL);
+  pthread_create(&recorder->thread, NULL, &trajectoryWorker, recorder);
+  
+  activeTrajectory = recorder;
+  atexit(closeTrajectory);
+  
+  return recorder;
+}
+
+
+/**
+ * Queue a copy of the live planets for the writer thread, called by the
+ * physics thread between steps. Only waits when the writer has fallen a
+ * whole queue behind.
+ * 
+ * @param recorder
+ * @param planets
+ */
+void recordTrajectory(trajectoryRecorder *recorder, planetStore *planets)
+{
+  trajectorySlot *slot;
+  int pi, count;
+  
+  pthread_mutex_lock(&recorder->mutex);
+  while ( recorder->queued == TRAJECTORY_QUEUE && !recorder->closing )
+  {
+    pthread_cond_wait(&recorder->emptied, &recorder->mutex);
+  }
+  if ( recorder->closing || recorder->failed )
+  {
+    pthread_mutex_unlock(&recorder->mutex);
+    return;
+  }
+  
+  // the slot after the queued frames is not touched by the writer
+  slot = &recorder->slots[(recorder->head + recorder->queued) % TRAJECTORY_QUEUE];
+  pthread_mutex_unlock(&recorder->mutex);
+  
+  if ( slot->size < planets->count )
+  {
+    slot->size = planets->capacity;
+    slot->x = (double *) realloc(slot->x, slot->size * sizeof(double));
+    slot->y = (double *) realloc(slot->y, slot->size * sizeof(double));
+    slot->velocityX = (double *) realloc(slot->velocityX, slot->size * sizeof(double));
+    slot->velocityY = (double *) realloc(slot->velocityY, slot->size * sizeof(double));
+    slot->mass = (double *) realloc(slot->mass, slot->size * sizeof(double));
+    slot->id = (int *) realloc(slot->id, slot->size * sizeof(int));
+  }
+  
+  count = 0;
+  for(pi = 0; pi < planets->count; pi++)
+  {
+    if ( planets->mass[pi] > 0 )
+    {
+      slot->x[count] = planets->x[pi];
+      slot->y[count] = planets->y[pi];
+      slot->velocityX[count] = planets->velocityX[pi];
+      slot->velocityY[count] = planets->velocityY[pi];
+      slot->mass[count] = planets->mass[pi];
+      slot->id[count] = planets->id[pi];
+      count++;
+    }
+  }
+  slot->count = count;
+  slot->ids = planets->idCount;
+  slot->step = planets->step;
+  slot->time = planets->time;
+  
+  pthread_mutex_lock(&recorder->mutex);
+  if ( !recorder->closing )
+  {
+    recorder->queued++;
+    pthread_cond_signal(&recorder->filled);
+  }
+  pthread_mutex_unlock(&recorder->mutex);
+}
+
+
+/**
+ * Trajectory writer thread, encodes and appends the queued frames until
+ * the recorder is closed and the queue is empty.
+ * 
+ * @param args The trajectoryRecorder.
+ */
+void * trajectoryWorker(void *args)
+{
+  trajectoryRecorder *recorder;
+  trajectorySlot *slot;
+  int failed;
+  
+  recorder = (trajectoryRecorder *) args;
+  
+  pthread_mutex_lock(&recorder->mutex);
+  while (1)
+  {
+    while ( recorder->queued == 0 && !recorder->closing )
+    {
+      pthread_cond_wait(&recorder->filled, &recorder->mutex);
+    }
+    if ( recorder->queued == 0 ) break;
+    
+    // write outside the lock so the physics thread can queue the next frame
+    slot = &recorder->slots[recorder->head];
+    pthread_mutex_unlock(&recorder->mutex);
+    
+    failed = !recorder->failed && writeTrajectoryFrame(recorder, slot) != 0;
+    if ( failed )
+    {
+      fprintf(stderr, "Cannot write trajectory %s, recording stopped\n", recorder->path);
+    }
+    
+    pthread_mutex_lock(&recorder->mutex);
+    if ( failed ) recorder->failed = 1;
+    recorder->head = (recorder->head + 1) % TRAJECTORY_QUEUE;
+    recorder->queued--;
+    pthread_cond_signal(&recorder->emptied);
+  }
+  pthread_mutex_unlock(&recorder->mutex);
+  
+  return NULL;
+}
+
+
+/**
+ * Encode a frame against the previous one and append it and its index
+ * entry. Values are quantized before taking differences so the error
+ * never builds up from frame to frame.
+ * 
+ * @param recorder
+ * @param slot
+ * @return 0 on success, -1 on failure.
+ */
+int writeTrajectoryFrame(trajectoryRecorder *recorder, trajectorySlot *slot)
+{
+  trajectoryFrame frame;
+  trajectoryIndex entry;
+  unsigned char *out;
+  long long *reference, value, difference;
+  double *fields[4];
+  int pi, id, last, key, known, massChanged, field;
+  
+  // grow the references to cover every id
+  if ( slot->ids > recorder->ids )
+  {
+    recorder->reference = (long long *) realloc(recorder->reference, 4 * (size_t)slot->ids * sizeof(long long));
+    recorder->referenceMass = (double *) realloc(recorder->referenceMass, slot->ids * sizeof(double));
+    recorder->seen = (long long *) realloc(recorder->seen, slot->ids * sizeof(long long));
+    for(id = recorder->ids; id < slot->ids; id++)
+    {
+      recorder->seen[id] = -1;
+    }
+    recorder->ids = slot->ids;
+  }
+  if ( recorder->bufferSize < (size_t)slot->count * TRAJECTORY_PLANET_BYTES )
+  {
+    recorder->bufferSize = (size_t)slot->count * TRAJECTORY_PLANET_BYTES;
+    recorder->buffer = (unsigned char *) realloc(recorder->buffer, recorder->bufferSize);
+  }
+  
+  fields[0] = slot->x;
+  fields[1] = slot->y;
+  fields[2] = slot->velocityX;
+  fields[3] = slot->velocityY;
+  
+  key = recorder->frames % TRAJECTORY_KEY_INTERVAL == 0;
+  out = recorder->buffer;
+  last = -1;
+  for(pi = 0; pi < slot->count; pi++)
+  {
+    id = slot->id[pi];
+    reference = &recorder->reference[4 * (size_t)id];
+    
+    // planets new to this frame and every planet of a key frame start from 0
+    known = !key && recorder->seen[id] == recorder->frames - 1;
+    if ( !known )
+    {
+      reference[0] = reference[1] = reference[2] = reference[3] = 0;
+    }
+    massChanged = !known || slot->mass[pi] != recorder->referenceMass[id];
+    
+    // zigzag coding keeps small negative differences short
+    difference = id - last;
+    out += putTrajectoryVarint(out, ((((unsigned long long)difference << 1) ^ (difference >> 63)) << 1) | massChanged);
+    for(field = 0; field < 4; field++)
+    {
+      value = quantizeTrajectory(fields[field][pi], recorder->quantum);
+      difference = value - reference[field];
+      out += putTrajectoryVarint(out, ((unsigned long long)difference << 1) ^ (difference >> 63));
+      reference[field] = value;
+    }
+    if ( massChanged )
+    {
+      memcpy(out, &slot->mass[pi], sizeof(double));
+      out += sizeof(double);
+      recorder->referenceMass[id] = slot->mass[pi];
+    }
+    
+    recorder->seen[id] = recorder->frames;
+    last = id;
+  }
+  
+  frame.step = slot->step;
+  frame.time = slot->time;
+  frame.count = slot->count;
+  frame.size = out - recorder->buffer;
+  entry.offset = recorder->offset;
+  entry.step = slot->step;
+  
+  // the frame reaches the file before its index entry so a reader of a
+  // growing file never finds an entry for a missing frame
+  if ( fwrite(&frame, sizeof(trajectoryFrame), 1, recorder->file) != 1 || 
+       fwrite(recorder->buffer, 1, frame.size, recorder->file) != (size_t)frame.size || 
+       fflush(recorder->file) != 0 || 
+       fwrite(&entry, sizeof(trajectoryIndex), 1, recorder->index) != 1 || 
+       fflush(recorder->index) != 0 )
+  {
+    return -1;
+  }
+  
+  recorder->offset += sizeof(trajectoryFrame) + frame.size;
+  recorder->frames++;
+  
+  return 0;
+}
+
+
+/**
+ * Write an unsigned varint, seven bits per byte with the high bit set on
+ * every byte but the last.
+ * 
+ * @param buffer
+ * @param value
+ * @return The number of bytes written.
+ */
+int putTrajectoryVarint(unsigned char *buffer, unsigned long long value)
+{
+  int bytes;
+  
+  bytes = 0;
+  while ( value >= 0x80 )
+  {
+    buffer[bytes++] = (unsigned char)(value | 0x80);
+    value >>= 7;
+  }
+  buffer[bytes++] = (unsigned char)value;
+  
+  return bytes;
+}
+
+
+/**
+ * Round a value to the nearest multiple of the quantum, values out of
+ * range are clamped and not a number is stored as 0.
+ * 
+ * @param value
+ * @param quantum
+ * @return The number of quanta.
+ */
+long long quantizeTrajectory(double value, double quantum)
+{
+  value /= quantum;
+  if ( value != value ) return 0;
+  if ( value > TRAJECTORY_LIMIT ) value = TRAJECTORY_LIMIT;
+  if ( value < -TRAJECTORY_LIMIT ) value = -TRAJECTORY_LIMIT;
+  
+  return llround(value);
+}
+
+
+/**
+ * Write the frames still queued and close the trajectory, registered with
+ * atexit so every way of quitting finishes the file.
+ */
+void closeTrajectory(void)
+{
+  trajectoryRecorder *recorder;
+  
+  recorder = activeTrajectory;
+  if ( recorder == NULL ) return;
+  activeTrajectory = NULL;
+  
+  pthread_mutex_lock(&recorder->mutex);
+  recorder->closing = 1;
+  pthread_cond_broadcast(&recorder->filled);
+  pthread_cond_broadcast(&recorder->emptied);
+  pthread_mutex_unlock(&recorder->mutex);
+  pthread_join(recorder->thread, NULL);
+  
+  fclose(recorder->file);
+  fclose(recorder->index);
+  printf("# trajectory %s: %lld frames, %lld bytes\n", recorder->path, recorder->frames, recorder->offset);
+}
+
+
+/**
+ * Map a recorded trajectory and its seek index for replay. Frames are
+ * decoded straight from the mapped pages, so only the frames that are
+ * shown are ever read from disk.
+ * 
+ * @param path
+ * @return 
+ */
+trajectoryReplay * openReplay(char *path)
+{
+  trajectoryReplay *replay;
+  char *indexPath;
+  long long frame;
+  trajectoryFrame *header;
+  
+  replay = (trajectoryReplay *) calloc(1, sizeof(trajectoryReplay));
+  replay->data = (unsigned char *) mapReplayFile(path, &replay->size);
+  
+  indexPath = (char *) malloc(strlen(path) + 5);
+  sprintf(indexPath, "%s.idx", path);
+  replay->index = (trajectoryIndex *) mapReplayFile(indexPath, &replay->indexSize);
+  free(indexPath);
+  
+  replay->header = (trajectoryHeader *) replay->data;
+  if ( replay->size < sizeof(trajectoryHeader) || 
+       memcmp(replay->header->magic, TRAJECTORY_MAGIC, sizeof(replay->header->magic)) != 0 || 
+       replay->header->version != TRAJECTORY_VERSION || replay->header->keyInterval < 1 )
+  {
+    printf("%s is not a version %d trajectory\n", path, TRAJECTORY_VERSION);
+    exit(1);
+  }
+  
+  // a recording cut short can have index entries past the last whole frame
+  replay->frames = replay->indexSize / sizeof(trajectoryIndex);
+  for(frame = 0; frame < replay->frames; frame++)
+  {
+    header = (trajectoryFrame *) (replay->data + replay->index[frame].offset);
+    if ( replay->index[frame].offset < (long long)sizeof(trajectoryHeader) || 
+         replay->index[frame].offset + (long long)sizeof(trajectoryFrame) > (long long)replay->size || 
+         header->count < 0 || header->size < 0 || 
+         replay->index[frame].offset + (long long)sizeof(trajectoryFrame) + header->size > (long long)replay->size )
+    {
+      break;
+    }
+  }
+  replay->frames = frame;
+  if ( replay->frames == 0 )
+  {
+    printf("Trajectory %s has no frames\n", path);
+    exit(1);
+  }
+  
+  replay->frame = -1;
+  replay->target = 0;
+  replay->direction = 1;
+  replay->speed = REPLAY_FPS;
+  replay->jump = -1;
+  
+  return replay;
+}
+
+
+/**
+ * Map a whole file read only.
+ * 
+ * @param path
+ * @param size Set to the file size.
+ * @return 
+ */
+void * mapReplayFile(char *path, size_t *size)
+{
+  struct stat status;
+  void *data;
+  int fd;
+  
+  fd = open(path, O_RDONLY);
+  if ( fd < 0 || fstat(fd, &status) != 0 )
+  {
+    printf("Cannot open trajectory %s\n", path);
+    exit(1);
+  }
+  if ( status.st_size == 0 )
+  {
+    printf("Trajectory %s has no frames\n", path);
+    exit(1);
+  }
+  
+  data = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if ( data == MAP_FAILED )
+  {
+    printf("Cannot map trajectory %s\n", path);
+    exit(1);
+  }
+  *size = status.st_size;
+  
+  return data;
+}
+
+
+/**
+ * Handle a playback key: space pauses, r reverses, t and T halve and
+ * double the speed, , and . step one frame, < and > jump a tenth of the
+ * recording and a frame number followed by Enter jumps to that frame.
+ * 
+ * @param replay
+ * @param key
+ * @param now Wall time in seconds.
+ */
+void controlReplay(trajectoryReplay *replay, char key, double now)
+{
+  long long jump;
+  
+  jump = (long long)(replay->frames * REPLAY_JUMP) + 1;
+  
+  if ( key >= '0' && key <= '9' )
+  {
+    replay->jump = (replay->jump < 0 ? 0 : 10 * replay->jump) + key - '0';
+    return;
+  }
+  
+  switch( key )
+  {
+    case ' ':
+      replay->paused = !replay->paused;
+      break;
+      
+    case 'r':
+      replay->direction = -replay->direction;
+      break;
+      
+    case 't':
+      if ( replay->speed > 1 ) replay->speed /= 2;
+      break;
+      
+    case 'T':
+      if ( replay->speed < REPLAY_FPS * 1024 ) replay->speed *= 2;
+      break;
+      
+    case ',':
+    case '.':
+      replay->paused = 1;
+      replay->target += key == '.' ? 1 : -1;
+      break;
+      
+    case '<':
+      replay->target -= jump;
+      break;
+      
+    case '>':
+      replay->target += jump;
+      break;
+      
+    case '\r':
+      if ( replay->jump >= 0 ) replay->target = replay->jump;
+      break;
+  }
+  replay->jump = -1;
+  
+  // playing carries on from the new frame
+  replay->clock = now;
+}
+
+
+/**
+ * Move playback on by the frames due since the last call and decode the
+ * frame to show, playback pauses at either end of the recording.
+ * 
+ * @param replay
+ * @param now Wall time in seconds.
+ * @return 1 when the snapshot holds a new frame, 0 when it is unchanged.
+ */
+int advanceReplay(trajectoryReplay *replay, double now)
+{
+  long long due;
+  
+  // the clock starts with the first frame
+  if ( replay->frame < 0 ) replay->clock = now;
+  
+  if ( !replay->paused )
+  {
+    due = (long long)((now - replay->clock) * replay->speed);
+    if ( due > 0 )
+    {
+      replay->target += replay->direction * due;
+      replay->clock += due / replay->speed;
+    }
+  }
+  else
+  {
+    replay->clock = now;
+  }
+  
+  if ( replay->target < 0 || replay->target >= replay->frames )
+  {
+    replay->target = replay->target < 0 ? 0 : replay->frames - 1;
+    if ( replay->frame >= 0 ) replay->paused = 1;
+  }
+  
+  if ( replay->target == replay->frame ) return 0;
+  
+  seekReplay(replay, replay->target);
+  return 1;
+}
+
+
+/**
+ * Decode a frame into the snapshot. Frames depend on the frame before
+ * them back to a key frame, so a jump decodes at most a key interval of
+ * frames, and playing forward decodes one. Decoding starts from the key
+ * frame before the previous frame so every planet has an acceleration.
+ * 
+ * @param replay
+ * @param frame
+ */
+void seekReplay(trajectoryReplay *replay, long long frame)
+{
+  long long first;
+  
+  first = frame > 0 ? frame - 1 : 0;
+  first -= first % replay->header->keyInterval;
+  
+  // carry on from the decoded frame when it is on the way
+  if ( replay->frame >= first && replay->frame < frame ) first = replay->frame + 1;
+  
+  for(; first <= frame; first++)
+  {
+    decodeReplayFrame(replay, first);
+  }
+}
+
+
+/**
+ * Decode one frame from the mapping into the snapshot, the snapshot must
+ * hold the frame before unless this is a key frame. Accelerations are not
+ * recorded, they are the change in velocity since the previous frame.
+ * 
+ * @param replay
+ * @param frame
+ */
+void decodeReplayFrame(trajectoryReplay *replay, long long frame)
+{
+  trajectoryFrame *header;
+  planetSnapshot *snapshot;
+  planetStore measured;
+  unsigned char *in, *end;
+  unsigned long long value;
+  long long *quantized, velocityX, velocityY;
+  double quantum, elapsed, mass;
+  int pi, id, key, continued, known, massChanged, field;
+  
+  header = (trajectoryFrame *) (replay->data + replay->index[frame].offset);
+  in = (unsigned char *) (header + 1);
+  end = in + header->size;
+  snapshot = &replay->snapshot;
+  quantum = replay->header->quantum;
+  key = frame % replay->header->keyInterval == 0;
+  elapsed = frame > 0 ? header->time - ((trajectoryFrame *) (replay->data + replay->index[frame - 1].offset))->time : 0;
+  
+  if ( header->count > snapshot->size )
+  {
+    freeSnapshot(snapshot);
+    allocateSnapshot(snapshot, header->count);
+  }
+  
+  id = -1;
+  for(pi = 0; pi < header->count; pi++)
+  {
+    value = getTrajectoryVarint(&in, end);
+    massChanged = value & 1;
+    value >>= 1;
+    id += (int)((value >> 1) ^ -(value & 1));
+    if ( id < 0 || in > end )
+    {
+      printf("Trajectory frame %lld is corrupt\n", frame);
+      exit(1);
+    }
+    if ( id >= replay->ids ) growReplayIds(replay, id + 1);
+    quantized = &replay->quantized[4 * (size_t)id];
+    
+    // the same rule as the writer decides what each value is relative to,
+    // the values of an id are those of the last frame it was seen in
+    continued = replay->seen[id] == frame - 1;
+    known = continued && !key;
+    velocityX = quantized[2];
+    velocityY = quantized[3];
+    for(field = 0; field < 4; field++)
+    {
+      value = getTrajectoryVarint(&in, end);
+      quantized[field] = (known ? quantized[field] : 0) + (long long)((value >> 1) ^ -(value & 1));
+    }
+    if ( in > end )
+    {
+      printf("Trajectory frame %lld is corrupt\n", frame);
+      exit(1);
+    }
+    if ( massChanged )
+    {
+      if ( in + sizeof(double) > end )
+      {
+        printf("Trajectory frame %lld is corrupt\n", frame);
+        exit(1);
+      }
+      memcpy(&mass, in, sizeof(double));
+      in += sizeof(double);
+      
+      // a planet that gained mass merged, the display flashes it; seeking
+      // decodes frames again, each merge counts the first time only
+      if ( continued && mass != replay->mass[id] && frame > replay->counted[id] ) replay->merges[id]++;
+      replay->mass[id] = mass;
+    }
+    replay->seen[id] = frame;
+    if ( frame > replay->counted[id] ) replay->counted[id] = frame;
+    
+    snapshot->id[pi] = id;
+    snapshot->x[pi] = quantized[0] * quantum;
+    snapshot->y[pi] = quantized[1] * quantum;
+    snapshot->velocityX[pi] = quantized[2] * quantum;
+    snapshot->velocityY[pi] = quantized[3] * quantum;
+    snapshot->mass[pi] = replay->mass[id];
+    snapshot->flash[pi] = replay->merges[id];
+    snapshot->accelerationX[pi] = 0;
+    snapshot->accelerationY[pi] = 0;
+    if ( continued && elapsed > 0 )
+    {
+      snapshot->accelerationX[pi] = (quantized[2] - velocityX) * quantum / elapsed;
+      snapshot->accelerationY[pi] = (quantized[3] - velocityY) * quantum / elapsed;
+    }
+  }
+  if ( in != end )
+  {
+    printf("Trajectory frame %lld is corrupt\n", frame);
+    exit(1);
+  }
+  
+  snapshot->count = header->count;
+  snapshot->ids = replay->ids;
+  replay->frame = frame;
+  
+  // the totals come from the same code as the live planets
+  measured.x = snapshot->x;
+  measured.y = snapshot->y;
+  measured.mass = snapshot->mass;
+  measured.velocityX = snapshot->velocityX;
+  measured.velocityY = snapshot->velocityY;
+  measurePlanets(&snapshot->stats, &measured, 0, snapshot->count);
+  finishPlanetStats(&snapshot->stats);
+}
+
+
+/**
+ * Grow the arrays kept for each planet id.
+ * 
+ * @param replay
+ * @param ids The number of ids to cover.
+ */
+void growReplayIds(trajectoryReplay *replay, int ids)
+{
+  int id;
+  
+  if ( ids < 2 * replay->ids ) ids = 2 * replay->ids;
+  replay->quantized = (long long *) realloc(replay->quantized, 4 * (size_t)ids * sizeof(long long));
+  replay->mass = (double *) realloc(replay->mass, ids * sizeof(double));
+  replay->seen = (long long *) realloc(replay->seen, ids * sizeof(long long));
+  replay->counted = (long long *) realloc(replay->counted, ids * sizeof(long long));
+  replay->merges = (int *) realloc(replay->merges, ids * sizeof(int));
+  for(id = replay->ids; id < ids; id++)
+  {
+    replay->seen[id] = -1;
+    replay->counted[id] = -1;
+    replay->merges[id] = 0;
+  }
+  replay->ids = ids;
+}
+
+
+/**
+ * Read an unsigned varint written by putTrajectoryVarint, stopping at the
+ * end of the frame.
+ * 
+ * @param in Advanced past the varint.
+ * @param end End of the frame.
+ * @return 
+ */
+unsigned long long getTrajectoryVarint(unsigned char **in, unsigned char *end)
+{
+  unsigned long long value;
+  unsigned char *p;
+  int shift;
+  
+  value = 0;
+  shift = 0;
+  for(p = *in; p < end && shift < 64; p++, shift += 7)
+  {
+    value |= (unsigned long long)(*p & 0x7F) << shift;
+    if ( !(*p & 0x80) )
+    {
+      *in = p + 1;
+      return value;
+    }
+  }
+  
+  // runs off the end, the caller sees in past the frame
+  *in = end + 1;
+  return 0;
+}
+
+
+/**
+ * Describe the playback position for the status line.
+ * 
+ * @param replay
+ * @param text
+ */
+void describeReplay(trajectoryReplay *replay, char *text)
+{
+  trajectoryFrame *header;
+  
+  header = (trajectoryFrame *) (replay->data + replay->index[replay->frame].offset);
+  sprintf(text, "frame %lld/%lld  step %lld  %G s  %s %G fps", replay->frame, replay->frames - 1, header->step, header->time, 
+          replay->paused ? "paused" : (replay->direction > 0 ? "playing" : "reversing"), replay->speed);
+  if ( replay->jump >= 0 ) sprintf(text + strlen(text), "  jump to %lld", replay->jump);
+}
+
+
+/**
+ * Randomize the location, velocity, and mass of all planets.
+ */
+void randomizePlanets(planetStore *planetData)
+{
+  seedPlanets(planetData, (unsigned int)time((time_t *)NULL));
+}
+
+
+/**
+ * Randomize the planets from the given random seed.
+ * 
+ * @param planetData
+ * @param seed
+ */
+void seedPlanets(planetStore *planetData, unsigned int seed)
+{
+  int i;
+  double r, a;
+  
+  // seed
+  planetData->seed = seed;
+  seedRandom(planetData, seed);
+
+  // start over with the first ids
+  planetData->count = planetData->randomCount;
+  planetData->idCount = planetData->randomCount;
+  planetData->freeCount = 0;
+  
+  // loop through all planets
+  for(i = 0; i < planetData->count; i++) {
+    // randomize polar coordinates from center
+    r = MAXPOS * (getRandom(planetData));
+    a = (2 * M_PI) * (getRandom(planetData));
+    
+    // convert polar coordinates into rectangular
+    planetData->x[i] = (r * cos(a));
+    if( isnan(planetData->x[i]) )
+    {
+      planetData->x[i] = 0;
+    }
+    else if( isinf(planetData->x[i]) )
+    {
+      planetData->x[i] = r;
+    }
+
+    planetData->y[i] = (r * sin(a));
+    if( isnan(planetData->y[i]) )
+    {
+      planetData->y[i] = 0;
+    }
+    else if( isinf(planetData->y[i]) )
+    {
+      planetData->y[i] = r;
+    }
+      
+    // random planet velocity
+    planetData->velocityX[i] = (2 * MAXV * (getRandom(planetData))) - MAXV;
+    planetData->velocityY[i] = (2 * MAXV * (getRandom(planetData))) - MAXV;
+    
+    // random mass
+    planetData->mass[i] = MAXKG * (pow(1/sqrt(M_PI), -1 * pow(getRandom(planetData), 2) / 0.75) - 1);
+    
+    // reset flash flag
+    planetData->flash[i] = 0;
+    
+    planetData->id[i] = i;
+  }
+  
+  // the random mass can come out as zero
+  compactPlanets(planetData);
+  updatePlanetStats(planetData);
+}
+
+
+/**
+ * Start the scenario random generator from a seed. The generator state is
+ * kept with the planets so a checkpoint continues the same sequence.
+ * 
+ * @param planetData
+ * @param seed
+ */
+void seedRandom(planetStore *planetData, unsigned int seed)
+{
+  unsigned long long z;
+  
+  // splitmix64 spreads the seed over the state, which must not be zero
+  z = seed + 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z ^= z >> 31;
+  planetData->random = z ? z : 1;
+}
+
+
+/**
+ * Get the next number of the scenario random generator, xorshift64*.
+ * 
+ * @param planetData
+ * @return A number from 0 up to but not including 1.
+ */
+double getRandom(planetStore *planetData)
+{
+  unsigned long long x;
+  
+  x = planetData->random;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  planetData->random = x;
+  
+  return ((x * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/**
+ * Clear the planet settings.
+ * 
+ * @param planetData
+ */
+void clearPlanets(planetStore *planetData)
+{
+  int i;
+
+  for(i = 0; i < planetData->count; i++) {
+    planetData->freeIds[planetData->freeCount++] = planetData->id[i];
+  }
+  planetData->count = 0;
+}
+
+
+/**
+ * Create a large gravity well.
+ * 
+ * @param planetData
+ */
+void createGravityWell(planetStore *planetData, int cx, int cy)
+{
+  int pi = addPlanet(planetData);
+  planetData->x[pi] = 0 - cx;
+  planetData->y[pi] = 0 - cy;
+  planetData->mass[pi] = MAXKG * (int)(1000 * (getRandom(planetData)));
+  planetData->velocityX[pi] = 0;
+  planetData->velocityY[pi] = 0;
+  
+}
+
+
+/**
+ * Create a binary orbiting gravity well.
+ * 
+ * @param planetData
+ * @param cx
+ * @param cy
+ */
+void createBinaryWell(planetStore *planetData, int cx, int cy)
+{
+  int pi;
+  
+  pi = addPlanet(planetData);
+  planetData->x[pi] = 0 - cx;
+  planetData->y[pi] = 500 - cy;
+  planetData->mass[pi] = MAXKG * (int)(1000 * (getRandom(planetData)));
+  planetData->velocityX[pi] = 2;
+  planetData->velocityY[pi] = 0;
+
+  pi = addPlanet(planetData);
+  planetData->x[pi] = 0 - cx;
+  planetData->y[pi] = -500 - cy;
+  planetData->mass[pi] = MAXKG * (int)(1000 * (getRandom(planetData)));
+  planetData->velocityX[pi] = -2;
+  planetData->velocityY[pi] = 0;
+}
+
+
+/**
+ * Create a heliocentric system.
+ * 
+ * @param planetData
+ * @param cx
+ * @param cy
+ */
+void createHeliocentricSystem(planetStore *planetData, int cx, int cy)
+{
+  int pi;
+
+  pi = addPlanet(planetData);
+  planetData->x[pi] = 0 - cx;
+  planetData->y[pi] = 0 - cy;
+  planetData->mass[pi] = 2e14;
+  planetData->velocityX[pi] = 0;
+  planetData->velocityY[pi] = 0;
+
+  pi = addPlanet(planetData);
+  planetData->x[pi] = 0 - cx;
+  planetData->y[pi] = -200 - cy;
+  planetData->mass[pi] = 5e8;
+  planetData->velocityX[pi] = -8;
+  planetData->velocityY[pi] = 0;
+
+  pi = addPlanet(planetData);
+  planetData->x[pi] = -500 - cx;
+  planetData->y[pi] = 0 - cy;
+  planetData->mass[pi] = 5e8;
+  planetData->velocityX[pi] = 0;
+  planetData->velocityY[pi] = 5;
+
+  pi = addPlanet(planetData);
+  planetData->x[pi] = 800 - cx;
+  planetData->y[pi] = 0 - cy;
+  planetData->mass[pi] = 5e8;
+  planetData->velocityX[pi] = 0;
+  planetData->velocityY[pi] = -4.5;
+
+  pi = addPlanet(planetData);
+  planetData->x[pi] = 0 - cx;
+  planetData->y[pi] = 1200 - cy;
+  planetData->mass[pi] = 5e8;
+  planetData->velocityX[pi] = 3.8;
+  planetData->velocityY[pi] = 0;
+}
+
+
+/**
+ * Create a geocentric system.
+ * 
+ * @param planetData
+ * @param cx
+ * @param cy
+ */
+void createGeocentricSystem(planetStore *planetData, int cx, int cy)
+{
+  int pi;
+
+  pi = addPlanet(planetData);
+  planetData->x[pi] = 0 - cx;
+  planetData->y[pi] = 0 - cy;
+  planetData->mass[pi] = 5e8;
+  planetData->velocityX[pi] = 0;
+  planetData->velocityY[pi] = 0;
+
+  pi = addPlanet(planetData);
+  planetData->x[pi] = 0 - cx;
+  planetData->y[pi] = -200 - cy;
+  planetData->mass[pi] = 5e8;
+  planetData->velocityX[pi] = -8;
+  planetData->velocityY[pi] = 0;
+
+  pi = addPlanet(planetData);
+  planetData->x[pi] = -500 - cx;
+  planetData->y[pi] = 0 - cy;
+  planetData->mass[pi] = 5e8;
+  planetData->velocityX[pi] = 0;
+  planetData->velocityY[pi] = 5;
+
+  pi = addPlanet(planetData);
+  planetData->x[pi] = 800 - cx;
+  planetData->y[pi] = 0 - cy;
+  planetData->mass[pi] = 2e14;
+  planetData->velocityX[pi] = 0;
+  planetData->velocityY[pi] = -4.5;
+
+  pi = addPlanet(planetData);
+  planetData->x[pi] = 0 - cx;
+  planetData->y[pi] = 1200 - cy;
+  planetData->mass[pi] = 5e8;
+  planetData->velocityX[pi] = 3.25;
+  planetData->velocityY[pi] = 0;
+}
+
+
+/**
+ * Create Sol planetary system out to Saturn.
+ * 
+ * @param planetData
+ * @param cx
+ * @param cy
+ */
+void createPlanetarySystem(planetStore *planetData, int cx, int cy)
+{
+  int pi;
+
+  // sol
+  pi = addPlanet(planetData);
+  planetData->x[pi] = 0 - cx;
+  planetData->y[pi] = 0 - cy;
+  planetData->mass[pi] = 1.9891e30;
+  planetData->velocityX[pi] = 0;
+  planetData->velocityY[pi] = 0;
+
+  // mercury
+  pi = addPlanet(planetData);
+  planetData->x[pi] = 0 - cx;
+  planetData->y[pi] = 57909050e3 - cy;
+  planetData->mass[pi] = 3.3022e23;
+  planetData->velocityX[pi] = 47.87e3;
+  planetData->velocityY[pi] = 0;
+
+  // venus
+  pi = addPlanet(planetData);
+  planetData->x[pi] = -108209184e3 - cx;
+  planetData->y[pi] = 0 - cy;
+  planetData->mass[pi] = 4.8685e24;
+  planetData->velocityX[pi] = 0;
+  planetData->velocityY[pi] = 35.02e3;
+
+  //earth
+  pi = addPlanet(planetData);
+  planetData->x[pi] = 149597887e3 - cx;
+  planetData->y[pi] = 0 - cy;
+  planetData->mass[pi] = 5.9736e24;
+  planetData->velocityX[pi] = 0;
+  planetData->velocityY[pi] = -29.783e3;
+
+  //moon
+  pi = addPlanet(planetData);
+  planetData->x[pi] = 149597887e3 + 384400e3 - cx; // + 384400e3
+  planetData->y[pi] = 0 - cy;
+  planetData->mass[pi] = 7.3477e22;
+  planetData->velocityX[pi] = 0;
+  planetData->velocityY[pi] = -29.783e3 - 1.022e3;
+
+  // mars
+  pi = addPlanet(planetData);
+  planetData->x[pi] = 0 - cx;
+  planetData->y[pi] = 227939150e3 - cy;
+  planetData->mass[pi] = 6.4185e23;
+  planetData->velocityX[pi] = 24.077e3;
+  planetData->velocityY[pi] = 0;
+
+  // jupiter
+  pi = addPlanet(planetData);
+  planetData->x[pi] = 0 - cx;
+  planetData->y[pi] = -778547200e3 - cy;
+  planetData->mass[pi] = 1.8986e27;
+  planetData->velocityX[pi] = -13.07e3;
+  planetData->velocityY[pi] = 0;
+
+  // saturn
+  pi = addPlanet(planetData);
+  planetData->x[pi] = 0 - cx;
+  planetData->y[pi] = 1433449369.5e3 - cy;
+  planetData->mass[pi] = 5.6846e26;
+  planetData->velocityX[pi] = 9.69e3;
+  planetData->velocityY[pi] = 0;
+}
+
+
+/**
+ * Create molniya orbit around earth.
+ * 
+ * @param planetData
+ * @param cx
+ * @param cy
+ */
+void createMolniyaOrbit(planetStore *planetData, int cx, int cy)
+{
+  int pi;
+
+  pi = addPlanet(planetData);
+  planetData->x[pi] = 0 - cx;
+  planetData->y[pi] = 0 - cy;
+  planetData->mass[pi] = 5.9736e24;
+  planetData->velocityX[pi] = 0;
+  planetData->velocityY[pi] = 0;
+
+  //satellite in molniya orbit
+  pi = addPlanet(planetData);
+  planetData->x[pi] = 6929e3 - cx; // + 384400e3
+  planetData->y[pi] = 0 - cy;
+  planetData->mass[pi] = 11000;
+  planetData->velocityX[pi] = 0;
+  planetData->velocityY[pi] = -10.0125e3;
+}
+
+
+/**
+ * calculate the distance between two planets
+ * 
+ * @param p1
+ * @param p2
+ * @return 
+ */
+double calculateDistance(int p1, int p2, planetStore *planetData)
+{
+  return sqrt(pow(planetData->x[p1] - planetData->x[p2], 2) + pow(planetData->y[p1] - planetData->y[p2], 2));
+}
+
+
+/**
+ * calculate the gravitational force between two planets
+ * 
+ * @param distance
+ * @param p1
+ * @param p2
+ * @return 
+ */
+double calculateGravitationalAcceleration(double distance, int p1, int p2, planetStore *planetData)
+{
+  return G * (planetData->mass[p1] * planetData->mass[p2] / pow(distance, 2));
+}
+
+
+/**
+ * calculate the polar direction of the gravitational force between two planets
+ * 
+ * @param p1
+ * @param p2
+ * @return 
+ */
+double calculateGravitationalDirection(int p1, int p2, planetStore *planetData)
+{
+  double direction;
+  
+  direction = atan2(planetData->y[p2] - planetData->y[p1], planetData->x[p2] - planetData->x[p1]);
+  if( isinf(direction) )
+  {
+    direction = M_PI / 2;
+  }
+  else if( isnan(direction) && (planetData->x[p2] - planetData->x[p1]) > 0 )
+  {
+    direction = 0;
+  }
+  else if( isnan(direction) && (planetData->x[p2] - planetData->x[p1]) < 0 )
+  {
+    direction = M_PI;
+  }
+  
+  return direction;
+}
+
+
+/**
+ * add the gravitational acceleration from planet 2 on planet 1 to the
+ * caller's accumulators
+ * 
+ * @param p1
+ * @param p2
+ * @param planetData
+ * @param acceleration The acceleration sum for planet 1.
+ * @param nearestDistance The nearest distance found so far for planet 1.
+ */
+void addGravitationalAcceleration(int p1, int p2, planetStore *planetData, accelerationVector *acceleration, double *nearestDistance)
+{
+  double distance, gravity, direction, accelerationX, accelerationY;
+  
+  // calculate the polar acceleration between two planets
+  distance = calculateDistance(p1, p2, planetData);
+  if ( distance < *nearestDistance )
+  {
+    *nearestDistance = distance;
+  }
+  
+  gravity = calculateGravitationalAcceleration(distance, p1, p2, planetData);
+  direction = calculateGravitationalDirection(p1, p2, planetData);
+  
+  accelerationX = (gravity / planetData->mass[p1]) * cos(direction);
+  if( isnan(accelerationX) )
+  {
+    accelerationX = 0;
+  }
+  else if( isinf(accelerationX) )
+  {
+    accelerationX = gravity / planetData->mass[p1];
+  }
+  
+  accelerationY = (gravity / planetData->mass[p1]) * sin(direction);
+  if( isnan(accelerationY) )
+  {
+    accelerationY = 0;
+  }
+  else if( isinf(accelerationY) )
+  {
+    accelerationY = gravity / planetData->mass[p1];
+  }
+  
+  acceleration->accelerationX += accelerationX;
+  acceleration->accelerationY += accelerationY;
+}
+
+
+// names used to select a force kernel on the command line
+char *kernelNames[KERNEL_COUNT] = {
+  "scalar",
+  "generic",
+  "sse2",
+  "avx2",
+  "avx512"
+};
+
+
+/**
+ * Look up a force kernel by name.
+ * 
+ * @param name
+ * @return The kernel number, KERNEL_AUTO for "auto" or -2 when unknown.
+ */
+int getForceKernelByName(char *name)
+{
+  int kernel;
+  
+  if ( strcmp(name, "auto") == 0 )
+  {
+    return KERNEL_AUTO;
+  }
+  
+  for(kernel = 0; kernel < KERNEL_COUNT; kernel++)
+  {
+    if ( strcmp(name, kernelNames[kernel]) == 0 )
+    {
+      return kernel;
+    }
+  }
+  
+  return -2;
+}
+
+
+/**
+ * Check if the running CPU can execute a force kernel.
+ * 
+ * @param kernel
+ * @return 
+ */
+int isForceKernelSupported(int kernel)
+{
+  switch( kernel )
+  {
+    case KERNEL_SCALAR:
+    case KERNEL_GENERIC:
+      return 1;
+
+#if defined(__x86_64__) || defined(__i386__)
+    case KERNEL_SSE2:
+      return __builtin_cpu_supports("sse2") != 0;
+
+    case KERNEL_AVX2:
+      return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+
+    case KERNEL_AVX512:
+      return __builtin_cpu_supports("avx512f") != 0;
+#endif
+  }
+  
+  return 0;
+}
+
+
+/**
+ * Pick the widest force kernel the running CPU supports.
+ * 
+ * @return 
+ */
+int selectForceKernel(void)
+{
+  int kernel;
+  
+  for(kernel = KERNEL_COUNT - 1; kernel > KERNEL_GENERIC; kernel--)
+  {
+    if ( isForceKernelSupported(kernel) )
+    {
+      return kernel;
+    }
+  }
+  
+  return KERNEL_GENERIC;
+}
+
+
+/**
+ * Get the function for a force kernel number.
+ * 
+ * @param kernel
+ * @return 
+ */
+forceKernel getForceKernel(int kernel)
+{
+  switch( kernel )
+  {
+    case KERNEL_SCALAR:
+      return &forceKernelScalar;
+
+    case KERNEL_SSE2:
+      return &forceKernelSSE2;
+
+    case KERNEL_AVX2:
+      return &forceKernelAVX2;
+
+    case KERNEL_AVX512:
+      return &forceKernelAVX512;
+  }
+  
+  return &forceKernelGeneric;
+}
+
+
+/**
+ * Original direct sum kernel using the polar force calculations.
+ * 
+ * @param planetData
+ * @param p The planet receiving the acceleration.
+ * @param first The first source planet.
+ * @param last One past the last source planet.
+ * @param acceleration
+ * @param nearestDistance
+ */
+void forceKernelScalar(planetStore *planetData, int p, int first, int last, accelerationVector *acceleration, double *nearestDistance)
+{
+  int i;
+  
+  for(i = first; i < last; i++) {
+    if( i != p && planetData->mass[i] > 0 ) {
+      addGravitationalAcceleration(p, i, planetData, acceleration, nearestDistance);
+    }
+  }
+}
+
+
+/**
+ * Direct sum kernel using rectangular math and a reciprocal square root,
+ * written so the compiler can vectorize it on any target. Coincident
+ * planets add no acceleration and are left to the collision pass.
+ * 
+ * @param planetData
+ * @param p The planet receiving the acceleration.
+ * @param first The first source planet.
+ * @param last One past the last source planet.
+ * @param acceleration
+ * @param nearestDistance
+ */
+void forceKernelGeneric(planetStore *planetData, int p, int first, int last, accelerationVector *acceleration, double *nearestDistance)
+{
+  int i;
+  double px, py, dx, dy, r2, inv, s, ax, ay, near2;
+  
+  px = planetData->x[p];
+  py = planetData->y[p];
+  ax = 0;
+  ay = 0;
+  near2 = DBL_MAX;
+  
+  for(i = first; i < last; i++) {
+    dx = planetData->x[i] - px;
+    dy = planetData->y[i] - py;
+    r2 = dx * dx + dy * dy;
+    
+    if ( planetData->mass[i] > 0 && r2 < near2 ) near2 = r2;
+    
+    if ( r2 > 0 )
+    {
+      inv = 1 / sqrt(r2);
+      s = G * planetData->mass[i] * inv * inv * inv;
+      ax += s * dx;
+      ay += s * dy;
+    }
+  }
+  
+  acceleration->accelerationX += ax;
+  acceleration->accelerationY += ay;
+  if ( near2 < DBL_MAX && sqrt(near2) < *nearestDistance ) *nearestDistance = sqrt(near2);
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/**
+ * SSE2 direct sum kernel, two source planets per instruction.
+ * 
+ * @param planetData
+ * @param p The planet receiving the acceleration.
+ * @param first The first source planet.
+ * @param last One past the last source planet.
+ * @param acceleration
+ * @param nearestDistance
+ */
+__attribute__((target("sse2")))
+void forceKernelSSE2(planetStore *planetData, int p, int first, int last, accelerationVector *acceleration, double *nearestDistance)
+{
+  int i;
+  double sum[2];
+  __m128d px, py, zero, big, g, one, dx, dy, r2, m, inv, s, ax, ay, near2;
+  
+  px = _mm_set1_pd(planetData->x[p]);
+  py = _mm_set1_pd(planetData->y[p]);
+  zero = _mm_setzero_pd();
+  big = _mm_set1_pd(DBL_MAX);
+  g = _mm_set1_pd(G);
+  one = _mm_set1_pd(1);
+  ax = zero;
+  ay = zero;
+  near2 = big;
+  
+  for(i = first; i + 2 <= last; i += 2) {
+    dx = _mm_sub_pd(_mm_loadu_pd(&planetData->x[i]), px);
+    dy = _mm_sub_pd(_mm_loadu_pd(&planetData->y[i]), py);
+    m = _mm_loadu_pd(&planetData->mass[i]);
+    r2 = _mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy));
+    
+    // nearest distance only counts planets with mass
+    s = _mm_cmpgt_pd(m, zero);
+    near2 = _mm_min_pd(near2, _mm_or_pd(_mm_and_pd(s, r2), _mm_andnot_pd(s, big)));
+    
+    // the mask drops the infinite terms of coincident planets
+    inv = _mm_div_pd(one, _mm_sqrt_pd(r2));
+    s = _mm_mul_pd(_mm_mul_pd(g, m), _mm_mul_pd(inv, _mm_mul_pd(inv, inv)));
+    s = _mm_and_pd(s, _mm_cmpgt_pd(r2, zero));
+    ax = _mm_add_pd(ax, _mm_mul_pd(s, dx));
+    ay = _mm_add_pd(ay, _mm_mul_pd(s, dy));
+  }
+  
+  _mm_storeu_pd(sum, ax);
+  acceleration->accelerationX += sum[0] + sum[1];
+  _mm_storeu_pd(sum, ay);
+  acceleration->accelerationY += sum[0] + sum[1];
+  _mm_storeu_pd(sum, near2);
+  if ( sum[1] < sum[0] ) sum[0] = sum[1];
+  if ( sum[0] < DBL_MAX && sqrt(sum[0]) < *nearestDistance ) *nearestDistance = sqrt(sum[0]);
+  
+  // remaining planets
+  forceKernelGeneric(planetData, p, i, last, acceleration, nearestDistance);
+}
+
+
+/**
+ * AVX2 direct sum kernel, four source planets per instruction.
+ * 
+ * @param planetData
+ * @param p The planet receiving the acceleration.
+ * @param first The first source planet.
+ * @param last One past the last source planet.
+ * @param acceleration
+ * @param nearestDistance
+ */
+__attribute__((target("avx2,fma")))
+void forceKernelAVX2(planetStore *planetData, int p, int first, int last, accelerationVector *acceleration, double *nearestDistance)
+{
+  int i;
+  double sum[4];
+  __m256d px, py, zero, big, g, one, dx, dy, r2, m, inv, s, ax, ay, near2;
+  
+  px = _mm256_set1_pd(planetData->x[p]);
+  py = _mm256_set1_pd(planetData->y[p]);
+  zero = _mm256_setzero_pd();
+  big = _mm256_set1_pd(DBL_MAX);
+  g = _mm256_set1_pd(G);
+  one = _mm256_set1_pd(1);
+  ax = zero;
+  ay = zero;
+  near2 = big;
+  
+  for(i = first; i + 4 <= last; i += 4) {
+    dx = _mm256_sub_pd(_mm256_loadu_pd(&planetData->x[i]), px);
+    dy = _mm256_sub_pd(_mm256_loadu_pd(&planetData->y[i]), py);
+    m = _mm256_loadu_pd(&planetData->mass[i]);
+    r2 = _mm256_fmadd_pd(dx, dx, _mm256_mul_pd(dy, dy));
+    
+    // nearest distance only counts planets with mass
+    near2 = _mm256_min_pd(near2, _mm256_blendv_pd(big, r2, _mm256_cmp_pd(m, zero, _CMP_GT_OQ)));
+    
+    // the mask drops the infinite terms of coincident planets
+    inv = _mm256_div_pd(one, _mm256_sqrt_pd(r2));
+    s = _mm256_mul_pd(_mm256_mul_pd(g, m), _mm256_mul_pd(inv, _mm256_mul_pd(inv, inv)));
+    s = _mm256_and_pd(s, _mm256_cmp_pd(r2, zero, _CMP_GT_OQ));
+    ax = _mm256_fmadd_pd(s, dx, ax);
+    ay = _mm256_fmadd_pd(s, dy, ay);
+  }
+  
+  _mm256_storeu_pd(sum, ax);
+  acceleration->accelerationX += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+  _mm256_storeu_pd(sum, ay);
+  acceleration->accelerationY += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+  _mm256_storeu_pd(sum, near2);
+  if ( sum[1] < sum[0] ) sum[0] = sum[1];
+  if ( sum[3] < sum[2] ) sum[2] = sum[3];
+  if ( sum[2] < sum[0] ) sum[0] = sum[2];
+  if ( sum[0] < DBL_MAX && sqrt(sum[0]) < *nearestDistance ) *nearestDistance = sqrt(sum[0]);
+  
+  // remaining planets
+  forceKernelGeneric(planetData, p, i, last, acceleration, nearestDistance);
+}
+
+
+/**
+ * AVX-512 direct sum kernel, eight source planets per instruction. The
+ * 14 bit reciprocal square root estimate is refined with two Newton steps.
+ * 
+ * @param planetData
+ * @param p The planet receiving the acceleration.
+ * @param first The first source planet.
+ * @param last One past the last source planet.
+ * @param acceleration
+ * @param nearestDistance
+ */
+__attribute__((target("avx512f")))
+void forceKernelAVX512(planetStore *planetData, int p, int first, int last, accelerationVector *acceleration, double *nearestDistance)
+{
+  int i;
+  double near2;
+  __m512d px, py, zero, big, g, half, threeHalves, dx, dy, r2, m, inv, s, ax, ay, near2v;
+  __mmask8 valid;
+  
+  px = _mm512_set1_pd(planetData->x[p]);
+  py = _mm512_set1_pd(planetData->y[p]);
+  zero = _mm512_setzero_pd();
+  big = _mm512_set1_pd(DBL_MAX);
+  g = _mm512_set1_pd(G);
+  half = _mm512_set1_pd(0.5);
+  threeHalves = _mm512_set1_pd(1.5);
+  ax = zero;
+  ay = zero;
+  near2v = big;
+  
+  for(i = first; i + 8 <= last; i += 8) {
+    dx = _mm512_sub_pd(_mm512_loadu_pd(&planetData->x[i]), px);
+    dy = _mm512_sub_pd(_mm512_loadu_pd(&planetData->y[i]), py);
+    m = _mm512_loadu_pd(&planetData->mass[i]);
+    r2 = _mm512_fmadd_pd(dx, dx, _mm512_mul_pd(dy, dy));
+    
+    // nearest distance only counts planets with mass
+    near2v = _mm512_mask_min_pd(near2v, _mm512_cmp_pd_mask(m, zero, _CMP_GT_OQ), near2v, r2);
+    
+    // inv = inv * (1.5 - 0.5 * r2 * inv * inv)
+    inv = _mm512_rsqrt14_pd(r2);
+    inv = _mm512_mul_pd(inv, _mm512_fnmadd_pd(_mm512_mul_pd(half, r2), _mm512_mul_pd(inv, inv), threeHalves));
+    inv = _mm512_mul_pd(inv, _mm512_fnmadd_pd(_mm512_mul_pd(half, r2), _mm512_mul_pd(inv, inv), threeHalves));
+    
+    // coincident planets are masked out of the sums
+    valid = _mm512_cmp_pd_mask(r2, zero, _CMP_GT_OQ);
+    s = _mm512_mul_pd(_mm512_mul_pd(g, m), _mm512_mul_pd(inv, _mm512_mul_pd(inv, inv)));
+    ax = _mm512_mask3_fmadd_pd(s, dx, ax, valid);
+    ay = _mm512_mask3_fmadd_pd(s, dy, ay, valid);
+  }
+  
+  acceleration->accelerationX += _mm512_reduce_add_pd(ax);
+  acceleration->accelerationY += _mm512_reduce_add_pd(ay);
+  near2 = _mm512_reduce_min_pd(near2v);
+  if ( near2 < DBL_MAX && sqrt(near2) < *nearestDistance ) *nearestDistance = sqrt(near2);
+  
+  // remaining planets
+  forceKernelGeneric(planetData, p, i, last, acceleration, nearestDistance);
+}
+
+#else
+
+// vector kernels are only built for x86, fall back to the generic kernel
+
+void forceKernelSSE2(planetStore *planetData, int p, int first, int last, accelerationVector *acceleration, double *nearestDistance)
+{
+  forceKernelGeneric(planetData, p, first, last, acceleration, nearestDistance);
+}
+
+void forceKernelAVX2(planetStore *planetData, int p, int first, int last, accelerationVector *acceleration, double *nearestDistance)
+{
+  forceKernelGeneric(planetData, p, first, last, acceleration, nearestDistance);
+}
+
+void forceKernelAVX512(planetStore *planetData, int p, int first, int last, accelerationVector *acceleration, double *nearestDistance)
+{
+  forceKernelGeneric(planetData, p, first, last, acceleration, nearestDistance);
+}
+
+#endif
+
+
+/**
+ * Allocate the single precision planet copy for the mixed precision kernels.
+ * 
+ * @param count The planet count.
+ * @param kernel Double precision kernel for the tiles that need it.
+ * @return 
+ */
+mixedTiles * createMixedTiles(int count, forceKernel kernel)
+{
+  mixedTiles *tiles;
+  
+  tiles = (mixedTiles *) calloc(1, sizeof(mixedTiles));
+  tiles->kernel = kernel;
+  growMixedTiles(tiles, count > 0 ? count : 1);
+  
+  return tiles;
+}
+
+
+/**
+ * Grow the single precision planet copy to hold more planets, called
+ * between steps when the planet store has grown.
+ * 
+ * @param tiles
+ * @param capacity
+ */
+void growMixedTiles(mixedTiles *tiles, int capacity)
+{
+  int tileCount;
+  
+  free(tiles->x);
+  free(tiles->y);
+  free(tiles->gm);
+  free(tiles->originX);
+  free(tiles->originY);
+  free(tiles->extent);
+  
+  tileCount = (capacity + MIXED_TILE - 1) / MIXED_TILE;
+  tiles->x = (float *) allocateStoreArray(capacity, sizeof(float));
+  tiles->y = (float *) allocateStoreArray(capacity, sizeof(float));
+  tiles->gm = (float *) allocateStoreArray(capacity, sizeof(float));
+  tiles->originX = (double *) allocateStoreArray(tileCount, sizeof(double));
+  tiles->originY = (double *) allocateStoreArray(tileCount, sizeof(double));
+  tiles->extent = (double *) allocateStoreArray(tileCount, sizeof(double));
+  tiles->capacity = capacity;
+}
+
+
+/**
+ * Convert this thread's share of the tiles to single precision relative to
+ * the center of each tile's bounding box, the threads take every threads'th
+ * tile.
+ * 
+ * @param threadArgs
+ */
+void prepareMixedTiles(calcArgs *threadArgs)
+{
+  planetStore *planetData;
+  mixedTiles *tiles;
+  double minX, maxX, minY, maxY, originX, originY;
+  int tile, first, last, i;
+  
+  planetData = (*threadArgs).planetData;
+  tiles = (*threadArgs).tiles;
+  
+  for(tile = (*threadArgs).thread; tile * MIXED_TILE < planetData->count; tile += (*threadArgs).threads)
+  {
+    first = tile * MIXED_TILE;
+    last = first + MIXED_TILE < planetData->count ? first + MIXED_TILE : planetData->count;
+    
+    // planets flung to infinity would make every other planet in the tile unusable
+    minX = DBL_MAX;
+    maxX = -DBL_MAX;
+    minY = DBL_MAX;
+    maxY = -DBL_MAX;
+    for(i = first; i < last; i++)
+    {
+      if ( planetData->mass[i] > 0 && isfinite(planetData->x[i]) && isfinite(planetData->y[i]) )
+      {
+        if ( planetData->x[i] < minX ) minX = planetData->x[i];
+        if ( planetData->x[i] > maxX ) maxX = planetData->x[i];
+        if ( planetData->y[i] < minY ) minY = planetData->y[i];
+        if ( planetData->y[i] > maxY ) maxY = planetData->y[i];
+      }
+    }
+    
+    originX = 0;
+    originY = 0;
+    tiles->extent[tile] = 0;
+    if ( minX <= maxX )
+    {
+      originX = minX + (maxX - minX) / 2;
+      originY = minY + (maxY - minY) / 2;
+      tiles->extent[tile] = (maxX - minX > maxY - minY ? maxX - minX : maxY - minY) / 2;
+    }
+    tiles->originX[tile] = originX;
+    tiles->originY[tile] = originY;
+    
+    for(i = first; i < last; i++)
+    {
+      tiles->x[i] = (float)(planetData->x[i] - originX);
+      tiles->y[i] = (float)(planetData->y[i] - originY);
+      tiles->gm[i] = planetData->mass[i] > 0 ? (float)(G * planetData->mass[i]) : 0;
+    }
+  }
+}
+
+
+/**
+ * Get the mixed precision kernel matching a force kernel's instruction set.
+ * 
+ * @param kernel
+ * @return 
+ */
+mixedKernel getMixedKernel(int kernel)
+{
+  switch( kernel )
+  {
+    case KERNEL_AVX2:
+      return &forceKernelMixedAVX2;
+
+    case KERNEL_AVX512:
+      return &forceKernelMixedAVX512;
+  }
+  
+  return &forceKernelMixedGeneric;
+}
+
+
+/**
+ * Check if a tile can be summed in single precision for a planet and get
+ * the offset from the planet to the tile origin. Rounding to single
+ * precision moves a position by up to FLT_EPSILON of its distance from the
+ * tile origin, and the offset by FLT_EPSILON of its length, so both must
+ * stay under MIXED_TOLERANCE of the distance to the planet's nearest
+ * neighbour in the last pass. Planets without a nearest distance yet are
+ * summed in double. Inlined so it is built for each kernel's instruction
+ * set, a call into plain SSE code from an AVX kernel costs more than the
+ * tile it checks.
+ * 
+ * @param planetData
+ * @param tiles
+ * @param p The planet receiving the acceleration.
+ * @param tile
+ * @param offsetX Set to the tile origin minus the planet position.
+ * @param offsetY
+ * @return 1 when single precision is close enough, 0 when not.
+ */
+static inline int getMixedOffset(planetStore *planetData, mixedTiles *tiles, int p, int tile, float *offsetX, float *offsetY)
+{
+  double dx, dy, nearest;
+  
+  dx = tiles->originX[tile] - planetData->x[p];
+  dy = tiles->originY[tile] - planetData->y[p];
+  nearest = planetData->nearestDistance[p];
+  if ( !(nearest < DBL_MAX) || !(FLT_EPSILON * (tiles->extent[tile] + fabs(dx) + fabs(dy)) <= MIXED_TOLERANCE * nearest) )
+  {
+    return 0;
+  }
+  
+  *offsetX = (float)dx;
+  *offsetY = (float)dy;
+  return 1;
+}
+
+
+/**
+ * Mixed precision direct sum kernel in plain C. The pair terms are single
+ * precision and added to double sums.
+ * 
+ * @param planetData
+ * @param tiles
+ * @param p The planet receiving the acceleration.
+ * @param first The first source planet.
+ * @param last One past the last source planet.
+ * @param acceleration
+ * @param nearestDistance
+ */
+void forceKernelMixedGeneric(planetStore *planetData, mixedTiles *tiles, int p, int first, int last, accelerationVector *acceleration, double *nearestDistance)
+{
+  int start, end, i;
+  float offsetX, offsetY, dx, dy, r2, inv, s, near2;
+  double ax, ay;
+  
+  ax = 0;
+  ay = 0;
+  near2 = FLT_MAX;
+  
+  for(start = first; start < last; start = end)
+  {
+    end = (start / MIXED_TILE + 1) * MIXED_TILE;
+    if ( end > last ) end = last;
+    
+    if ( !getMixedOffset(planetData, tiles, p, start / MIXED_TILE, &offsetX, &offsetY) )
+    {
+      tiles->kernel(planetData, p, start, end, acceleration, nearestDistance);
+      continue;
+    }
+    
+    for(i = start; i < end; i++)
+    {
+      dx = tiles->x[i] + offsetX;
+      dy = tiles->y[i] + offsetY;
+      r2 = dx * dx + dy * dy;
+      
+      if ( tiles->gm[i] > 0 && r2 < near2 ) near2 = r2;
+      
+      // multiplied in this order so 1 / r^3 does not underflow on its own
+      if ( r2 > 0 )
+      {
+        inv = 1 / sqrtf(r2);
+        s = tiles->gm[i] * inv * inv * inv;
+        ax += s * dx;
+        ay += s * dy;
+      }
+    }
+  }
+  
+  acceleration->accelerationX += ax;
+  acceleration->accelerationY += ay;
+  if ( near2 < FLT_MAX && sqrt(near2) < *nearestDistance ) *nearestDistance = sqrt(near2);
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/**
+ * AVX2 mixed precision direct sum kernel, eight source planets per
+ * instruction. The 12 bit reciprocal square root estimate is refined with
+ * one Newton step, the pair terms of a tile are summed in single precision
+ * and the tile sums are widened to double.
+ * 
+ * @param planetData
+ * @param tiles
+ * @param p The planet receiving the acceleration.
+ * @param first The first source planet.
+ * @param last One past the last source planet.
+ * @param acceleration
+ * @param nearestDistance
+ */
+__attribute__((target("avx2,fma")))
+void forceKernelMixedAVX2(planetStore *planetData, mixedTiles *tiles, int p, int first, int last, accelerationVector *acceleration, double *nearestDistance)
+{
+  int start, end, i;
+  float offsetX, offsetY, near[8];
+  double sum[4];
+  __m256 ox, oy, zero, big, half, threeHalves, dx, dy, r2, gm, inv, s, near2, tx, ty;
+  __m256d ax, ay;
+  __m256i lanes, load;
+  
+  zero = _mm256_setzero_ps();
+  big = _mm256_set1_ps(FLT_MAX);
+  half = _mm256_set1_ps(0.5f);
+  threeHalves = _mm256_set1_ps(1.5f);
+  lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  ax = _mm256_setzero_pd();
+  ay = _mm256_setzero_pd();
+  near2 = big;
+  
+  for(start = first; start < last; start = end)
+  {
+    end = (start / MIXED_TILE + 1) * MIXED_TILE;
+    if ( end > last ) end = last;
+    
+    if ( !getMixedOffset(planetData, tiles, p, start / MIXED_TILE, &offsetX, &offsetY) )
+    {
+      tiles->kernel(planetData, p, start, end, acceleration, nearestDistance);
+      continue;
+    }
+    ox = _mm256_set1_ps(offsetX);
+    oy = _mm256_set1_ps(offsetY);
+    tx = zero;
+    ty = zero;
+    
+    // the last group of the tile loads only the planets left, the rest have no mass
+    for(i = start; i < end; i += 8)
+    {
+      load = _mm256_cmpgt_epi32(_mm256_set1_epi32(end - i), lanes);
+      dx = _mm256_add_ps(_mm256_maskload_ps(&tiles->x[i], load), ox);
+      dy = _mm256_add_ps(_mm256_maskload_ps(&tiles->y[i], load), oy);
+      gm = _mm256_maskload_ps(&tiles->gm[i], load);
+      r2 = _mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy));
+      
+      // nearest distance only counts planets with mass
+      near2 = _mm256_min_ps(near2, _mm256_blendv_ps(big, r2, _mm256_cmp_ps(gm, zero, _CMP_GT_OQ)));
+      
+      // inv = inv * (1.5 - 0.5 * r2 * inv * inv)
+      inv = _mm256_rsqrt_ps(r2);
+      inv = _mm256_mul_ps(inv, _mm256_fnmadd_ps(_mm256_mul_ps(half, r2), _mm256_mul_ps(inv, inv), threeHalves));
+      
+      // the mask drops the infinite terms of coincident planets
+      s = _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(gm, inv), inv), inv);
+      s = _mm256_and_ps(s, _mm256_cmp_ps(r2, zero, _CMP_GT_OQ));
+      tx = _mm256_fmadd_ps(s, dx, tx);
+      ty = _mm256_fmadd_ps(s, dy, ty);
+    }
+    
+    // a tile's sums are widened to double before they are added to the total
+    ax = _mm256_add_pd(ax, _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(tx)), _mm256_cvtps_pd(_mm256_extractf128_ps(tx, 1))));
+    ay = _mm256_add_pd(ay, _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(ty)), _mm256_cvtps_pd(_mm256_extractf128_ps(ty, 1))));
+  }
+  
+  _mm256_storeu_pd(sum, ax);
+  acceleration->accelerationX += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+  _mm256_storeu_pd(sum, ay);
+  acceleration->accelerationY += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+  _mm256_storeu_ps(near, near2);
+  for(i = 1; i < 8; i++)
+  {
+    if ( near[i] < near[0] ) near[0] = near[i];
+  }
+  if ( near[0] < FLT_MAX && sqrt(near[0]) < *nearestDistance ) *nearestDistance = sqrt(near[0]);
+}
+
+
+/**
+ * AVX-512 mixed precision direct sum kernel, sixteen source planets per
+ * instruction. The 14 bit reciprocal square root estimate is refined with
+ * one Newton step, the pair terms of a tile are summed in single precision
+ * and the tile sums are widened to double.
+ * 
+ * @param planetData
+ * @param tiles
+ * @param p The planet receiving the acceleration.
+ * @param first The first source planet.
+ * @param last One past the last source planet.
+ * @param acceleration
+ * @param nearestDistance
+ */
+__attribute__((target("avx512f")))
+void forceKernelMixedAVX512(planetStore *planetData, mixedTiles *tiles, int p, int first, int last, accelerationVector *acceleration, double *nearestDistance)
+{
+  int start, end, i;
+  float offsetX, offsetY, near2;
+  __m512 ox, oy, zero, big, half, threeHalves, dx, dy, r2, gm, inv, s, near2v, tx, ty;
+  __m512d ax, ay;
+  __mmask16 load, valid;
+  
+  zero = _mm512_setzero_ps();
+  big = _mm512_set1_ps(FLT_MAX);
+  half = _mm512_set1_ps(0.5f);
+  threeHalves = _mm512_set1_ps(1.5f);
+  ax = _mm512_setzero_pd();
+  ay = _mm512_setzero_pd();
+  near2v = big;
+  
+  for(start = first; start < last; start = end)
+  {
+    end = (start / MIXED_TILE + 1) * MIXED_TILE;
+    if ( end > last ) end = last;
+    
+    if ( !getMixedOffset(planetData, tiles, p, start / MIXED_TILE, &offsetX, &offsetY) )
+    {
+      tiles->kernel(planetData, p, start, end, acceleration, nearestDistance);
+      continue;
+    }
+    ox = _mm512_set1_ps(offsetX);
+    oy = _mm512_set1_ps(offsetY);
+    tx = zero;
+    ty = zero;
+    
+    // the last group of the tile loads only the planets left, the rest have no mass
+    for(i = start; i < end; i += 16)
+    {
+      load = end - i >= 16 ? 0xffff : (__mmask16)((1 << (end - i)) - 1);
+      dx = _mm512_add_ps(_mm512_maskz_loadu_ps(load, &tiles->x[i]), ox);
+      dy = _mm512_add_ps(_mm512_maskz_loadu_ps(load, &tiles->y[i]), oy);
+      gm = _mm512_maskz_loadu_ps(load, &tiles->gm[i]);
+      r2 = _mm512_fmadd_ps(dx, dx, _mm512_mul_ps(dy, dy));
+      
+      // nearest distance only counts planets with mass
+      near2v = _mm512_mask_min_ps(near2v, _mm512_cmp_ps_mask(gm, zero, _CMP_GT_OQ), near2v, r2);
+      
+      // inv = inv * (1.5 - 0.5 * r2 * inv * inv)
+      inv = _mm512_rsqrt14_ps(r2);
+      inv = _mm512_mul_ps(inv, _mm512_fnmadd_ps(_mm512_mul_ps(half, r2), _mm512_mul_ps(inv, inv), threeHalves));
+      
+      // coincident planets are masked out of the sums
+      valid = _mm512_mask_cmp_ps_mask(load, r2, zero, _CMP_GT_OQ);
+      s = _mm512_maskz_mul_ps(valid, _mm512_mul_ps(_mm512_mul_ps(gm, inv), inv), inv);
+      tx = _mm512_fmadd_ps(s, dx, tx);
+      ty = _mm512_fmadd_ps(s, dy, ty);
+    }
+    
+    // a tile's sums are widened to double before they are added to the total
+    ax = _mm512_add_pd(ax, _mm512_add_pd(_mm512_cvtps_pd(_mm512_castps512_ps256(tx)), 
+                                         _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(tx), 1)))));
+    ay = _mm512_add_pd(ay, _mm512_add_pd(_mm512_cvtps_pd(_mm512_castps512_ps256(ty)), 
+                                         _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(ty), 1)))));
+  }
+  
+  acceleration->accelerationX += _mm512_reduce_add_pd(ax);
+  acceleration->accelerationY += _mm512_reduce_add_pd(ay);
+  near2 = _mm512_reduce_min_ps(near2v);
+  if ( near2 < FLT_MAX && sqrt(near2) < *nearestDistance ) *nearestDistance = sqrt(near2);
+}
+
+#else
+
+// vector kernels are only built for x86, fall back to the generic kernel
+
+void forceKernelMixedAVX2(planetStore *planetData, mixedTiles *tiles, int p, int first, int last, accelerationVector *acceleration, double *nearestDistance)
+{
+  forceKernelMixedGeneric(planetData, tiles, p, first, last, acceleration, nearestDistance);
+}
+
+void forceKernelMixedAVX512(planetStore *planetData, mixedTiles *tiles, int p, int first, int last, accelerationVector *acceleration, double *nearestDistance)
+{
+  forceKernelMixedGeneric(planetData, tiles, p, first, last, acceleration, nearestDistance);
+}
+
+#endif
+
+
+/**
+ * Adjust planet velocity and move based on time factor.
+ */
+void movePlanets(double timeFactor, planetStore *planetData)
+{
+  int pi;
+  
+  // move planets
+  for(pi = 0; pi < planetData->count; pi++) {
+    if( planetData->mass[pi] > 0 ) {
+      // update planet's velocity with new acceleration
+      planetData->velocityX[pi] += planetData->accelerationX[pi] * timeFactor;
+      planetData->velocityY[pi] += planetData->accelerationY[pi] * timeFactor;
+
+      // move planet position
+      planetData->x[pi] += planetData->velocityX[pi] * timeFactor;
+      planetData->y[pi] += planetData->velocityY[pi] * timeFactor;
+    }
+  }
+}
+
+
+/**
+ * Update the planet velocities from their accelerations.
+ * 
+ * @param timeFactor
+ * @param planetData
+ */
+void kickPlanets(double timeFactor, planetStore *planetData)
+{
+  int pi;
+  
+  for(pi = 0; pi < planetData->count; pi++) {
+    if( planetData->mass[pi] > 0 ) {
+      planetData->velocityX[pi] += planetData->accelerationX[pi] * timeFactor;
+      planetData->velocityY[pi] += planetData->accelerationY[pi] * timeFactor;
+    }
+  }
+}
+
+
+/**
+ * Move the planets along their velocities.
+ * 
+ * @param timeFactor
+ * @param planetData
+ */
+void driftPlanets(double timeFactor, planetStore *planetData)
+{
+  int pi;
+  
+  for(pi = 0; pi < planetData->count; pi++) {
+    if( planetData->mass[pi] > 0 ) {
+      planetData->x[pi] += planetData->velocityX[pi] * timeFactor;
+      planetData->y[pi] += planetData->velocityY[pi] * timeFactor;
+    }
+  }
+}
+
+
+// names used to select an integrator on the command line
+char *integratorNames[INTEGRATOR_COUNT] = {
+  "euler",
+  "leapfrog",
+  "yoshida",
+  "block"
+};
+
+
+/**
+ * Look up an integrator by name.
+ * 
+ * @param name
+ * @return The integrator number or -1 when unknown.
+ */
+int getIntegratorByName(char *name)
+{
+  int integrator;
+  
+  for(integrator = 0; integrator < INTEGRATOR_COUNT; integrator++)
+  {
+    if ( strcmp(name, integratorNames[integrator]) == 0 )
+    {
+      return integrator;
+    }
+  }
+  
+  return -1;
+}
+
+
+/**
+ * Allocate the spatial hash used to find collision candidates.
+ * 
+ * @param count The planet count.
+ * @param threads The number of calculation threads.
+ * @return 
+ */
+collisionGrid * createCollisionGrid(int count, int threads)
+{
+  collisionGrid *grid;
+  int t;
+  
+  grid = (collisionGrid *) malloc(sizeof(collisionGrid));
+  memset(grid, 0, sizeof(collisionGrid));
+  sizeCollisionGrid(grid, count);
+  grid->cellSize = 1;
+  
+  // per thread pair lists
+  grid->threads = (collisionThread *) allocateStoreArray(threads, sizeof(collisionThread));
+  for(t = 0; t < threads; t++)
+  {
+    grid->threads[t].pairCapacity = 64;
+    grid->threads[t].pairs = (int *) malloc(2 * grid->threads[t].pairCapacity * sizeof(int));
+    grid->threads[t].bucketCapacity = 64;
+    grid->threads[t].buckets = (int *) malloc(grid->threads[t].bucketCapacity * sizeof(int));
+  }
+  
+  return grid;
+}
+
+
+/**
+ * Allocate the per planet arrays of the collision grid, replacing any
+ * already there. Nothing in them lasts from one pass to the next.
+ * 
+ * @param grid
+ * @param count The number of planets.
+ */
+void sizeCollisionGrid(collisionGrid *grid, int count)
+{
+  // at least twice as many buckets as planets keeps the lists short
+  grid->size = 1;
+  while ( grid->size < 2 * count ) grid->size *= 2;
+  
+  free(grid->start);
+  free(grid->sorted);
+  free(grid->bucket);
+  grid->start = (int *) malloc((grid->size + 1) * sizeof(int));
+  grid->sorted = (int *) malloc(count * sizeof(int));
+  grid->bucket = (int *) malloc(count * sizeof(int));
+  
+  // merge groups, a zero stamp is never current
+  free(grid->parent);
+  free(grid->seen);
+  free(grid->members);
+  free(grid->survivor);
+  free(grid->groupMass);
+  free(grid->groupMomentumX);
+  free(grid->groupMomentumY);
+  free(grid->groupForceX);
+  free(grid->groupForceY);
+  grid->parent = (int *) malloc(count * sizeof(int));
+  grid->seen = (int *) calloc(count, sizeof(int));
+  grid->members = (int *) malloc(count * sizeof(int));
+  grid->survivor = (int *) malloc(count * sizeof(int));
+  grid->groupMass = (double *) malloc(count * sizeof(double));
+  grid->groupMomentumX = (double *) malloc(count * sizeof(double));
+  grid->groupMomentumY = (double *) malloc(count * sizeof(double));
+  grid->groupForceX = (double *) malloc(count * sizeof(double));
+  grid->groupForceY = (double *) malloc(count * sizeof(double));
+  grid->stamp = 0;
+}
+
+
+/**
+ * Get the hash bucket of a grid cell.
+ * 
+ * @param grid
+ * @param ix
+ * @param iy
+ * @return 
+ */
+int getCollisionBucket(collisionGrid *grid, long long ix, long long iy)
+{
+  unsigned long long h;
+  
+  h = (unsigned long long)ix * 0x9E3779B97F4A7C15ULL ^ (unsigned long long)iy * 0xC2B2AE3D27D4EB4FULL;
+  h ^= h >> 29;
+  
+  return (int)(h & (grid->size - 1));
+}
+
+
+/**
+ * Get the grid cell coordinate for a position.
+ * 
+ * @param cellSize Width of a grid cell.
+ * @param position
+ * @return 
+ */
+long long getCollisionCell(double cellSize, double position)
+{
+  double cell;
+  
+  cell = floor(position / cellSize);
+  
+  // keep far away planets from overflowing the cell index
+  if ( cell > 1e15 ) cell = 1e15;
+  if ( cell < -1e15 ) cell = -1e15;
+  
+  return (long long)cell;
+}
+
+
+/**
+ * Sort the planets into the hash buckets once each planet's bucket is set.
+ * 
+ * @param grid
+ * @param planetData
+ */
+void sortCollisionGrid(collisionGrid *grid, planetStore *planetData)
+{
+  int pi, b;
+  
+  // count the planets in each bucket
+  memset(grid->start, 0, (grid->size + 1) * sizeof(int));
+  for(pi = 0; pi < planetData->count; pi++) {
+    if ( grid->bucket[pi] >= 0 )
+    {
+      grid->start[grid->bucket[pi] + 1]++;
+    }
+  }
+  
+  // bucket offsets
+  for(b = 0; b < grid->size; b++) {
+    grid->start[b + 1] += grid->start[b];
+  }
+  
+  // place planets in ascending order within each bucket, start ends up
+  // pointing at the end of each bucket and is shifted back afterwards
+  for(pi = 0; pi < planetData->count; pi++) {
+    if ( grid->bucket[pi] >= 0 )
+    {
+      grid->sorted[grid->start[grid->bucket[pi]]++] = pi;
+    }
+  }
+  for(b = grid->size; b > 0; b--) {
+    grid->start[b] = grid->start[b - 1];
+  }
+  grid->start[0] = 0;
+}
+
+
+/**
+ * compare planet numbers for sorting
+ * 
+ * @param a
+ * @param b
+ * @return 
+ */
+int comparePlanetIndex(const void *a, const void *b)
+{
+  return *(const int *)a - *(const int *)b;
+}
+
+
+/**
+ * Record a colliding pair in a thread's list.
+ * 
+ * @param ct
+ * @param pi The surviving planet.
+ * @param vi The consumed planet.
+ */
+void addCollisionPair(collisionThread *ct, int pi, int vi)
+{
+  if ( ct->pairCount == ct->pairCapacity )
+  {
+    ct->pairCapacity *= 2;
+    ct->pairs = (int *) realloc(ct->pairs, 2 * ct->pairCapacity * sizeof(int));
+  }
+  
+  ct->pairs[2 * ct->pairCount] = pi;
+  ct->pairs[2 * ct->pairCount + 1] = vi;
+  ct->pairCount++;
+}
+
+
+/**
+ * Find the planets colliding with a planet and record each pair. Only
+ * planets with less mass, or equal mass and a higher number, are checked
+ * so each pair is recorded once.
+ * 
+ * @param grid
+ * @param ct
+ * @param planetData
+ * @param pi
+ */
+void findCollisionPairs(collisionGrid *grid, collisionThread *ct, planetStore *planetData, int pi)
+{
+  long long ix, iy, cx, cy;
+  int b, e, vi, n, i, rings, count;
+  
+  // only smaller planets are merged so the reach is twice this planet's radius
+  rings = (int)ceil(2 * getCollisionRadius(planetData->mass[pi]) / grid->cellSize);
+  
+  if ( (2 * (long long)rings + 1) * (2 * (long long)rings + 1) >= grid->size )
+  {
+    // the search covers the whole table, check every planet
+    ct->tests += planetData->count;
+    for(vi = 0; vi < planetData->count; vi++) {
+      if ( vi != pi && planetData->mass[vi] > 0 && 
+           (planetData->mass[vi] < planetData->mass[pi] || (planetData->mass[vi] == planetData->mass[pi] && vi > pi)) &&
+           inCollisionRange(planetData->mass[pi], planetData->mass[vi], calculateDistance(pi, vi, planetData)) )
+      {
+        addCollisionPair(ct, pi, vi);
+      }
+    }
+    return;
+  }
+  
+  // neighbouring cells can share a bucket, so collect and sort the buckets first
+  n = (2 * rings + 1) * (2 * rings + 1);
+  if ( n > ct->bucketCapacity )
+  {
+    ct->bucketCapacity = n;
+    ct->buckets = (int *) realloc(ct->buckets, n * sizeof(int));
+  }
+  
+  n = 0;
+  cx = getCollisionCell(grid->cellSize, planetData->x[pi]);
+  cy = getCollisionCell(grid->cellSize, planetData->y[pi]);
+  for(ix = cx - rings; ix <= cx + rings; ix++) {
+    for(iy = cy - rings; iy <= cy + rings; iy++) {
+      ct->buckets[n++] = getCollisionBucket(grid, ix, iy);
+    }
+  }
+  qsort(ct->buckets, n, sizeof(int), comparePlanetIndex);
+  
+  count = 0;
+  for(i = 0; i < n; i++) {
+    if ( count > 0 && ct->buckets[count - 1] == ct->buckets[i] ) continue;
+    ct->buckets[count++] = b = ct->buckets[i];
+    ct->tests += grid->start[b + 1] - grid->start[b];
+    
+    for(e = grid->start[b]; e < grid->start[b + 1]; e++) {
+      vi = grid->sorted[e];
+      
+      if ( vi != pi && planetData->mass[vi] > 0 && 
+           (planetData->mass[vi] < planetData->mass[pi] || (planetData->mass[vi] == planetData->mass[pi] && vi > pi)) &&
+           inCollisionRange(planetData->mass[pi], planetData->mass[vi], calculateDistance(pi, vi, planetData)) )
+      {
+        addCollisionPair(ct, pi, vi);
+      }
+    }
+  }
+}
+
+
+/**
+ * Find the root of a merge group.
+ * 
+ * @param parent
+ * @param pi
+ * @return 
+ */
+int findMergeGroup(int *parent, int pi)
+{
+  while ( parent[pi] != pi )
+  {
+    // halve the path on the way up
+    parent[pi] = parent[parent[pi]];
+    pi = parent[pi];
+  }
+  
+  return pi;
+}
+
+
+/**
+ * Add a planet to the current merge pass the first time it is seen.
+ * 
+ * @param grid
+ * @param pi
+ * @param count Number of members so far.
+ * @return The new member count.
+ */
+int addMergeMember(collisionGrid *grid, int pi, int count)
+{
+  if ( grid->seen[pi] != grid->stamp )
+  {
+    grid->seen[pi] = grid->stamp;
+    grid->parent[pi] = pi;
+    grid->members[count++] = pi;
+  }
+  
+  return count;
+}
+
+
+/**
+ * Merge the colliding pairs found by all threads. Pairs are joined into
+ * groups, each group becomes its heaviest planet, lowest number on a tie,
+ * with the total mass and momentum summed in planet order. The result
+ * does not depend on which thread found which pair.
+ * 
+ * @param grid
+ * @param planetData
+ * @param threads
+ * @return The number of planets merged into another.
+ */
+int resolveCollisions(collisionGrid *grid, planetStore *planetData, int threads)
+{
+  int t, i, n, pi, vi, root, merged;
+  collisionThread *ct;
+  
+  // a new stamp marks every planet as unseen without clearing
+  grid->stamp++;
+  
+  // join the pairs, the lower planet number always becomes the root
+  n = 0;
+  for(t = 0; t < threads; t++)
+  {
+    ct = &grid->threads[t];
+    for(i = 0; i < ct->pairCount; i++)
+    {
+      pi = ct->pairs[2 * i];
+      vi = ct->pairs[2 * i + 1];
+      n = addMergeMember(grid, pi, n);
+      n = addMergeMember(grid, vi, n);
+      
+      pi = findMergeGroup(grid->parent, pi);
+      vi = findMergeGroup(grid->parent, vi);
+      if ( pi < vi ) grid->parent[vi] = pi;
+      else if ( vi < pi ) grid->parent[pi] = vi;
+    }
+  }
+  
+  if ( n == 0 )
+  {
+    return 0;
+  }
+  
+  // sum each group in planet order
+  qsort(grid->members, n, sizeof(int), comparePlanetIndex);
+  for(i = 0; i < n; i++)
+  {
+    pi = grid->members[i];
+    root = findMergeGroup(grid->parent, pi);
+    
+    // the root is the lowest member so it is reached first
+    if ( root == pi )
+    {
+      grid->groupMass[root] = 0;
+      grid->groupMomentumX[root] = 0;
+      grid->groupMomentumY[root] = 0;
+      grid->groupForceX[root] = 0;
+      grid->groupForceY[root] = 0;
+      grid->survivor[root] = pi;
+    }
+    
+    grid->groupMass[root] += planetData->mass[pi];
+    grid->groupMomentumX[root] += planetData->mass[pi] * planetData->velocityX[pi];
+    grid->groupMomentumY[root] += planetData->mass[pi] * planetData->velocityY[pi];
+    grid->groupForceX[root] += planetData->mass[pi] * planetData->accelerationX[pi];
+    grid->groupForceY[root] += planetData->mass[pi] * planetData->accelerationY[pi];
+    if ( planetData->mass[pi] > planetData->mass[grid->survivor[root]] )
+    {
+      grid->survivor[root] = pi;
+    }
+  }
+  
+  // the survivor takes the group's mass and momentum, the pulls between
+  // members cancel so the mass weighted acceleration is the group's
+  // acceleration from everything else
+  for(i = 0; i < n; i++)
+  {
+    pi = grid->members[i];
+    root = findMergeGroup(grid->parent, pi);
+    
+    if ( pi == grid->survivor[root] )
+    {
+      planetData->velocityX[pi] = grid->groupMomentumX[root] / grid->groupMass[root];
+      planetData->velocityY[pi] = grid->groupMomentumY[root] / grid->groupMass[root];
+      planetData->accelerationX[pi] = grid->groupForceX[root] / grid->groupMass[root];
+      planetData->accelerationY[pi] = grid->groupForceY[root] / grid->groupMass[root];
+      planetData->mass[pi] = grid->groupMass[root];
+      planetData->flash[pi]++;
+      if ( planetData->mass[pi] > planetData->stats.massMax ) planetData->stats.massMax = planetData->mass[pi];
+    }
+  }
+  merged = 0;
+  for(i = 0; i < n; i++)
+  {
+    pi = grid->members[i];
+    if ( pi != grid->survivor[findMergeGroup(grid->parent, pi)] )
+    {
+      planetData->mass[pi] = 0;
+      merged++;
+    }
+  }
+  planetData->dead += merged;
+  
+  // mass and momentum are kept, the smallest mass can be left over from a
+  // merged planet until the next pass
+  planetData->stats.count -= merged;
+  
+  return merged;
+}
+
+
+/**
+ * Calculate collisions between planets, run by every calculation thread.
+ * Planets are hashed into a grid of cells two of the largest planets wide
+ * so each planet near a collision only checks its neighbouring cells. The
+ * threads collect colliding pairs and the first thread merges them. The
+ * first sweep also gathers the planet totals for the step.
+ * 
+ * @param threadArgs
+ */
+void calculateCollisions(calcArgs *threadArgs)
+{
+  planetStore *planetData;
+  collisionGrid *grid;
+  collisionThread *ct;
+  int t, i, pi, first, last, range, candidates;
+  double massMax, cellSize;
+  
+  planetData = (*threadArgs).planetData;
+  grid = (*threadArgs).grid;
+  t = (*threadArgs).thread;
+  ct = &grid->threads[t];
+  
+  // each thread owns a fixed slice of the planets for the setup passes
+  first = (long)planetData->count * t / (*threadArgs).threads;
+  last = (long)planetData->count * (t + 1) / (*threadArgs).threads;
+  
+  // mass range, bounds and totals of our slice
+  measurePlanets(&ct->stats, planetData, first, last);
+  ct->pairCount = 0;
+  ct->tests = 0;
+  
+  waitThreadBarrier(threadArgs);
+  
+  massMax = 0;
+  for(i = 0; i < (*threadArgs).threads; i++) {
+    if( grid->threads[i].stats.massMax > massMax ) massMax = grid->threads[i].stats.massMax;
+  }
+  
+  // the other threads only read the partials, the totals are ours
+  if ( t == 0 )
+  {
+    clearPlanetStats(&planetData->stats);
+    for(i = 0; i < (*threadArgs).threads; i++) {
+      addPlanetStats(&planetData->stats, &grid->threads[i].stats);
+    }
+    finishPlanetStats(&planetData->stats);
+  }
+  
+  // cells fit two of the largest planets, every thread works out the same
+  // size and the first one stores it for the passes after the barrier
+  cellSize = 2 * getCollisionRadius(massMax);
+  if ( !(cellSize > 0) ) cellSize = 1;
+  if ( t == 0 ) grid->cellSize = cellSize;
+  
+  // hash our slice and count the planets that came close enough to anything
+  ct->candidates = 0;
+  for(pi = first; pi < last; pi++) {
+    grid->bucket[pi] = -1;
+    if ( planetData->mass[pi] > 0 && isfinite(planetData->x[pi]) && isfinite(planetData->y[pi]) )
+    {
+      grid->bucket[pi] = getCollisionBucket(grid, getCollisionCell(cellSize, planetData->x[pi]), getCollisionCell(cellSize, planetData->y[pi]));
+      
+      // worst case planet came too close
+      if ( inCollisionRange(planetData->mass[pi], massMax, planetData->nearestDistance[pi]) ) ct->candidates++;
+    }
+  }
+  
+  waitThreadBarrier(threadArgs);
+  
+  candidates = 0;
+  for(i = 0; i < (*threadArgs).threads; i++) {
+    candidates += grid->threads[i].candidates;
+  }
+  
+  // nothing is close enough to collide
+  if ( candidates == 0 )
+  {
+    return;
+  }
+  
+  if ( t == 0 )
+  {
+    sortCollisionGrid(grid, planetData);
+  }
+  
+  waitThreadBarrier(threadArgs);
+  
+  // find pairs for the candidates in the chunks we claim
+  range = t % (*threadArgs).schedule->rangeCount;
+  while ( getNextCalcChunk((*threadArgs).schedule, &range, &first, &last) )
+  {
+    for(pi = first; pi < last; pi++) {
+      if ( grid->bucket[pi] >= 0 && inCollisionRange(planetData->mass[pi], massMax, planetData->nearestDistance[pi]) )
+      {
+        findCollisionPairs(grid, ct, planetData, pi);
+      }
+    }
+  }
+  addProfileCount(t, COUNTER_COLLISION_TESTS, ct->tests);
+  
+  waitThreadBarrier(threadArgs);
+  
+  if ( t == 0 )
+  {
+    addProfileCount(t, COUNTER_MERGES, resolveCollisions(grid, planetData, (*threadArgs).threads));
+  }
+}
+
+
+/**
+ * Get the radius used for collisions of a planet with the given mass.
+ * 
+ * @param mass
+ * @return 
+ */
+double getCollisionRadius(double mass)
+{
+  double sphereradc; // calculated constant for sphere radius formula
+  sphereradc = (4 / 3 * M_PI) * 5000000000; // multiplied by constant for dirty density calc
+
+  return cbrt(mass / sphereradc);
+}
+
+
+/**
+ * determine if the two given masses within the given distance are considered to be in a collision
+ * 
+ * @param mass1
+ * @param mass2
+ * @param distance
+ * @return 
+ */
+int inCollisionRange(double mass1, double mass2, double distance)
+{
+  if ( getCollisionRadius(mass1) + getCollisionRadius(mass2) >= distance )
+  {
+    // collision
+    return 1;
+  }
+  
+  return 0;
+}
+
+
+/**
+ * Empty the planet totals.
+ * 
+ * @param stats
+ */
+void clearPlanetStats(planetStats *stats)
+{
+  stats->count = 0;
+  stats->massMax = 0;
+  stats->massMin = DBL_MAX;
+  stats->minX = DBL_MAX;
+  stats->maxX = -DBL_MAX;
+  stats->minY = DBL_MAX;
+  stats->maxY = -DBL_MAX;
+  stats->mass = 0;
+  stats->momentumX = 0;
+  stats->momentumY = 0;
+  stats->centerX = 0;
+  stats->centerY = 0;
+}
+
+
+/**
+ * Gather the mass range, bounding box and totals of a range of planets in
+ * one sweep. The center of mass is left as the mass weighted position sums
+ * until finishPlanetStats.
+ * 
+ * @param stats
+ * @param planetData
+ * @param first The first planet.
+ * @param last One past the last planet.
+ */
+void measurePlanets(planetStats *stats, planetStore *planetData, int first, int last)
+{
+  int pi;
+  double mass;
+  
+  clearPlanetStats(stats);
+  for(pi = first; pi < last; pi++) {
+    mass = planetData->mass[pi];
+    if( !(mass > 0) ) continue;
+    
+    stats->count++;
+    if( mass > stats->massMax ) stats->massMax = mass;
+    if( mass < stats->massMin ) stats->massMin = mass;
+    stats->mass += mass;
+    stats->momentumX += mass * planetData->velocityX[pi];
+    stats->momentumY += mass * planetData->velocityY[pi];
+    
+    // a planet flung to infinity would swamp the bounds and the center
+    if( isfinite(planetData->x[pi]) && isfinite(planetData->y[pi]) ) {
+      if( planetData->x[pi] < stats->minX ) stats->minX = planetData->x[pi];
+      if( planetData->x[pi] > stats->maxX ) stats->maxX = planetData->x[pi];
+      if( planetData->y[pi] < stats->minY ) stats->minY = planetData->y[pi];
+      if( planetData->y[pi] > stats->maxY ) stats->maxY = planetData->y[pi];
+      stats->centerX += mass * planetData->x[pi];
+      stats->centerY += mass * planetData->y[pi];
+    }
+  }
+}
+
+
+/**
+ * Add the partial totals of another range of planets.
+ * 
+ * @param stats
+ * @param partial Totals from measurePlanets.
+ */
+void addPlanetStats(planetStats *stats, planetStats *partial)
+{
+  stats->count += partial->count;
+  if( partial->massMax > stats->massMax ) stats->massMax = partial->massMax;
+  if( partial->massMin < stats->massMin ) stats->massMin = partial->massMin;
+  if( partial->minX < stats->minX ) stats->minX = partial->minX;
+  if( partial->maxX > stats->maxX ) stats->maxX = partial->maxX;
+  if( partial->minY < stats->minY ) stats->minY = partial->minY;
+  if( partial->maxY > stats->maxY ) stats->maxY = partial->maxY;
+  stats->mass += partial->mass;
+  stats->momentumX += partial->momentumX;
+  stats->momentumY += partial->momentumY;
+  stats->centerX += partial->centerX;
+  stats->centerY += partial->centerY;
+}
+
+
+/**
+ * Turn the mass weighted position sums into the center of mass once every
+ * partial is added.
+ * 
+ * @param stats
+ */
+void finishPlanetStats(planetStats *stats)
+{
+  if( stats->mass > 0 ) {
+    stats->centerX /= stats->mass;
+    stats->centerY /= stats->mass;
+  }
+}
+
+
+/**
+ * Gather the planet totals on the calling thread, used after the planets
+ * change outside of a step.
+ * 
+ * @param planetData
+ */
+void updatePlanetStats(planetStore *planetData)
+{
+  measurePlanets(&planetData->stats, planetData, 0, planetData->count);
+  finishPlanetStats(&planetData->stats);
+}
+
+
+/**
+ * worker thread
+ * 
+ * performs gravitational calculations in a multi-thread safe environment
+ * 
+ * @param args A pointer to arguments, in this case a calcArgs struct.
+ * @return 
+ */
+void * calcWorker(void * args)
+{
+  calcArgs *threadArgs;
+  double start, wait;
+  int pass;
+  
+  threadArgs = (calcArgs *) args;
+  
+  while (1)
+  {
+    // wait for for all calculation ready
+    pthread_barrier_wait((*threadArgs).calcBarrier);
+    
+    // run the pass requested by the main thread
+    pass = (*threadArgs).schedule->pass;
+    start = getSeconds();
+    switch ( pass )
+    {
+      case PASS_FORCE:
+        calculateAccelerations(threadArgs);
+        break;
+        
+      case PASS_COLLIDE:
+        calculateCollisions(threadArgs);
+        break;
+    }
+    (*threadArgs).busyTime[pass] += getSeconds() - start;
+    endProfile((*threadArgs).thread, pass, start);
+    
+    // wait for for all calculations finished
+    wait = startProfile();
+    pthread_barrier_wait((*threadArgs).calcBarrier);
+    endProfile((*threadArgs).thread, ZONE_BARRIER, wait);
+    
+  } // main loop
+}
+
+
+/**
+ * Calculate the gravitational acceleration on each planet, run by every
+ * calculation thread.
+ * 
+ * @param threadArgs
+ */
+void calculateAccelerations(calcArgs *threadArgs)
+{
+  planetStore *planetData;  
+  planetStore *source; // where the direct sum reads the positions and masses
+  accelerationVector acceleration;
+  double nearestDistance;
+  int i, p, first, last, range, mixed, replicated;
+  long long pairs;
+  
+  planetData = (*threadArgs).planetData;
+  source = planetData;
+  pairs = 0;
+  
+  // pinned threads touch the arrays they own first after every move, all
+  // threads see the same arrays move so they agree on the barrier
+  if ( (*threadArgs).placement && placeCalcStorage(threadArgs) )
+  {
+    waitThreadBarrier(threadArgs);
+  }
+  
+  // block timesteps drift every planet before each force pass, each thread
+  // its own share
+  if ( (*threadArgs).schedule->drift > 0 )
+  {
+    first = (long long) planetData->count * (*threadArgs).thread / (*threadArgs).threads;
+    last = (long long) planetData->count * ((*threadArgs).thread + 1) / (*threadArgs).threads;
+    for(p = first; p < last; p++)
+    {
+      if ( planetData->mass[p] > 0 )
+      {
+        planetData->x[p] += planetData->velocityX[p] * (*threadArgs).schedule->drift;
+        planetData->y[p] += planetData->velocityY[p] * (*threadArgs).schedule->drift;
+      }
+    }
+    waitThreadBarrier(threadArgs);
+  }
+  
+  // copy this thread's share of the positions and masses to its node
+  replicated = (*threadArgs).placement && (*threadArgs).placement->replicas;
+  if ( replicated )
+  {
+    refreshNodeReplica(threadArgs);
+    source = &(*threadArgs).view;
+  }
+  
+  // single precision pair terms unless the store holds astronomical masses,
+  // every thread reads the same mass range so they agree on the barrier
+  mixed = (*threadArgs).tiles && planetData->stats.massMax <= MIXED_MAX_MASS;
+  if ( mixed )
+  {
+    prepareMixedTiles(threadArgs);
+  }
+  if ( mixed || replicated )
+  {
+    waitThreadBarrier(threadArgs);
+  }
+  
+  // start with our own range when stealing
+  range = (*threadArgs).thread % (*threadArgs).schedule->rangeCount;
+  
+  // build the quadtree when using Barnes-Hut
+  if ( (*threadArgs).tree )
+  {
+    buildQuadTree(threadArgs);
+  }
+  
+  // the fast multipole method works on whole cells rather than planets
+  if ( (*threadArgs).fmm )
+  {
+    calculateFmmAccelerations(threadArgs);
+    return;
+  }
+
+  while ( getNextCalcChunk((*threadArgs).schedule, &range, &first, &last) )
+  {
+    for(i = first; i < last; i++)
+    {
+      // with block timesteps only the planets due for a kick are calculated
+      p = (*threadArgs).schedule->activeOnly ? (*threadArgs).schedule->active[i] : i;
+      
+      // consumed planets need no calculations
+      if ( planetData->mass[p] <= 0 )
+      {
+        continue;
+      }
+      
+      if ( (*threadArgs).tree )
+      {
+        // approximate distant planets using the quadtree
+        pairs += addQuadTreeAcceleration(p, threadArgs);
+        continue;
+      }
+      
+      // sum into locals so the shared arrays are only written once per planet
+      acceleration.accelerationX = 0;
+      acceleration.accelerationY = 0;
+      nearestDistance = DBL_MAX;
+      
+      // calculate acceleration from the planets on either side of our planet
+      if ( mixed )
+      {
+        (*threadArgs).mixed(source, (*threadArgs).tiles, p, 0, p, &acceleration, &nearestDistance);
+        (*threadArgs).mixed(source, (*threadArgs).tiles, p, p + 1, planetData->count, &acceleration, &nearestDistance);
+      }
+      else
+      {
+        (*threadArgs).kernel(source, p, 0, p, &acceleration, &nearestDistance);
+        (*threadArgs).kernel(source, p, p + 1, planetData->count, &acceleration, &nearestDistance);
+      }
+      
+      planetData->accelerationX[p] = acceleration.accelerationX;
+      planetData->accelerationY[p] = acceleration.accelerationY;
+      planetData->nearestDistance[p] = nearestDistance;
+      pairs += planetData->count - 1;
+    }
+  } // planet gravitational calculation loop
+  
+  addProfileCount((*threadArgs).thread, COUNTER_PAIRS, pairs);
+}
+
+
+// names used to select a thread affinity on the command line
+char *affinityNames[AFFINITY_COUNT] = {
+  "none",
+  "compact",
+  "scatter"
+};
+
+
+/**
+ * Look up a thread affinity policy by name.
+ * 
+ * @param name
+ * @return The AFFINITY_ constant or -1 when unknown.
+ */
+int getAffinityByName(char *name)
+{
+  int affinity;
+  
+  for(affinity = 0; affinity < AFFINITY_COUNT; affinity++)
+  {
+    if ( strcmp(name, affinityNames[affinity]) == 0 )
+    {
+      return affinity;
+    }
+  }
+  
+  return -1;
+}
+
+
+/**
+ * Choose a CPU for each calculation thread. The CPUs this process may run
+ * on are grouped by NUMA node from sysfs, with the first hardware thread of
+ * every core ahead of its siblings, so threads get whole cores before
+ * sharing one. Without NUMA information all CPUs are one node. Threads
+ * beyond the CPU count wrap around.
+ * 
+ * @param policy AFFINITY_COMPACT or AFFINITY_SCATTER.
+ * @param threads The number of calculation threads.
+ * @return 
+ */
+threadPlacement * createThreadPlacement(int policy, int threads)
+{
+  threadPlacement *placement;
+  cpu_set_t allowed, nodeSet, siblings;
+  char path[256];
+  int *order, *rank, nodeFirst[MAX_NODES + 1], nodeUsed[MAX_NODES];
+  int nodes, cpus, n, c, s, level, levels, t, k, index;
+  
+  placement = (threadPlacement *) calloc(1, sizeof(threadPlacement));
+  placement->policy = policy;
+  placement->threads = threads;
+  
+  CPU_ZERO(&allowed);
+  if ( sched_getaffinity(0, sizeof(cpu_set_t), &allowed) )
+  {
+    printf("Cannot read the CPUs this process may run on\n");
+    exit(1);
+  }
+  
+  // position of each CPU among the hardware threads of its core
+  rank = (int *) calloc(CPU_SETSIZE, sizeof(int));
+  levels = 1;
+  for(c = 0; c < CPU_SETSIZE; c++)
+  {
+    sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", c);
+    if ( CPU_ISSET(c, &allowed) && readCpuList(path, &siblings) )
+    {
+      for(s = 0; s < c; s++)
+      {
+        if ( CPU_ISSET(s, &siblings) ) rank[c]++;
+      }
+      if ( rank[c] >= levels ) levels = rank[c] + 1;
+    }
+  }
+  
+  order = (int *) malloc(CPU_SETSIZE * sizeof(int));
+  cpus = 0;
+  nodes = 0;
+  for(n = 0; n <= MAX_NODES; n++)
+  {
+    if ( n < MAX_NODES )
+    {
+      sprintf(path, "/sys/devices/system/node/node%d/cpulist", n);
+      if ( !readCpuList(path, &nodeSet) ) continue;
+    }
+    else if ( cpus == 0 )
+    {
+      // no NUMA information, or none of our CPUs was listed
+      nodeSet = allowed;
+    }
+    else
+    {
+      break;
+    }
+    
+    nodeFirst[nodes] = cpus;
+    for(level = 0; level < levels; level++)
+    {
+      for(c = 0; c < CPU_SETSIZE; c++)
+      {
+        if ( CPU_ISSET(c, &nodeSet) && CPU_ISSET(c, &allowed) && rank[c] == level ) order[cpus++] = c;
+      }
+    }
+    if ( cpus > nodeFirst[nodes] ) nodes++;
+  }
+  nodeFirst[nodes] = cpus;
+  
+  // nodes are numbered in the order the threads first use them
+  for(k = 0; k < nodes; k++)
+  {
+    nodeUsed[k] = -1;
+  }
+  for(t = 0; t < threads; t++)
+  {
+    if ( policy == AFFINITY_SCATTER )
+    {
+      k = t % nodes;
+      index = nodeFirst[k] + (t / nodes) % (nodeFirst[k + 1] - nodeFirst[k]);
+    }
+    else
+    {
+      index = t % cpus;
+      for(k = 0; nodeFirst[k + 1] <= index; k++);
+    }
+    
+    if ( nodeUsed[k] < 0 ) nodeUsed[k] = placement->nodes++;
+    placement->cpu[t] = order[index];
+    placement->node[t] = nodeUsed[k];
+  }
+  
+  free(order);
+  free(rank);
+  
+  return placement;
+}
+
+
+/**
+ * Read a sysfs CPU list such as 0-3,8-11 into a CPU set.
+ * 
+ * @param path
+ * @param set
+ * @return 1 when the list was read, 0 when the file is missing.
+ */
+int readCpuList(char *path, cpu_set_t *set)
+{
+  FILE *file;
+  int first, last, c;
+  char separator;
+  
+  CPU_ZERO(set);
+  file = fopen(path, "r");
+  if ( file == NULL )
+  {
+    return 0;
+  }
+  
+  while ( fscanf(file, "%d", &first) == 1 )
+  {
+    last = first;
+    separator = fgetc(file);
+    if ( separator == '-' )
+    {
+      if ( fscanf(file, "%d", &last) != 1 ) break;
+      separator = fgetc(file);
+    }
+    for(c = first; c <= last && c < CPU_SETSIZE; c++)
+    {
+      CPU_SET(c, set);
+    }
+    if ( separator != ',' ) break;
+  }
+  fclose(file);
+  
+  return 1;
+}
+
+
+/**
+ * Allocate a copy of the positions and masses for each node the threads
+ * run on.
+ * 
+ * @param placement
+ * @param capacity
+ */
+void createNodeReplicas(threadPlacement *placement, int capacity)
+{
+  placement->replicas = (nodeReplica *) calloc(placement->nodes, sizeof(nodeReplica));
+  growNodeReplicas(placement, capacity > 0 ? capacity : 1);
+}
+
+
+/**
+ * Grow the node copies to hold more planets, called between steps when the
+ * planet store has grown. The threads of each node move the new pages to
+ * their node in the next force pass.
+ * 
+ * @param placement
+ * @param capacity
+ */
+void growNodeReplicas(threadPlacement *placement, int capacity)
+{
+  nodeReplica *replica;
+  int n;
+  
+  for(n = 0; n < placement->nodes; n++)
+  {
+    replica = &placement->replicas[n];
+    free(replica->x);
+    free(replica->y);
+    free(replica->mass);
+    replica->x = (double *) allocateStoreArray(capacity, sizeof(double));
+    replica->y = (double *) allocateStoreArray(capacity, sizeof(double));
+    replica->mass = (double *) allocateStoreArray(capacity, sizeof(double));
+    replica->capacity = capacity;
+  }
+}
+
+
+/**
+ * Move this thread's share of the planet arrays, and of its node's copy of
+ * the positions and masses, to its own node when they have been allocated
+ * or moved since the last force pass. Each thread owns an equal slice of
+ * the planet slots, the arrays are allocated and seeded by one thread so
+ * their pages start out on its node.
+ * 
+ * @param threadArgs
+ * @return 1 when any pages were moved.
+ */
+int placeCalcStorage(calcArgs *threadArgs)
+{
+  planetStore *planetData;
+  nodeReplica *replica;
+  int first, last, placed;
+  char *buffer;
+  
+  planetData = (*threadArgs).planetData;
+  buffer = (*threadArgs).placeBuffer;
+  placed = 0;
+  
+  if ( planetData->x != (*threadArgs).placedX )
+  {
+    first = (long long) planetData->capacity * (*threadArgs).thread / (*threadArgs).threads;
+    last = (long long) planetData->capacity * ((*threadArgs).thread + 1) / (*threadArgs).threads;
+    placeStoreArray(planetData->x, planetData->capacity, first, last, sizeof(double), buffer);
+    placeStoreArray(planetData->y, planetData->capacity, first, last, sizeof(double), buffer);
+    placeStoreArray(planetData->mass, planetData->capacity, first, last, sizeof(double), buffer);
+    placeStoreArray(planetData->velocityX, planetData->capacity, first, last, sizeof(double), buffer);
+    placeStoreArray(planetData->velocityY, planetData->capacity, first, last, sizeof(double), buffer);
+    placeStoreArray(planetData->accelerationX, planetData->capacity, first, last, sizeof(double), buffer);
+    placeStoreArray(planetData->accelerationY, planetData->capacity, first, last, sizeof(double), buffer);
+    placeStoreArray(planetData->nearestDistance, planetData->capacity, first, last, sizeof(double), buffer);
+    placeStoreArray(planetData->flash, planetData->capacity, first, last, sizeof(int), buffer);
+    placeStoreArray(planetData->id, planetData->capacity, first, last, sizeof(int), buffer);
+    placeStoreArray(planetData->freeIds, planetData->capacity, first, last, sizeof(int), buffer);
+    placeStoreArray(planetData->stepLevel, planetData->capacity, first, last, sizeof(int), buffer);
+    (*threadArgs).placedX = planetData->x;
+    placed = 1;
+  }
+  
+  if ( (*threadArgs).placement->replicas )
+  {
+    replica = &(*threadArgs).placement->replicas[(*threadArgs).placement->node[(*threadArgs).thread]];
+    if ( replica->x != (*threadArgs).placedReplica )
+    {
+      getNodeShare(threadArgs, replica->capacity, &first, &last);
+      placeStoreArray(replica->x, replica->capacity, first, last, sizeof(double), buffer);
+      placeStoreArray(replica->y, replica->capacity, first, last, sizeof(double), buffer);
+      placeStoreArray(replica->mass, replica->capacity, first, last, sizeof(double), buffer);
+      (*threadArgs).placedReplica = replica->x;
+      placed = 1;
+    }
+  }
+  
+  return placed;
+}
+
+
+/**
+ * Move the pages lying wholly inside elements first through last - 1 of an
+ * array to the node of the calling thread. Each page is copied out, dropped
+ * and written back, and Linux allocates the new page on the node of the
+ * thread that first touches it. Arrays of a huge page or more move the huge
+ * pages inside the range whole so they keep them, as allocated by
+ * allocateStoreArray, and the rest of the range in base pages. No other
+ * thread may use the pages meanwhile.
+ * 
+ * @param data
+ * @param count Elements in the array.
+ * @param first
+ * @param last
+ * @param size Size of each element.
+ * @param buffer Scratch of HUGE_PAGE_SIZE bytes.
+ */
+void placeStoreArray(void *data, size_t count, size_t first, size_t last, size_t size, char *buffer)
+{
+  char *page, *end;
+  size_t small, granule, skip, step;
+  
+  small = (size_t) sysconf(_SC_PAGESIZE);
+  granule = count * size >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : small;
+  page = (char *) data + first * size;
+  skip = (size_t) page % small;
+  if ( skip ) page += small - skip;
+  end = (char *) data + last * size;
+  
+  // a share smaller than a huge page, or the ends of a larger one, splits
+  // the huge pages it lies in
+  for(; page + small <= end; page += step)
+  {
+    step = (size_t) page % granule == 0 && page + granule <= end ? granule : small;
+    memcpy(buffer, page, step);
+    madvise(page, step, MADV_DONTNEED);
+    memcpy(page, buffer, step);
+  }
+}
+
+
+/**
+ * Get this thread's equal share of count items among the threads on its
+ * node.
+ * 
+ * @param threadArgs
+ * @param count
+ * @param first Set to the first item.
+ * @param last Set to one past the last item.
+ */
+void getNodeShare(calcArgs *threadArgs, int count, int *first, int *last)
+{
+  threadPlacement *placement;
+  int t, node, share, shares;
+  
+  placement = (*threadArgs).placement;
+  node = placement->node[(*threadArgs).thread];
+  share = 0;
+  shares = 0;
+  for(t = 0; t < placement->threads; t++)
+  {
+    if ( placement->node[t] != node ) continue;
+    if ( t < (*threadArgs).thread ) share++;
+    shares++;
+  }
+  
+  *first = (long long) count * share / shares;
+  *last = (long long) count * (share + 1) / shares;
+}
+
+
+/**
+ * Copy this thread's share of the positions and masses to its node's copy
+ * and point the thread's view of the planet store at the copy. The copy is
+ * only complete after the threads have passed a barrier.
+ * 
+ * @param threadArgs
+ */
+void refreshNodeReplica(calcArgs *threadArgs)
+{
+  planetStore *planetData;
+  nodeReplica *replica;
+  int first, last;
+  
+  planetData = (*threadArgs).planetData;
+  replica = &(*threadArgs).placement->replicas[(*threadArgs).placement->node[(*threadArgs).thread]];
+  
+  getNodeShare(threadArgs, planetData->count, &first, &last);
+  memcpy(&replica->x[first], &planetData->x[first], (last - first) * sizeof(double));
+  memcpy(&replica->y[first], &planetData->y[first], (last - first) * sizeof(double));
+  memcpy(&replica->mass[first], &planetData->mass[first], (last - first) * sizeof(double));
+  
+  (*threadArgs).view = *planetData;
+  (*threadArgs).view.x = replica->x;
+  (*threadArgs).view.y = replica->y;
+  (*threadArgs).view.mass = replica->mass;
+}
+
+
+/**
+ * Create the work schedule for the calculation threads.
+ * 
+ * @param count The planet count.
+ * @param threads The number of calculation threads.
+ * @param chunk Planets per chunk, 0 to size chunks from the counts.
+ * @param steal Give each thread its own range and steal when it runs out.
+ * @return 
+ */
+calcSchedule * createCalcSchedule(int count, int threads, int chunk, int steal)
+{
+  calcSchedule *schedule;
+  
+  schedule = (calcSchedule *) malloc(sizeof(calcSchedule));
+  schedule->rangeCount = steal ? threads : 1;
+  schedule->ranges = (workRange *) allocateStoreArray(schedule->rangeCount, sizeof(workRange));
+  
+  // enough chunks per thread to even out the load without many atomic claims
+  if ( chunk < 1 )
+  {
+    chunk = count / (threads * CHUNKS_PER_THREAD);
+    if ( chunk > MAX_CHUNK_SIZE ) chunk = MAX_CHUNK_SIZE;
+    if ( chunk < 1 ) chunk = 1;
+  }
+  schedule->chunk = chunk;
+  schedule->active = (int *) malloc(count * sizeof(int));
+  schedule->regroup = (int *) malloc(count * sizeof(int));
+  schedule->activeOnly = 0;
+  schedule->drift = 0;
+  
+  resetCalcSchedule(schedule, count);
+  
+  return schedule;
+}
+
+
+/**
+ * Rewind the work ranges before a calculation pass, must only be called
+ * while the calculation threads are waiting on the barrier.
+ * 
+ * @param schedule
+ * @param count The planet count.
+ */
+void resetCalcSchedule(calcSchedule *schedule, int count)
+{
+  int i;
+  
+  for(i = 0; i < schedule->rangeCount; i++)
+  {
+    schedule->ranges[i].next = (long)count * i / schedule->rangeCount;
+    schedule->ranges[i].end = (long)count * (i + 1) / schedule->rangeCount;
+  }
+}
+
+
+/**
+ * Claim the next chunk of planets. Threads claim from their current range
+ * with an atomic add and move on to the following ranges once it is empty.
+ * 
+ * @param schedule
+ * @param range The range to claim from, updated as ranges run out.
+ * @param first Set to the first planet of the chunk.
+ * @param last Set to one past the last planet of the chunk.
+ * @return 1 when a chunk was claimed, 0 when all work is taken.
+ */
+int getNextCalcChunk(calcSchedule *schedule, int *range, int *first, int *last)
+{
+  int tried;
+  workRange *r;
+  
+  for(tried = 0; tried < schedule->rangeCount; tried++)
+  {
+    r = &schedule->ranges[*range];
+    
+    // cheap check before the atomic claim
+    if ( r->next < r->end )
+    {
+      *first = __sync_fetch_and_add(&r->next, schedule->chunk);
+      if ( *first < r->end )
+      {
+        *last = *first + schedule->chunk;
+        if ( *last > r->end ) *last = r->end;
+        return 1;
+      }
+    }
+    
+    // range is used up, steal from the next one
+    *range = (*range + 1) % schedule->rangeCount;
+  }
+  
+  return 0;
+}
+
+
+/**
+ * Allocate the quadtree used by the Barnes-Hut solver.
+ * 
+ * @param count The planet count.
+ * @param threads The number of calculation threads.
+ * @return 
+ */
+quadTree * createQuadTree(int count, int threads)
+{
+  quadTree *tree;
+  
+  tree = (quadTree *) malloc(sizeof(quadTree));
+  
+  // a tree of n bodies normally needs about 3n nodes, grown when a build overflows
+  tree->capacity = 4 * count + 4 * QUAD_TOP_CELLS;
+  tree->nodes = (quadNode *) malloc(tree->capacity * sizeof(quadNode));
+  tree->used = 0;
+  tree->overflow = 0;
+  tree->nextCell = 0;
+  tree->next = (int *) malloc(count * sizeof(int));
+  tree->cellHead = (int *) malloc(threads * QUAD_TOP_CELLS * sizeof(int));
+  tree->bounds = (double *) malloc(threads * 4 * sizeof(double));
+  
+  return tree;
+}
+
+
+/**
+ * Take four contiguous nodes from the pool and initialize them as the
+ * empty children of the given cell.
+ * 
+ * @param tree
+ * @param node The parent node.
+ * @return The index of the first child or -1 when the pool is exhausted.
+ */
+int allocateQuadChildren(quadTree *tree, int node)
+{
+  int c, q;
+  quadNode *parent, *child;
+  
+  c = __sync_fetch_and_add(&tree->used, 4);
+  if ( c + 4 > tree->capacity )
+  {
+    tree->overflow = 1;
+    return -1;
+  }
+  
+  parent = &tree->nodes[node];
+  for(q = 0; q < 4; q++)
+  {
+    // quadrant bit 0 is the east half, bit 1 is the south half
+    child = &tree->nodes[c + q];
+    child->half = parent->half / 2;
+    child->cx = parent->cx + (q & 1 ? child->half : -child->half);
+    child->cy = parent->cy + (q & 2 ? child->half : -child->half);
+    child->mass = 0;
+    child->comX = 0;
+    child->comY = 0;
+    child->child = -1;
+    child->body = -1;
+    child->count = 0;
+  }
+  
+  parent->child = c;
+  return c;
+}
+
+
+/**
+ * Create the top levels of the quadtree down to the split depth and
+ * record the node of each top level cell.
+ * 
+ * @param tree
+ * @param node
+ * @param depth
+ * @param cell The top level cell path collected so far.
+ */
+void createQuadTop(quadTree *tree, int node, int depth, int cell)
+{
+  int q, c;
+  
+  if ( depth == QUAD_SPLIT_DEPTH )
+  {
+    tree->topNode[cell] = node;
+    return;
+  }
+  
+  c = allocateQuadChildren(tree, node);
+  for(q = 0; q < 4; q++)
+  {
+    createQuadTop(tree, c + q, depth + 1, cell * 4 + q);
+  }
+}
+
+
+/**
+ * Find the top level cell that holds the given position.
+ * 
+ * @param tree
+ * @param x
+ * @param y
+ * @return 
+ */
+int getQuadTopCell(quadTree *tree, double x, double y)
+{
+  int depth, q, node, cell;
+  
+  node = 0;
+  cell = 0;
+  for(depth = 0; depth < QUAD_SPLIT_DEPTH; depth++)
+  {
+    q = (x >= tree->nodes[node].cx) + 2 * (y >= tree->nodes[node].cy);
+    node = tree->nodes[node].child + q;
+    cell = cell * 4 + q;
+  }
+  
+  return cell;
+}
+
+
+/**
+ * Insert a planet into the subtree below the given node.
+ * 
+ * @param tree
+ * @param planetData
+ * @param node
+ * @param depth
+ * @param p
+ */
+void insertQuadBody(quadTree *tree, planetStore *planetData, int node, int depth, int p)
+{
+  int q, c, old;
+  quadNode *n;
+  
+  while (1)
+  {
+    n = &tree->nodes[node];
+    
+    // descend into the matching child of a split cell
+    if ( n->child >= 0 )
+    {
+      q = (planetData->x[p] >= n->cx) + 2 * (planetData->y[p] >= n->cy);
+      node = n->child + q;
+      depth++;
+      continue;
+    }
+    
+    // empty leaf
+    if ( n->body < 0 )
+    {
+      n->body = p;
+      tree->next[p] = -1;
+      return;
+    }
+    
+    // too deep or sharing a position, keep a list in the leaf
+    old = n->body;
+    if ( depth >= QUAD_MAX_DEPTH || (planetData->x[old] == planetData->x[p] && planetData->y[old] == planetData->y[p]) )
+    {
+      tree->next[p] = old;
+      n->body = p;
+      return;
+    }
+    
+    // split the leaf and push the resident list down one level
+    c = allocateQuadChildren(tree, node);
+    if ( c < 0 )
+    {
+      return;
+    }
+    
+    n = &tree->nodes[node];
+    q = (planetData->x[old] >= n->cx) + 2 * (planetData->y[old] >= n->cy);
+    tree->nodes[c + q].body = old;
+    n->body = -1;
+  }
+}
+
+
+/**
+ * Calculate the mass and center of mass of each cell in a subtree.
+ * 
+ * @param tree
+ * @param planetData
+ * @param node
+ * @param depth The depth of the node, cells at the stop depth are already summarized.
+ * @param stopDepth
+ */
+void summarizeQuadNode(quadTree *tree, planetStore *planetData, int node, int depth, int stopDepth)
+{
+  int q, i, count;
+  double mass, mx, my;
+  quadNode *n, *child;
+  
+  n = &tree->nodes[node];
+  mass = 0;
+  mx = 0;
+  my = 0;
+  count = 0;
+  
+  if ( n->child >= 0 )
+  {
+    for(q = 0; q < 4; q++)
+    {
+      child = &tree->nodes[n->child + q];
+      if ( depth + 1 != stopDepth )
+      {
+        summarizeQuadNode(tree, planetData, n->child + q, depth + 1, stopDepth);
+      }
+      mass += child->mass;
+      mx += child->mass * child->comX;
+      my += child->mass * child->comY;
+      count += child->count;
+    }
+  }
+  else
+  {
+    for(i = n->body; i >= 0; i = tree->next[i])
+    {
+      mass += planetData->mass[i];
+      mx += planetData->mass[i] * planetData->x[i];
+      my += planetData->mass[i] * planetData->y[i];
+      count++;
+    }
+  }
+  
+  n->mass = mass;
+  n->count = count;
+  if ( mass > 0 )
+  {
+    n->comX = mx / mass;
+    n->comY = my / mass;
+  }
+  else
+  {
+    n->comX = n->cx;
+    n->comY = n->cy;
+  }
+}
+
+
+/**
+ * Build the quadtree over the planet positions. Called by every calculation
+ * thread, the bounding box, the cell lists and the subtrees below the top
+ * level cells are all built in parallel.
+ * 
+ * @param threadArgs
+ */
+void buildQuadTree(calcArgs *threadArgs)
+{
+  quadTree *tree;
+  planetStore *planetData;
+  double *bounds;
+  double minx, maxx, miny, maxy, width;
+  int t, i, p, cell, first, last, next;
+  int *heads;
+  
+  tree = (*threadArgs).tree;
+  planetData = (*threadArgs).planetData;
+  t = (*threadArgs).thread;
+  
+  // each thread owns a fixed slice of the planets for the setup passes
+  first = (long)planetData->count * t / (*threadArgs).threads;
+  last = (long)planetData->count * (t + 1) / (*threadArgs).threads;
+  
+  // bounding box of our slice
+  bounds = &tree->bounds[t * 4];
+  bounds[0] = DBL_MAX;
+  bounds[1] = -DBL_MAX;
+  bounds[2] = DBL_MAX;
+  bounds[3] = -DBL_MAX;
+  for(p = first; p < last; p++)
+  {
+    if ( planetData->mass[p] > 0 && isfinite(planetData->x[p]) && isfinite(planetData->y[p]) )
+    {
+      if ( planetData->x[p] < bounds[0] ) bounds[0] = planetData->x[p];
+      if ( planetData->x[p] > bounds[1] ) bounds[1] = planetData->x[p];
+      if ( planetData->y[p] < bounds[2] ) bounds[2] = planetData->y[p];
+      if ( planetData->y[p] > bounds[3] ) bounds[3] = planetData->y[p];
+    }
+  }
+  
+  do
+  {
+    waitThreadBarrier(threadArgs);
+    
+    // the first thread lays out the top levels of the tree
+    if ( t == 0 )
+    {
+      minx = DBL_MAX;
+      maxx = -DBL_MAX;
+      miny = DBL_MAX;
+      maxy = -DBL_MAX;
+      for(i = 0; i < (*threadArgs).threads; i++)
+      {
+        bounds = &tree->bounds[i * 4];
+        if ( bounds[0] < minx ) minx = bounds[0];
+        if ( bounds[1] > maxx ) maxx = bounds[1];
+        if ( bounds[2] < miny ) miny = bounds[2];
+        if ( bounds[3] > maxy ) maxy = bounds[3];
+      }
+      
+      // no planets, use any small box
+      if ( minx > maxx )
+      {
+        minx = maxx = miny = maxy = 0;
+      }
+      
+      // square root cell slightly larger than the bounds
+      width = maxx - minx > maxy - miny ? maxx - minx : maxy - miny;
+      width = width * 1.0001 + 1;
+      
+      tree->nodes[0].cx = minx + (maxx - minx) / 2;
+      tree->nodes[0].cy = miny + (maxy - miny) / 2;
+      tree->nodes[0].half = width / 2;
+      tree->nodes[0].child = -1;
+      tree->nodes[0].body = -1;
+      tree->nodes[0].count = 0;
+      tree->used = 1;
+      tree->overflow = 0;
+      tree->nextCell = 0;
+      createQuadTop(tree, 0, 0, 0);
+    }
+    
+    waitThreadBarrier(threadArgs);
+    
+    // sort our slice into per thread lists for each top level cell
+    heads = &tree->cellHead[t * QUAD_TOP_CELLS];
+    for(cell = 0; cell < QUAD_TOP_CELLS; cell++)
+    {
+      heads[cell] = -1;
+    }
+    for(p = first; p < last; p++)
+    {
+      if ( planetData->mass[p] > 0 && isfinite(planetData->x[p]) && isfinite(planetData->y[p]) )
+      {
+        cell = getQuadTopCell(tree, planetData->x[p], planetData->y[p]);
+        tree->next[p] = heads[cell];
+        heads[cell] = p;
+      }
+    }
+    
+    waitThreadBarrier(threadArgs);
+    
+    // take top level cells one at a time and build their subtrees
+    while ( (cell = __sync_fetch_and_add(&tree->nextCell, 1)) < QUAD_TOP_CELLS )
+    {
+      for(i = 0; i < (*threadArgs).threads && !tree->overflow; i++)
+      {
+        for(p = tree->cellHead[i * QUAD_TOP_CELLS + cell]; p >= 0 && !tree->overflow; p = next)
+        {
+          // insertion reuses the link for leaf lists
+          next = tree->next[p];
+          insertQuadBody(tree, planetData, tree->topNode[cell], QUAD_SPLIT_DEPTH, p);
+        }
+      }
+      
+      if ( !tree->overflow )
+      {
+        summarizeQuadNode(tree, planetData, tree->topNode[cell], QUAD_SPLIT_DEPTH, -1);
+      }
+    }
+    
+    waitThreadBarrier(threadArgs);
+    
+    // grow the node pool and start over if a subtree ran out of nodes
+    if ( tree->overflow )
+    {
+      if ( t == 0 )
+      {
+        tree->capacity *= 2;
+        tree->nodes = (quadNode *) realloc(tree->nodes, tree->capacity * sizeof(quadNode));
+      }
+      continue;
+    }
+    
+    // the first thread finishes the levels above the top level cells
+    if ( t == 0 )
+    {
+      summarizeQuadNode(tree, planetData, 0, 0, QUAD_SPLIT_DEPTH);
+    }
+    
+    waitThreadBarrier(threadArgs);
+    
+  } while ( tree->overflow );
+}
+
+
+/**
+ * Add the gravitational acceleration on a planet by walking the quadtree,
+ * cells that appear smaller than theta from the planet are treated as a
+ * single mass at their center of mass.
+ * 
+ * @param p
+ * @param threadArgs
+ * @return The number of planets and cells added.
+ */
+int addQuadTreeAcceleration(int p, calcArgs *threadArgs)
+{
+  quadTree *tree;
+  planetStore *planetData;
+  quadNode *n;
+  int stack[4 * (QUAD_MAX_DEPTH + 2)];
+  int top, node, q, i, interactions;
+  double x, y, dx, dy, d2, d, a, ax, ay, nearest, theta2;
+  
+  tree = (*threadArgs).tree;
+  planetData = (*threadArgs).planetData;
+  theta2 = (*threadArgs).theta * (*threadArgs).theta;
+  
+  x = planetData->x[p];
+  y = planetData->y[p];
+  ax = 0;
+  ay = 0;
+  nearest = DBL_MAX;
+  interactions = 0;
+  
+  top = 0;
+  stack[top++] = 0;
+  while ( top > 0 )
+  {
+    node = stack[--top];
+    n = &tree->nodes[node];
+    
+    if ( n->mass <= 0 )
+    {
+      continue;
+    }
+    
+    dx = n->comX - x;
+    dy = n->comY - y;
+    d2 = dx * dx + dy * dy;
+    
+    if ( n->child >= 0 )
+    {
+      // far enough away and not holding our planet, use the cell as a whole
+      if ( 4 * n->half * n->half < theta2 * d2 && 
+           (fabs(x - n->cx) > n->half || fabs(y - n->cy) > n->half) )
+      {
+        d = sqrt(d2);
+        a = G * n->mass / d2;
+        ax += a * dx / d;
+        ay += a * dy / d;
+        
+        // nearest possible distance to a planet inside the cell
+        dx = fabs(x - n->cx) - n->half;
+        dy = fabs(y - n->cy) - n->half;
+        d = sqrt((dx > 0 ? dx * dx : 0) + (dy > 0 ? dy * dy : 0));
+        if ( d < nearest ) nearest = d;
+        interactions++;
+        continue;
+      }
+      
+      for(q = 0; q < 4; q++)
+      {
+        stack[top++] = n->child + q;
+      }
+      continue;
+    }
+    
+    // leaf, add each planet directly
+    for(i = n->body; i >= 0; i = tree->next[i])
+    {
+      if ( i == p )
+      {
+        continue;
+      }
+      interactions++;
+      
+      dx = planetData->x[i] - x;
+      dy = planetData->y[i] - y;
+      d2 = dx * dx + dy * dy;
+      d = sqrt(d2);
+      if ( d < nearest ) nearest = d;
+      
+      // coincident planets are left to the collision pass
+      if ( d2 > 0 )
+      {
+        a = G * planetData->mass[i] / d2;
+        ax += a * dx / d;
+        ay += a * dy / d;
+      }
+    }
+  }
+  
+  planetData->accelerationX[p] = ax;
+  planetData->accelerationY[p] = ay;
+  planetData->nearestDistance[p] = nearest;
+  
+  return interactions;
+}
+
+
+/**
+ * Allocate the fast multipole expansions, storage for each quadtree node is
+ * added when the tree grows.
+ * 
+ * @param order The expansion order.
+ * @return 
+ */
+fmmTree * createFmmTree(int order)
+{
+  fmmTree *fmm;
+  int n;
+  
+  fmm = (fmmTree *) malloc(sizeof(fmmTree));
+  fmm->order = order;
+  fmm->coefficients = FMM_COEFFICIENTS(order);
+  fmm->capacity = 0;
+  fmm->multipole = NULL;
+  fmm->local = NULL;
+  fmm->farNearest = NULL;
+  
+  fmm->inverseFactorial[0] = 1;
+  for(n = 1; n <= 2 * FMM_MAX_ORDER; n++)
+  {
+    fmm->inverseFactorial[n] = fmm->inverseFactorial[n - 1] / n;
+  }
+  
+  return fmm;
+}
+
+
+/**
+ * Calculate the derivatives of 1 / r at the given offset, up to twice the
+ * expansion order, using the recurrence
+ * r^2 D(a,b) = -(2a-1) x D(a-1,b) - 2b y D(a,b-1) - (a-1)^2 D(a-2,b) - b(b-1) D(a,b-2)
+ * 
+ * @param x
+ * @param y
+ * @param order The expansion order.
+ * @param derivatives Filled with D(a,b) at [a * (2 * FMM_MAX_ORDER + 1) + b].
+ */
+void getFmmDerivatives(double x, double y, int order, double *derivatives)
+{
+  int a, b, n, stride;
+  double r2, d;
+  
+  stride = 2 * FMM_MAX_ORDER + 1;
+  r2 = x * x + y * y;
+  derivatives[0] = 1 / sqrt(r2);
+  
+  for(n = 1; n <= 2 * order; n++)
+  {
+    for(a = 0; a <= n; a++)
+    {
+      b = n - a;
+      if ( a > 0 )
+      {
+        d = -(2 * a - 1) * x * derivatives[(a - 1) * stride + b];
+        if ( b > 0 ) d -= 2 * b * y * derivatives[a * stride + b - 1];
+        if ( a > 1 ) d -= (a - 1) * (a - 1) * derivatives[(a - 2) * stride + b];
+        if ( b > 1 ) d -= b * (b - 1) * derivatives[a * stride + b - 2];
+      }
+      else
+      {
+        d = -(2 * b - 1) * y * derivatives[b - 1];
+        if ( b > 1 ) d -= (b - 1) * (b - 1) * derivatives[b - 2];
+      }
+      derivatives[a * stride + b] = d / r2;
+    }
+  }
+}
+
+
+/**
+ * Form the multipole expansion of each cell in a subtree, leaves from their
+ * planets and split cells by shifting the expansions of their children.
+ * 
+ * @param fmm
+ * @param tree
+ * @param planetData
+ * @param node
+ * @param depth The depth of the node, cells at the stop depth are already formed.
+ * @param stopDepth
+ */
+void formFmmMultipole(fmmTree *fmm, quadTree *tree, planetStore *planetData, int node, int depth, int stopDepth)
+{
+  double *multipole;
+  double powerX[FMM_MAX_ORDER + 1], powerY[FMM_MAX_ORDER + 1];
+  quadNode *n, *child;
+  int q, i, a, b, k;
+  
+  n = &tree->nodes[node];
+  multipole = &fmm->multipole[(size_t)node * fmm->coefficients];
+  memset(multipole, 0, fmm->coefficients * sizeof(double));
+  
+  if ( n->child >= 0 )
+  {
+    for(q = 0; q < 4; q++)
+    {
+      child = &tree->nodes[n->child + q];
+      if ( depth + 1 != stopDepth )
+      {
+        formFmmMultipole(fmm, tree, planetData, n->child + q, depth + 1, stopDepth);
+      }
+      if ( child->count > 0 )
+      {
+        shiftFmmMultipole(fmm, node, n->child + q, (child->cx - n->cx) / fmm->scale, (child->cy - n->cy) / fmm->scale);
+      }
+    }
+    return;
+  }
+  
+  // sum of mass * d^k / k! over the planets of the leaf
+  for(i = n->body; i >= 0; i = tree->next[i])
+  {
+    powerX[0] = planetData->mass[i];
+    powerY[0] = 1;
+    for(k = 1; k <= fmm->order; k++)
+    {
+      powerX[k] = powerX[k - 1] * (planetData->x[i] - n->cx) / fmm->scale;
+      powerY[k] = powerY[k - 1] * (planetData->y[i] - n->cy) / fmm->scale;
+    }
+    
+    for(k = 0; k <= fmm->order; k++)
+    {
+      for(b = 0; b <= k; b++)
+      {
+        a = k - b;
+        multipole[FMM_COEFFICIENT(a, b)] += powerX[a] * fmm->inverseFactorial[a] * powerY[b] * fmm->inverseFactorial[b];
+      }
+    }
+  }
+}
+
+
+/**
+ * Add a child multipole expansion to its parent's, shifted to the parent
+ * center.
+ * 
+ * @param fmm
+ * @param target The parent node.
+ * @param source The child node.
+ * @param tx Offset from the parent center to the child center.
+ * @param ty
+ */
+void shiftFmmMultipole(fmmTree *fmm, int target, int source, double tx, double ty)
+{
+  double *multipole, *childMultipole;
+  double powerX[FMM_MAX_ORDER + 1], powerY[FMM_MAX_ORDER + 1];
+  double sum;
+  int a, b, ja, jb, k;
+  
+  multipole = &fmm->multipole[(size_t)target * fmm->coefficients];
+  childMultipole = &fmm->multipole[(size_t)source * fmm->coefficients];
+  
+  powerX[0] = 1;
+  powerY[0] = 1;
+  for(k = 1; k <= fmm->order; k++)
+  {
+    powerX[k] = powerX[k - 1] * tx;
+    powerY[k] = powerY[k - 1] * ty;
+  }
+  
+  for(k = 0; k <= fmm->order; k++)
+  {
+    for(b = 0; b <= k; b++)
+    {
+      a = k - b;
+      sum = 0;
+      for(ja = 0; ja <= a; ja++)
+      {
+        for(jb = 0; jb <= b; jb++)
+        {
+          sum += childMultipole[FMM_COEFFICIENT(ja, jb)] * 
+                 powerX[a - ja] * fmm->inverseFactorial[a - ja] * powerY[b - jb] * fmm->inverseFactorial[b - jb];
+        }
+      }
+      multipole[FMM_COEFFICIENT(a, b)] += sum;
+    }
+  }
+}
+
+
+/**
+ * Add the field of a well separated source cell to the local expansion of
+ * a target cell.
+ * 
+ * @param fmm
+ * @param target
+ * @param source
+ * @param rx Offset from the source center to the target center.
+ * @param ry
+ */
+void addFmmInteraction(fmmTree *fmm, int target, int source, double rx, double ry)
+{
+  double derivatives[(2 * FMM_MAX_ORDER + 1) * (2 * FMM_MAX_ORDER + 1)];
+  double signedMultipole[FMM_COEFFICIENTS(FMM_MAX_ORDER)];
+  double *local, *multipole;
+  double sum;
+  int stride, na, nb, ka, kb, n, k;
+  
+  stride = 2 * FMM_MAX_ORDER + 1;
+  getFmmDerivatives(rx, ry, fmm->order, derivatives);
+  
+  local = &fmm->local[(size_t)target * fmm->coefficients];
+  multipole = &fmm->multipole[(size_t)source * fmm->coefficients];
+  
+  // the expansion of 1 / |R - d| brings in (-1)^|k|
+  for(k = 0; k <= fmm->order; k++)
+  {
+    for(kb = 0; kb <= k; kb++)
+    {
+      signedMultipole[FMM_COEFFICIENT(k - kb, kb)] = (k & 1 ? -1 : 1) * multipole[FMM_COEFFICIENT(k - kb, kb)];
+    }
+  }
+  
+  for(n = 0; n <= fmm->order; n++)
+  {
+    for(nb = 0; nb <= n; nb++)
+    {
+      na = n - nb;
+      sum = 0;
+      for(k = 0; k <= fmm->order; k++)
+      {
+        for(kb = 0; kb <= k; kb++)
+        {
+          ka = k - kb;
+          sum += signedMultipole[FMM_COEFFICIENT(ka, kb)] * derivatives[(ka + na) * stride + kb + nb];
+        }
+      }
+      local[FMM_COEFFICIENT(na, nb)] += sum * fmm->inverseFactorial[na] * fmm->inverseFactorial[nb];
+    }
+  }
+}
+
+
+/**
+ * Add a parent local expansion to its child's, shifted to the child center.
+ * 
+ * @param fmm
+ * @param target The child node.
+ * @param source The parent node.
+ * @param sx Offset from the parent center to the child center.
+ * @param sy
+ */
+void shiftFmmLocal(fmmTree *fmm, int target, int source, double sx, double sy)
+{
+  double *local, *parentLocal;
+  double powerX[FMM_MAX_ORDER + 1], powerY[FMM_MAX_ORDER + 1];
+  double sum, binomialX, binomialY;
+  int a, b, na, nb, k;
+  
+  local = &fmm->local[(size_t)target * fmm->coefficients];
+  parentLocal = &fmm->local[(size_t)source * fmm->coefficients];
+  
+  powerX[0] = 1;
+  powerY[0] = 1;
+  for(k = 1; k <= fmm->order; k++)
+  {
+    powerX[k] = powerX[k - 1] * sx;
+    powerY[k] = powerY[k - 1] * sy;
+  }
+  
+  for(k = 0; k <= fmm->order; k++)
+  {
+    for(b = 0; b <= k; b++)
+    {
+      a = k - b;
+      sum = 0;
+      for(na = a; na <= fmm->order; na++)
+      {
+        // n choose a as n! / (a! (n - a)!)
+        binomialX = fmm->inverseFactorial[a] * fmm->inverseFactorial[na - a] / fmm->inverseFactorial[na];
+        for(nb = b; nb <= fmm->order - na; nb++)
+        {
+          binomialY = fmm->inverseFactorial[b] * fmm->inverseFactorial[nb - b] / fmm->inverseFactorial[nb];
+          sum += parentLocal[FMM_COEFFICIENT(na, nb)] * binomialX * binomialY * powerX[na - a] * powerY[nb - b];
+        }
+      }
+      local[FMM_COEFFICIENT(a, b)] += sum;
+    }
+  }
+}
+
+
+/**
+ * Add the acceleration from every planet of the source cell to every
+ * planet of the target cell directly.
+ * 
+ * @param tree
+ * @param planetData
+ * @param target
+ * @param source
+ */
+void addFmmDirect(quadTree *tree, planetStore *planetData, int target, int source)
+{
+  quadNode *n;
+  int stack[4 * (QUAD_MAX_DEPTH + 2)];
+  int top, node, q, i, j;
+  double x, y, dx, dy, d2, d, a, ax, ay, nearest;
+  
+  n = &tree->nodes[target];
+  if ( n->child >= 0 )
+  {
+    for(q = 0; q < 4; q++)
+    {
+      if ( tree->nodes[n->child + q].count > 0 )
+      {
+        addFmmDirect(tree, planetData, n->child + q, source);
+      }
+    }
+    return;
+  }
+  
+  for(i = n->body; i >= 0; i = tree->next[i])
+  {
+    x = planetData->x[i];
+    y = planetData->y[i];
+    ax = 0;
+    ay = 0;
+    nearest = planetData->nearestDistance[i];
+    
+    top = 0;
+    stack[top++] = source;
+    while ( top > 0 )
+    {
+      node = stack[--top];
+      n = &tree->nodes[node];
+      if ( n->child >= 0 )
+      {
+        for(q = 0; q < 4; q++)
+        {
+          if ( tree->nodes[n->child + q].count > 0 )
+          {
+            stack[top++] = n->child + q;
+          }
+        }
+        continue;
+      }
+      
+      for(j = n->body; j >= 0; j = tree->next[j])
+      {
+        if ( j == i )
+        {
+          continue;
+        }
+        
+        dx = planetData->x[j] - x;
+        dy = planetData->y[j] - y;
+        d2 = dx * dx + dy * dy;
+        d = sqrt(d2);
+        if ( d < nearest ) nearest = d;
+        
+        // coincident planets are left to the collision pass
+        if ( d2 > 0 )
+        {
+          a = G * planetData->mass[j] / d2;
+          ax += a * dx / d;
+          ay += a * dy / d;
+        }
+      }
+    }
+    
+    planetData->accelerationX[i] += ax;
+    planetData->accelerationY[i] += ay;
+    planetData->nearestDistance[i] = nearest;
+  }
+}
+
+
+/**
+ * Collect the field of a source cell into a target cell. Well separated
+ * cells interact through their expansions, otherwise the larger cell is
+ * split until the cells are separated or both are leaves.
+ * 
+ * @param threadArgs
+ * @param target
+ * @param source
+ */
+void interactFmmCells(calcArgs *threadArgs, int target, int source)
+{
+  fmmTree *fmm;
+  quadTree *tree;
+  quadNode *t, *s;
+  double dx, dy, r, gapX, gapY, gap;
+  int q;
+  
+  fmm = (*threadArgs).fmm;
+  tree = (*threadArgs).tree;
+  t = &tree->nodes[target];
+  s = &tree->nodes[source];
+  
+  dx = t->cx - s->cx;
+  dy = t->cy - s->cy;
+  r = (t->half + s->half) * M_SQRT2;
+  
+  if ( r * r < FMM_OPENING * FMM_OPENING * (dx * dx + dy * dy) )
+  {
+    // a few planets are cheaper to add directly than an expansion
+    if ( (double)t->count * s->count * 8 <= (double)fmm->coefficients * fmm->coefficients )
+    {
+      addFmmDirect(tree, (*threadArgs).planetData, target, source);
+      addProfileCount((*threadArgs).thread, COUNTER_PAIRS, (long long)t->count * s->count);
+      return;
+    }
+    
+    addFmmInteraction(fmm, target, source, dx / fmm->scale, dy / fmm->scale);
+    addProfileCount((*threadArgs).thread, COUNTER_PAIRS, 1);
+    
+    // nearest possible distance between planets of the two cells
+    gapX = fabs(dx) - t->half - s->half;
+    gapY = fabs(dy) - t->half - s->half;
+    gap = sqrt((gapX > 0 ? gapX * gapX : 0) + (gapY > 0 ? gapY * gapY : 0));
+    if ( gap < fmm->farNearest[target] ) fmm->farNearest[target] = gap;
+    return;
+  }
+  
+  if ( t->child < 0 && s->child < 0 )
+  {
+    addFmmDirect(tree, (*threadArgs).planetData, target, source);
+    addProfileCount((*threadArgs).thread, COUNTER_PAIRS, (long long)t->count * s->count);
+    return;
+  }
+  
+  if ( t->child >= 0 && (s->child < 0 || t->half >= s->half) )
+  {
+    for(q = 0; q < 4; q++)
+    {
+      if ( tree->nodes[t->child + q].count > 0 )
+      {
+        interactFmmCells(threadArgs, t->child + q, source);
+      }
+    }
+  }
+  else
+  {
+    for(q = 0; q < 4; q++)
+    {
+      if ( tree->nodes[s->child + q].count > 0 )
+      {
+        interactFmmCells(threadArgs, target, s->child + q);
+      }
+    }
+  }
+}
+
+
+/**
+ * Clear the local expansions of a subtree and the accelerations of its
+ * planets.
+ * 
+ * @param fmm
+ * @param tree
+ * @param planetData
+ * @param node
+ */
+void clearFmmCell(fmmTree *fmm, quadTree *tree, planetStore *planetData, int node)
+{
+  quadNode *n;
+  int q, i;
+  
+  n = &tree->nodes[node];
+  memset(&fmm->local[(size_t)node * fmm->coefficients], 0, fmm->coefficients * sizeof(double));
+  fmm->farNearest[node] = DBL_MAX;
+  
+  if ( n->child >= 0 )
+  {
+    for(q = 0; q < 4; q++)
+    {
+      if ( tree->nodes[n->child + q].count > 0 )
+      {
+        clearFmmCell(fmm, tree, planetData, n->child + q);
+      }
+    }
+    return;
+  }
+  
+  for(i = n->body; i >= 0; i = tree->next[i])
+  {
+    planetData->accelerationX[i] = 0;
+    planetData->accelerationY[i] = 0;
+    planetData->nearestDistance[i] = DBL_MAX;
+  }
+}
+
+
+/**
+ * Pass the local expansions down a subtree and add the far field to the
+ * planets in its leaves.
+ * 
+ * @param fmm
+ * @param tree
+ * @param planetData
+ * @param node
+ */
+void passFmmLocal(fmmTree *fmm, quadTree *tree, planetStore *planetData, int node)
+{
+  quadNode *n, *child;
+  double *local;
+  double powerX[FMM_MAX_ORDER + 1], powerY[FMM_MAX_ORDER + 1];
+  double fx, fy, scale;
+  int q, c, i, k, a, b;
+  
+  n = &tree->nodes[node];
+  if ( n->child >= 0 )
+  {
+    for(q = 0; q < 4; q++)
+    {
+      c = n->child + q;
+      child = &tree->nodes[c];
+      if ( child->count == 0 )
+      {
+        continue;
+      }
+      
+      shiftFmmLocal(fmm, c, node, (child->cx - n->cx) / fmm->scale, (child->cy - n->cy) / fmm->scale);
+      if ( fmm->farNearest[node] < fmm->farNearest[c] ) fmm->farNearest[c] = fmm->farNearest[node];
+      passFmmLocal(fmm, tree, planetData, c);
+    }
+    return;
   }
+  
+  // the acceleration is the gradient of the local expansion, scaled back
+  // from tree units
+  local = &fmm->local[(size_t)node * fmm->coefficients];
+  scale = G / (fmm->scale * fmm->scale);
+  for(i = n->body; i >= 0; i = tree->next[i])
+  {
+    powerX[0] = 1;
+    powerY[0] = 1;
+    for(k = 1; k <= fmm->order; k++)
+    {
+      powerX[k] = powerX[k - 1] * (planetData->x[i] - n->cx) / fmm->scale;
+      powerY[k] = powerY[k - 1] * (planetData->y[i] - n->cy) / fmm->scale;
+    }
+    
+    fx = 0;
+    fy = 0;
+    for(k = 1; k <= fmm->order; k++)
+    {
+      for(b = 0; b <= k; b++)
+      {
+        a = k - b;
+        if ( a > 0 ) fx += local[FMM_COEFFICIENT(a, b)] * a * powerX[a - 1] * powerY[b];
+        if ( b > 0 ) fy += local[FMM_COEFFICIENT(a, b)] * b * powerX[a] * powerY[b - 1];
+      }
+    }
     
-  pthread_mutex_unlock((*calcThreadArgs).calcMutex);
+    planetData->accelerationX[i] += scale * fx;
+    planetData->accelerationY[i] += scale * fy;
+    if ( fmm->farNearest[node] < planetData->nearestDistance[i] ) planetData->nearestDistance[i] = fmm->farNearest[node];
+  }
+}
+
+
+/**
+ * Calculate the acceleration on every planet with the fast multipole
+ * method over the quadtree. Called by every calculation thread after the
+ * tree is built, the upward pass and the downward pass are each shared out
+ * by top level cell.
+ * 
+ * @param threadArgs
+ */
+void calculateFmmAccelerations(calcArgs *threadArgs)
+{
+  fmmTree *fmm;
+  quadTree *tree;
+  planetStore *planetData;
+  int cell, node;
+  
+  fmm = (*threadArgs).fmm;
+  tree = (*threadArgs).tree;
+  planetData = (*threadArgs).planetData;
+  
+  // the first thread makes room for the nodes of this build
+  if ( (*threadArgs).thread == 0 )
+  {
+    if ( fmm->capacity < tree->capacity )
+    {
+      fmm->capacity = tree->capacity;
+      free(fmm->multipole);
+      free(fmm->local);
+      free(fmm->farNearest);
+      fmm->multipole = (double *) allocateStoreArray((size_t)fmm->capacity * fmm->coefficients, sizeof(double));
+      fmm->local = (double *) allocateStoreArray((size_t)fmm->capacity * fmm->coefficients, sizeof(double));
+      fmm->farNearest = (double *) allocateStoreArray(fmm->capacity, sizeof(double));
+    }
+    fmm->scale = 2 * tree->nodes[0].half;
+    fmm->nextCell = 0;
+    fmm->nextTarget = 0;
+  }
+  
+  waitThreadBarrier(threadArgs);
+  
+  // upward pass, each top level subtree then the levels above them
+  while ( (cell = __sync_fetch_and_add(&fmm->nextCell, 1)) < QUAD_TOP_CELLS )
+  {
+    formFmmMultipole(fmm, tree, planetData, tree->topNode[cell], QUAD_SPLIT_DEPTH, -1);
+  }
+  
+  waitThreadBarrier(threadArgs);
+  
+  if ( (*threadArgs).thread == 0 )
+  {
+    formFmmMultipole(fmm, tree, planetData, 0, 0, QUAD_SPLIT_DEPTH);
+  }
   
-  return i;
+  waitThreadBarrier(threadArgs);
+  
+  // downward pass, each thread only writes to the top level cells it takes
+  while ( (cell = __sync_fetch_and_add(&fmm->nextTarget, 1)) < QUAD_TOP_CELLS )
+  {
+    node = tree->topNode[cell];
+    if ( tree->nodes[node].count == 0 )
+    {
+      continue;
+    }
+    
+    clearFmmCell(fmm, tree, planetData, node);
+    interactFmmCells(threadArgs, node, 0);
+    passFmmLocal(fmm, tree, planetData, node);
+  }
 }
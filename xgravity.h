@@ -38,9 +38,8 @@ For more information, please refer to <http://unlicense.org/>
 #define M_PI 3.14159265358979323846
 #endif
 
-// default number of planets and maximum allowed count
+// default number of planets
 #define COUNT 500
-#define MAXCOUNT 100000
 
 // terminal window size
 #define WINW 1024
@@ -66,6 +65,152 @@ For more information, please refer to <http://unlicense.org/>
 #define THREAD_COUNT 4
 #define MAX_THREADS 1000
 
+// default number of steps when running headless
+#define STEPS 1000
+
+// default Barnes-Hut opening angle, 0 uses the direct sum
+#define THETA 0
+
+// work chunks handed to the calculation threads, 0 sizes them automatically
+#define CHUNK_SIZE 0
+#define CHUNKS_PER_THREAD 16
+#define MAX_CHUNK_SIZE 1024
+
+// frames a planet flashes for after a merge
+#define FLASH_FRAMES 10
+
+// display thread sleep when there is nothing new to draw
+#define RENDER_IDLE_USEC 2000
+
+// kinds of shape in a draw list
+#define SHAPE_DISC 0
+#define SHAPE_LINE 1
+
+// shapes the draw list starts with room for
+#define DRAW_LIST_SIZE 1024
+
+// visible planets per window pixel above which small planets are drawn as
+// a density map, and the widest disc still drawn over the map
+#define LOD_DENSITY 0.02
+#define LOD_DISC_SIZE 16
+
+// colors in the density map ramp
+#define HEAT_LEVELS 256
+
+// keyboard commands waiting for the physics thread
+#define COMMAND_QUEUE 64
+
+// set on the ready snapshot until the display takes it
+#define SNAPSHOT_FRESH 4
+
+// integrators that advance the planets each step
+#define INTEGRATOR_EULER 0
+#define INTEGRATOR_LEAPFROG 1
+#define INTEGRATOR_YOSHIDA 2
+#define INTEGRATOR_BLOCK 3
+#define INTEGRATOR_COUNT 4
+
+// block timesteps, each planet takes the largest power of two fraction of
+// the timestep below BLOCK_ETA * sqrt(nearest distance / acceleration)
+#define BLOCK_ETA 0.03
+#define BLOCK_MAX_LEVEL 20
+
+// checkpoint file format
+#define CHECKPOINT_MAGIC "XGRAVCKP"
+#define CHECKPOINT_VERSION 3
+#define CHECKPOINT_FILE "xgravity.ckpt"
+#define CHECKPOINT_ALIGN 4096 // field arrays start on page boundaries
+#define CHECKPOINT_FIELDS 9
+#define CHECKPOINT_INT_FIELDS 2 // the last fields hold ints
+
+// trajectory file format, every TRAJECTORY_KEY_INTERVAL frames a key frame
+// is stored that does not depend on the frames before it
+#define TRAJECTORY_MAGIC "XGRAVTRJ"
+#define TRAJECTORY_VERSION 1
+#define TRAJECTORY_EVERY 10 // default steps between frames
+#define TRAJECTORY_ERROR 1e-3 // default largest position and velocity error
+#define TRAJECTORY_KEY_INTERVAL 64
+#define TRAJECTORY_QUEUE 4 // frames waiting for the writer thread
+#define TRAJECTORY_LIMIT 1e18 // largest quantized value, larger ones are clamped
+#define TRAJECTORY_PLANET_BYTES 58 // most bytes one planet can encode to
+
+// replay frames shown per second at the starting speed, and the part of
+// the recording the < and > keys jump
+#define REPLAY_FPS 30
+#define REPLAY_JUMP 0.1
+
+// calculation passes run by the calculation threads
+#define PASS_FORCE 0
+#define PASS_COLLIDE 1
+#define PASS_COUNT 2
+
+// benchmark scenarios, the step count is picked so each run evaluates
+// about BENCH_PAIRS direct sum pairs
+#define BENCH_SEED 1
+#define BENCH_COUNTS 3
+#define BENCH_PAIRS 2e9
+#define BENCH_MAX_STEPS 100
+#define BENCH_CSV 0
+#define BENCH_JSON 1
+
+// startup tuning when the thread count is auto, each candidate is timed in
+// its own process for about TUNE_PAIRS direct sum pairs and the choice is
+// cached per machine, planet count range and solver options in TUNE_FILE
+#define TUNE_FILE "xgravity.tune"
+#define TUNE_PAIRS 2e8
+#define TUNE_MAX_STEPS 20
+#define TUNE_CHUNKS 4
+#define TUNE_KEY_SIZE 512
+
+// quadtree depth limits, cells below the max depth keep a list of bodies
+#define QUAD_MAX_DEPTH 40
+// depth of the top level grid that is split into independently built subtrees
+#define QUAD_SPLIT_DEPTH 3
+#define QUAD_TOP_CELLS 64
+
+// fast multipole method, cells interact through their expansions when the
+// sum of their radii is less than FMM_OPENING of their distance
+#define FMM_MAX_ORDER 12
+#define FMM_OPENING 0.5
+#define FMM_COEFFICIENTS(order) (((order) + 1) * ((order) + 2) / 2)
+#define FMM_COEFFICIENT(a, b) (((a) + (b)) * ((a) + (b) + 1) / 2 + (b))
+
+// planets sampled when reporting the force error against the direct sum
+#define ERROR_SAMPLE 0
+
+// instrumentation, the timers and counters only run while the HUD is shown,
+// a trace is being written or a benchmark row is being timed
+#define PROFILE_HUD 1
+#define PROFILE_TRACE 2
+#define PROFILE_BENCH 4 // counters for the benchmark rows
+#define PROFILE_PHYSICS MAX_THREADS // slots after the calculation threads
+#define PROFILE_DISPLAY (MAX_THREADS + 1)
+#define PROFILE_SLOTS (MAX_THREADS + 2)
+#define PROFILE_HUD_USEC 500000 // HUD refresh interval
+#define PROFILE_HUD_THREADS 16 // calculation threads listed on the HUD
+#define PROFILE_HUD_LINES (PROFILE_HUD_THREADS + 5)
+#define PROFILE_HUD_WIDTH 160
+
+// timed zones, the pass zones share the PASS_ numbers
+#define ZONE_FORCE 0
+#define ZONE_COLLIDE 1
+#define ZONE_BARRIER 2
+#define ZONE_STEP 3
+#define ZONE_SNAPSHOT 4
+#define ZONE_DRAW 5
+#define ZONE_FLUSH 6
+#define ZONE_COUNT 7
+
+// event counters
+#define COUNTER_PAIRS 0
+#define COUNTER_COLLISION_TESTS 1
+#define COUNTER_MERGES 2
+#define COUNTER_STEPS 3
+#define COUNTER_FRAMES 4
+#define COUNTER_DRAWN 5
+#define COUNTER_REQUESTS 6
+#define COUNTER_COUNT 7
+
 
 // define color names
 #define COLOR_GREEN 0
@@ -79,6 +224,46 @@ For more information, please refer to <http://unlicense.org/>
 
 #define COLOR_COUNT 8
 
+// alignment in bytes of the planet arrays
+#define STORE_ALIGN 64
+
+// arrays at least this big start on a huge page and ask for huge pages
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// slots added when the planet store grows, on top of doubling it
+#define STORE_GROW_MIN 64
+
+// direct sum force kernels, the vector kernels match the scalar kernel
+// to within KERNEL_TOLERANCE of the acceleration magnitude
+#define KERNEL_AUTO -1
+#define KERNEL_SCALAR 0
+#define KERNEL_GENERIC 1
+#define KERNEL_SSE2 2
+#define KERNEL_AVX2 3
+#define KERNEL_AVX512 4
+#define KERNEL_COUNT 5
+#define KERNEL_TOLERANCE 1e-12
+
+// mixed precision direct sum, pair terms are single precision relative to
+// the origin of each tile of MIXED_TILE source planets, a tile is summed in
+// double when rounding to single precision could move a planet more than
+// MIXED_TOLERANCE of the distance to its nearest neighbour, and stores
+// holding planets heavier than MIXED_MAX_MASS (the sol and Molniya
+// systems) are summed in double throughout
+#define MIXED_TILE 256
+#define MIXED_TOLERANCE 1e-4
+#define MIXED_MAX_MASS 1e20
+#define MIXED_ERROR_SAMPLE 1000 // planets checked at startup unless -e is given
+
+// pinning of the calculation threads, compact fills the cores of one NUMA
+// node before moving to the next and scatter deals the threads out across
+// the nodes in turn
+#define AFFINITY_NONE 0
+#define AFFINITY_COMPACT 1
+#define AFFINITY_SCATTER 2
+#define AFFINITY_COUNT 3
+#define MAX_NODES 64 // NUMA nodes looked for in sysfs
+
 
 
 /**
@@ -97,26 +282,528 @@ typedef struct
 
 
 /**
- *  structure used to define each planet
+ * totals and ranges over the live planets, each calculation thread
+ * gathers them for its slice in the collision pass
+ */
+typedef struct
+{
+  int count; // live planets
+  double massMax, massMin; // mass range
+  double minX, maxX, minY, maxY; // bounding box of the finite positions
+  double mass; // total mass
+  double momentumX, momentumY; // total momentum
+  double centerX, centerY; // center of mass, mass weighted position sums until finished
+} planetStats;
+
+
+/**
+ * structure of arrays holding every planet, each field is a separate
+ * cache line aligned array indexed by slot, the live planets are packed
+ * into the first count slots and keep a stable id as they move, the
+ * arrays grow when planets are added
+ */
+typedef struct
+{
+  double *x, *y; // 2d position
+  double *mass; // mass
+  double *velocityX; // velocity in x direction
+  double *velocityY; // velocity in y direction
+  double *accelerationX; // gravitational acceleration in x direction
+  double *accelerationY; // gravitational acceleration in y direction
+  double *nearestDistance; // used to decide if this planet needs collision detection
+  int *flash; // number of merges, the display flashes when it changes
+  int count; // number of slots in use
+  int capacity; // slots the arrays hold, also the limit on ids
+  int *id; // stable id of the planet in each slot
+  int idCount; // ids handed out, ids from here up have never been used
+  int *freeIds; // ids of planets that are gone, reused once every id is handed out
+  int freeCount; // number of free ids
+  int randomCount; // planets placed by a randomize
+  int dead; // slots in use whose planet was merged away since the last compaction
+  void *mapping; // checkpoint mapping holding the fields, NULL when allocated
+  size_t mappingSize; // size of the mapping
+  long step; // number of steps run
+  double time; // simulated time in seconds
+  unsigned int seed; // random seed used for the last randomize
+  unsigned long long random; // state of the scenario random generator
+  int accelerationCurrent; // accelerations match the current positions
+  int *stepLevel; // block timestep level, the planet steps timeFactor / 2^level
+  planetStats stats; // live planet totals as of the last collision pass or change
+} planetStore;
+
+
+/**
+ * range of planets claimed chunk by chunk, padded to keep each range on
+ * its own cache line
+ */
+typedef struct
+{
+  int next; // next unclaimed planet, updated atomically
+  int end; // one past the last planet in the range
+  char pad[STORE_ALIGN - 2 * sizeof(int)];
+} workRange;
+
+
+/**
+ * lock free distribution of planets to the calculation threads
+ */
+typedef struct
+{
+  workRange *ranges; // one shared range, or one per thread when stealing
+  int rangeCount; // number of ranges
+  int chunk; // planets claimed at a time
+  int pass; // pass the calculation threads run next
+  int *active; // planets for the force pass when only some are due
+  int *regroup; // scratch as large as active for ordering it by step level
+  int activeOnly; // force pass only calculates the active planets
+  double drift; // time every planet drifts before the force pass, 0 for none
+} calcSchedule;
+
+
+/**
+ * collision state kept by each calculation thread
+ */
+typedef struct
+{
+  int *pairs; // colliding planet pairs found by this thread, survivor first
+  int pairCount; // number of pairs found
+  int pairCapacity; // number of pairs the list can hold
+  int *buckets; // buckets searched for one planet
+  int bucketCapacity; // number of buckets the list can hold
+  int candidates; // planets in our slice that are close enough to collide
+  int tests; // planets checked against another for a collision this pass
+  planetStats stats; // totals of our slice
+} collisionThread;
+
+
+/**
+ * spatial hash of planet positions used to find collision candidates and
+ * the state used to merge the colliding groups
+ */
+typedef struct
+{
+  int size; // number of hash buckets, a power of two
+  int *start; // first entry of each bucket in the sorted list
+  int *sorted; // planet numbers ordered by bucket
+  int *bucket; // bucket of each planet, -1 when not in the grid
+  double cellSize; // width of a grid cell
+  collisionThread *threads; // per thread pair lists
+  int *parent; // union find parent of each colliding planet
+  int *seen; // stamp of the last merge a planet took part in
+  int stamp; // current merge stamp
+  int *members; // planets taking part in the current merge
+  int *survivor; // surviving planet of each group root
+  double *groupMass; // total mass of each group root
+  double *groupMomentumX; // total momentum of each group root
+  double *groupMomentumY;
+  double *groupForceX; // total mass times acceleration of each group root
+  double *groupForceY;
+} collisionGrid;
+
+
+/**
+ * copy of the planet state at the end of a step, read by the display
+ */
+typedef struct
+{
+  double *x, *y; // 2d position
+  double *mass; // mass
+  double *velocityX, *velocityY; // velocity
+  double *accelerationX, *accelerationY; // gravitational acceleration
+  int *flash; // number of merges
+  int *id; // stable id of each planet
+  int count; // number of planets
+  int size; // planets the arrays can hold
+  int ids; // planet ids in use are below this
+  planetStats stats; // live planet totals
+} planetSnapshot;
+
+
+/**
+ * triple buffered snapshots, the physics thread fills the back snapshot
+ * and swaps it with the ready one, the display swaps the ready one to the
+ * front when it is fresh
+ */
+typedef struct
+{
+  planetSnapshot snapshots[3];
+  int back; // snapshot being written by the physics thread
+  int ready; // latest complete snapshot, updated atomically
+  int front; // snapshot being displayed
+} snapshotBuffer;
+
+
+/**
+ * checkpoint file header, followed by one page aligned array per field in
+ * the order x, y, mass, velocityX, velocityY, accelerationX, accelerationY,
+ * flash, id, stored in native byte order with 8 byte fields first so the
+ * layout is the same for 32 and 64 bit builds, each array has room for
+ * capacity planets and holds count
+ */
+typedef struct
+{
+  char magic[8]; // CHECKPOINT_MAGIC without the terminator
+  long long step; // number of steps run
+  long long size; // total file size
+  long long fieldOffset[CHECKPOINT_FIELDS]; // byte offset of each field array
+  double time; // simulated time in seconds
+  double timeFactor; // calculation time factor in seconds
+  double cx, cy; // view center
+  double zoomFactor; // view zoom
+  unsigned long long random; // state of the scenario random generator
+  int version; // CHECKPOINT_VERSION
+  int count; // number of planets
+  unsigned int seed; // random seed of the last randomize
+  int capacity; // planets each field array has room for
+} checkpointHeader;
+
+
+/**
+ * trajectory file header, followed by the frames in the order they were
+ * recorded, each a trajectoryFrame and its encoded planets, stored in
+ * native byte order
+ */
+typedef struct
+{
+  char magic[8]; // TRAJECTORY_MAGIC without the terminator
+  double quantum; // positions and velocities are stored as multiples of this
+  long long every; // steps between frames
+  int version; // TRAJECTORY_VERSION
+  int keyInterval; // frames from one key frame to the next
+} trajectoryHeader;
+
+
+/**
+ * header of a recorded frame, followed by size bytes of varints for each
+ * planet: the difference from the previous planet's id shifted left, with
+ * the low bit set when the mass follows, then x, y, velocityX and velocityY
+ * as the change in quantized value since the previous frame, or the value
+ * itself in a key frame or when the id was not in the previous frame, and
+ * then the mass as a double when it changed
+ */
+typedef struct
+{
+  long long step; // number of steps run
+  double time; // simulated time in seconds
+  int count; // planets in the frame
+  int size; // bytes of encoded planets
+} trajectoryFrame;
+
+
+/**
+ * seek index entry, the index file beside a trajectory holds one for
+ * each frame so a reader can go straight to the nearest key frame
+ */
+typedef struct
+{
+  long long offset; // byte offset of the frame header in the trajectory
+  long long step; // number of steps run at the frame
+} trajectoryIndex;
+
+
+/**
+ * live planets copied from the store for the writer thread
+ */
+typedef struct
+{
+  double *x, *y; // 2d position
+  double *velocityX, *velocityY; // velocity
+  double *mass; // mass
+  int *id; // stable id of each planet
+  int count; // number of planets
+  int size; // planets the arrays can hold
+  int ids; // planet ids in use are below this
+  long long step; // number of steps run
+  double time; // simulated time in seconds
+} trajectorySlot;
+
+
+/**
+ * trajectory being recorded, the physics thread copies frames into the
+ * queue and the writer thread encodes and appends them
+ */
+typedef struct
+{
+  char *path; // trajectory file
+  FILE *file; // trajectory
+  FILE *index; // seek index
+  long every; // steps between frames
+  double quantum; // quantization step, twice the error bound
+  long long frames; // frames written
+  long long offset; // bytes written to the trajectory
+  trajectorySlot slots[TRAJECTORY_QUEUE]; // frames waiting to be written
+  int head; // first waiting frame
+  int queued; // number of waiting frames
+  int closing; // set when the writer should finish the queue and stop
+  int failed; // set when a write failed, later frames are dropped
+  pthread_mutex_t mutex; // protects the queue
+  pthread_cond_t filled; // signalled when a frame is queued
+  pthread_cond_t emptied; // signalled when a frame is written
+  pthread_t thread; // writer thread
+  long long *reference; // quantized x, y, velocityX and velocityY of each id in the last frame
+  double *referenceMass; // mass of each id in the last frame
+  long long *seen; // last frame each id was in
+  int ids; // ids the references cover
+  unsigned char *buffer; // encoded planets of the frame being written
+  size_t bufferSize; // bytes the buffer holds
+} trajectoryRecorder;
+
+
+/**
+ * recorded trajectory mapped for replay, frames are decoded from the
+ * mapping into a snapshot that the display draws in place of the live one
+ */
+typedef struct
+{
+  unsigned char *data; // mapped trajectory
+  size_t size; // bytes mapped
+  trajectoryHeader *header; // header at the start of the mapping
+  trajectoryIndex *index; // mapped seek index
+  size_t indexSize; // bytes of index mapped
+  long long frames; // whole frames in the recording
+  long long frame; // frame decoded into the snapshot, -1 before the first
+  long long target; // frame to show
+  long long jump; // frame number being typed, -1 when none
+  int paused; // playback paused
+  int direction; // 1 playing forward, -1 playing backward
+  double speed; // frames per second
+  double clock; // wall time the shown frame was due
+  planetSnapshot snapshot; // planets of the decoded frame
+  long long *quantized; // quantized x, y, velocityX and velocityY of each id when last seen
+  double *mass; // mass of each id when last seen
+  long long *seen; // last frame each id was decoded in
+  long long *counted; // highest frame each id was decoded in, merges count once
+  int *merges; // mass changes of each id, shown as flashes
+  int ids; // ids the arrays cover
+} trajectoryReplay;
+
+
+/**
+ * disc or line to draw in window coordinates
+ */
+typedef struct
+{
+  int shape; // SHAPE_ constant
+  int color; // COLOR_ constant
+  double x0, y0; // top left corner of a disc, start of a line
+  double x1, y1; // end of a line
+  int size; // width of a disc in pixels
+} drawShape;
+
+
+/**
+ * planet summed into the density map
+ */
+typedef struct
+{
+  int x, y; // window pixel
+  float mass; // mass
+} heatPoint;
+
+
+/**
+ * shapes making up one frame, in drawing order, and the planets drawn as a
+ * density map beneath them
+ */
+typedef struct
+{
+  drawShape *shapes; // the shapes
+  int count; // number of shapes
+  int capacity; // number of shapes the list can hold
+  heatPoint *heat; // density map planets
+  int heatCount; // number of density map planets
+  int heatCapacity; // number of density map planets the list can hold
+  double heatUnit; // mass of the faintest density map pixel
+  XArc *arcs; // discs sorted by color for Xlib
+  XSegment *segments; // lines of one color for Xlib
+  int batchCapacity; // number of arcs and segments the batches can hold
+} drawList;
+
+
+/**
+ * framebuffer drawn in software, in memory shared with the X server or
+ * sent with XPutImage, the render threads rasterize the draw list into
+ * horizontal bands of it
+ */
+typedef struct
+{
+  XImage *image; // framebuffer, 32 bits per pixel
+  int shared; // image is in MIT-SHM shared memory
+  XShmSegmentInfo segment; // shared memory segment holding the pixels
+  unsigned int colors[COLOR_COUNT]; // pixel value of each COLOR_ constant
+  unsigned int heatColors[HEAT_LEVELS]; // density map color ramp
+  float *heat; // mass landing on each pixel of the density map
+  drawList *list; // shapes of the frame being drawn
+  int threads; // number of render threads, 0 when drawn by the caller
+  float *bandMax; // largest pixel mass in each thread's band
+  pthread_barrier_t barrier; // barrier between the display and render threads
+  pthread_barrier_t bandBarrier; // barrier between the render threads
+} frameRenderer;
+
+
+/**
+ * struct to pass arguments to render threads
+ */
+typedef struct
+{
+  frameRenderer *renderer; // shared renderer
+  int thread; // index of this render thread
+} renderArgs;
+
+
+/**
+ * keyboard command passed from the display to the physics thread
+ */
+typedef struct
+{
+  char key; // key pressed
+  double cx, cy; // view center when the key was pressed
+  double zoomFactor; // view zoom when the key was pressed
+} simCommand;
+
+
+/**
+ * direct sum kernel adding the acceleration on planet p from planets first
+ * through last - 1
+ */
+typedef void (*forceKernel)(planetStore *planetData, int p, int first, int last, accelerationVector *acceleration, double *nearestDistance);
+
+
+/**
+ * single precision copy of the planets for the mixed precision kernels,
+ * rebuilt by the calculation threads at the start of each force pass
+ */
+typedef struct
+{
+  float *x, *y; // position relative to the origin of the planet's tile
+  float *gm; // G times mass, 0 for consumed planets
+  double *originX, *originY; // center of each tile's bounding box
+  double *extent; // half the longest side of each tile's bounding box
+  int capacity; // planets the arrays hold
+  forceKernel kernel; // double precision kernel for the tiles that need it
+} mixedTiles;
+
+
+/**
+ * mixed precision direct sum kernel with the same contract as forceKernel
+ */
+typedef void (*mixedKernel)(planetStore *planetData, mixedTiles *tiles, int p, int first, int last, accelerationVector *acceleration, double *nearestDistance);
+
+
+/**
+ * configuration picked by the startup tuning
  */
 typedef struct
 {
-  double x, y; // 2d position
-  double mass; // mass
-  double velocityX; // velocity in x direction
-  double velocityY; // velocity in y direction
-  accelerationVector acceleration; // gravitational acceleration
-  double nearestDistance; // used to decide if this planet needs collision detection
-  int flash; // flash state
-  int calc; // calculation state
-  
-  // temporary variables used when running calculations
-  double calcDistance;
-  double calcGravity;
-  double calcDirection;
-  double calcAccelerationX;
-  double calcAccelerationY;
-} planet;
+  int threads; // number of calculation threads
+  int chunk; // planets per work chunk, 0 for automatic
+  int kernel; // KERNEL_ constant
+  double seconds; // wall time per step
+} tuneChoice;
+
+
+/**
+ * copy of the positions and masses on one NUMA node, refreshed by the
+ * node's calculation threads at the start of each force pass
+ */
+typedef struct
+{
+  double *x, *y, *mass;
+  int capacity; // planets the arrays hold
+} nodeReplica;
+
+
+/**
+ * CPUs and NUMA nodes of the pinned calculation threads
+ */
+typedef struct
+{
+  int policy; // AFFINITY_ constant
+  int threads; // number of calculation threads
+  int nodes; // NUMA nodes the threads run on
+  int cpu[MAX_THREADS]; // CPU each thread is pinned to
+  int node[MAX_THREADS]; // node of each thread, numbered from 0 in the order they are used
+  nodeReplica *replicas; // one per node, NULL unless the direct sum runs on more than one node
+} threadPlacement;
+
+
+/**
+ * quadtree cell used by the Barnes-Hut solver
+ */
+typedef struct
+{
+  double cx, cy; // cell center
+  double half; // half of the cell width
+  double mass; // total mass in the cell
+  double comX, comY; // center of mass
+  int child; // index of the first of four contiguous children, -1 for a leaf
+  int body; // first planet in a leaf, -1 when empty
+  int count; // number of planets in the cell
+} quadNode;
+
+
+/**
+ * quadtree shared by the calculation threads
+ */
+typedef struct
+{
+  quadNode *nodes; // node pool
+  int capacity; // number of allocated nodes
+  int used; // number of nodes in use, updated atomically while building
+  int overflow; // set when the node pool ran out during a build
+  int nextCell; // next top level cell to build, updated atomically
+  int *next; // per planet link for the body lists
+  int *cellHead; // per thread body list heads for each top level cell
+  int topNode[QUAD_TOP_CELLS]; // node index of each top level cell
+  double *bounds; // per thread bounding box partials
+} quadTree;
+
+
+/**
+ * state shared with the physics thread
+ */
+typedef struct
+{
+  planetStore *planets; // planet data, only touched by the physics thread
+  calcSchedule *schedule; // calculation thread work distribution
+  pthread_barrier_t *calcBarrier; // barrier with the calculation threads
+  snapshotBuffer *snapshots; // snapshots for the display
+  double timeFactor; // calculation time factor in seconds
+  int integrator; // INTEGRATOR_ constant
+  pthread_mutex_t commandMutex; // protects the command queue
+  simCommand commands[COMMAND_QUEUE]; // queued keyboard commands
+  int commandHead; // first queued command
+  int commandCount; // number of queued commands
+  double cx, cy, zoomFactor; // view from the last command, saved in checkpoints
+  char *checkpointPath; // checkpoint file
+  long checkpointEvery; // steps between checkpoints, 0 for none
+  collisionGrid *grid; // collision grid, grown with the planet store
+  quadTree *tree; // quadtree, NULL when not used
+  int capacity; // planets the calculation storage is sized for
+  trajectoryRecorder *recorder; // trajectory being recorded, NULL for none
+  mixedTiles *tiles; // mixed precision planet copy, NULL when not used
+  threadPlacement *placement; // pinned thread placement, NULL when not used
+} physicsArgs;
+
+
+/**
+ * multipole and local expansions for the fast multipole method, one of each
+ * for every quadtree node about the cell center, positions are divided by
+ * the root width so the expansions stay well scaled
+ */
+typedef struct
+{
+  int order; // expansion order
+  int coefficients; // coefficients in each expansion
+  int capacity; // nodes with expansion storage
+  double *multipole; // multipole expansion of each node
+  double *local; // local expansion of each node
+  double *farNearest; // closest a far field cell comes to each node
+  double scale; // root cell width
+  int nextCell; // next top level cell for the upward pass, updated atomically
+  int nextTarget; // next top level cell for the downward pass, updated atomically
+  double inverseFactorial[2 * FMM_MAX_ORDER + 1]; // 1 / n!
+} fmmTree;
 
 
 /**
@@ -124,36 +811,239 @@ typedef struct
  */
 typedef struct
 {
-  planet **planetData; // pointer to array of pointers to planet structs
-  int count; // planet count
+  planetStore *planetData; // pointer to the planet arrays
+  int thread; // index of this calculation thread
+  int threads; // number of calculation threads
+  double theta; // Barnes-Hut opening angle
+  quadTree *tree; // shared quadtree, NULL when using the direct sum
+  fmmTree *fmm; // shared multipole tree, NULL unless using the fast multipole method
+  collisionGrid *grid; // shared collision grid
+  forceKernel kernel; // direct sum kernel
+  mixedTiles *tiles; // shared single precision planets, NULL unless using mixed precision
+  mixedKernel mixed; // mixed precision direct sum kernel
+  threadPlacement *placement; // shared thread placement, NULL when the threads are not pinned
+  planetStore view; // the planet store with this node's replica of the positions and masses
+  double *placedX; // position array this thread last placed its share of
+  double *placedReplica; // replica this thread last placed its share of
+  char *placeBuffer; // a huge page of scratch for moving pages
+  calcSchedule *schedule; // shared work distribution
   pthread_barrier_t *calcBarrier; // pointer to sychronization barrier
-  pthread_mutex_t *calcMutex; // pointer to mutex for discrete planet index selection
+  pthread_barrier_t *threadBarrier; // pointer to barrier between calculation threads only
+  double busyTime[PASS_COUNT]; // seconds spent working in each pass
 } calcArgs;
 
 
+/**
+ * wall time of each phase of a step, summed over the benchmark steps
+ */
+typedef struct
+{
+  double force; // force pass including barrier waits
+  double move; // movePlanets
+  double collide; // collision pass including barrier waits
+} benchTimes;
+
+
+/**
+ * time spent in each zone and event counts of one thread, written only by
+ * that thread and padded so threads do not share cache lines
+ */
+typedef struct
+{
+  long long zoneTime[ZONE_COUNT]; // nanoseconds spent in each zone
+  long long counter[COUNTER_COUNT]; // number of each event
+  char pad[2 * STORE_ALIGN - (ZONE_COUNT + COUNTER_COUNT) * sizeof(long long)];
+} profileSlot;
+
+
 /**
  * declare functions
  */
 
-void randomizePlanets(planet *planetData[], int count);
-void clearPlanets(planet *planetData[], int count);
-void createGravityWell(planet *planetData[], int count, int cx, int cy);
-void createBinaryWell(planet *planetData[], int count, int cx, int cy);
-void createHeliocentricSystem(planet *planetData[], int count, int cx, int cy);
-void createGeocentricSystem(planet *planetData[], int count, int cx, int cy);
-void createPlanetarySystem(planet *planetData[], int count, int cx, int cy);
-void createMolniyaOrbit(planet *planetData[], int count, int cx, int cy);
+void stepPlanets(planetStore *planets, calcSchedule *schedule, pthread_barrier_t *calcBarrier, double timeFactor, int integrator, benchTimes *times);
+void stepLeapfrog(planetStore *planets, calcSchedule *schedule, pthread_barrier_t *calcBarrier, double timeFactor, benchTimes *times);
+void stepBlock(planetStore *planets, calcSchedule *schedule, pthread_barrier_t *calcBarrier, double timeFactor, benchTimes *times);
+int getBlockLevel(planetStore *planets, int p, double timeFactor);
+void groupBlockLevels(planetStore *planets, int *list, int count, int *scratch);
+void runCalcPass(calcSchedule *schedule, pthread_barrier_t *calcBarrier, int pass, int count);
+void runHeadless(physicsArgs *physics, long steps);
+void reportForceError(planetStore *planets, calcSchedule *schedule, pthread_barrier_t *calcBarrier, int sample);
+double getSeconds(void);
+double startProfile(void);
+void endProfile(int slot, int zone, double start);
+void addProfileCount(int slot, int counter, long long count);
+void waitThreadBarrier(calcArgs *threadArgs);
+void openTrace(char *path, int threads);
+void closeTrace(void);
+void traceProfileCounters(void);
+void sampleProfile(profileSlot *sample);
+int updateProfileHud(profileSlot *last, double *lastTime, int threads, planetStats *stats, char text[][PROFILE_HUD_WIDTH]);
+void forkBenchRuns(int format, int *count, int *threads, int countGiven, int threadsGiven);
+void runBench(physicsArgs *physics, calcArgs *threadArgs, int threads, long steps, int format, char *kernelName, double theta, int fmmOrder);
+int tuneConfiguration(char *path, int count, char *solver, int tuneKernel, int tuneChunk, tuneChoice *choice);
+int timeTuneCandidate(tuneChoice *candidate, tuneChoice *best);
+void runTune(physicsArgs *physics, int fd);
+int readTuneCache(char *path, char *key, tuneChoice *choice);
+void writeTuneCache(char *path, char *key, tuneChoice *choice);
+void getMachineName(char *name, int size);
+void * physicsWorker(void *args);
+void stepPhysics(physicsArgs *physics);
+void postCommand(physicsArgs *physics, char key, double cx, double cy, double zoomFactor);
+void applyCommands(physicsArgs *physics);
+snapshotBuffer * createSnapshotBuffer(int count);
+void allocateSnapshot(planetSnapshot *snapshot, int size);
+void freeSnapshot(planetSnapshot *snapshot);
+void publishSnapshot(snapshotBuffer *buffer, planetStore *planets);
+int takeSnapshot(snapshotBuffer *buffer);
+drawList * createDrawList(void);
+drawShape * addDrawShape(drawList *list, int shape, int color);
+void addDrawDisc(drawList *list, int color, double x, double y, int size);
+void addDrawLine(drawList *list, int color, double x0, double y0, double x1, double y1);
+void addHeatPoint(drawList *list, double x, double y, double mass);
+void drawXlibShapes(Display *display, Drawable drawable, GC gc, XColor *colors, drawList *list, int width, int height);
+int handleShmError(Display *display, XErrorEvent *error);
+frameRenderer * createFrameRenderer(Display *display, int screen, int width, int height, int threads, int shared, XColor *colors, drawList *list);
+int createFrameImage(frameRenderer *renderer, Display *display, int screen, int width, int height);
+void destroyFrameImage(frameRenderer *renderer, Display *display);
+void createHeatRamp(frameRenderer *renderer, XColor *colors);
+void renderFrame(frameRenderer *renderer);
+void * renderWorker(void *args);
+void clearBand(frameRenderer *renderer, int top, int bottom);
+float accumulateHeat(frameRenderer *renderer, int top, int bottom);
+void toneMapHeat(frameRenderer *renderer, int top, int bottom, float max);
+void rasterizeBand(frameRenderer *renderer, int top, int bottom);
+void rasterizeDisc(frameRenderer *renderer, drawShape *shape, int top, int bottom);
+void rasterizeLine(frameRenderer *renderer, drawShape *shape, int top, int bottom);
+int clipLine(double *x0, double *y0, double *x1, double *y1, double width, double height);
+void printUsage(char *name);
+
+planetStore * createPlanetStore(int count);
+void growPlanetStore(planetStore *planetData, int capacity);
+void * moveStoreArray(void *data, size_t used, size_t capacity, size_t size, int owned);
+int addPlanet(planetStore *planetData);
+void compactPlanets(planetStore *planetData);
+void fitCalcStorage(physicsArgs *physics);
+void getCheckpointLayout(checkpointHeader *header, int capacity);
+int writeCheckpoint(char *path, planetStore *planets, double timeFactor, double cx, double cy, double zoomFactor);
+planetStore * restoreCheckpoint(char *path, checkpointHeader *header);
+trajectoryRecorder * openTrajectory(char *path, long every, double error);
+void recordTrajectory(trajectoryRecorder *recorder, planetStore *planets);
+void * trajectoryWorker(void *args);
+int writeTrajectoryFrame(trajectoryRecorder *recorder, trajectorySlot *slot);
+int putTrajectoryVarint(unsigned char *buffer, unsigned long long value);
+long long quantizeTrajectory(double value, double quantum);
+void closeTrajectory(void);
+trajectoryReplay * openReplay(char *path);
+void * mapReplayFile(char *path, size_t *size);
+void controlReplay(trajectoryReplay *replay, char key, double now);
+int advanceReplay(trajectoryReplay *replay, double now);
+void seekReplay(trajectoryReplay *replay, long long frame);
+void decodeReplayFrame(trajectoryReplay *replay, long long frame);
+void growReplayIds(trajectoryReplay *replay, int ids);
+unsigned long long getTrajectoryVarint(unsigned char **in, unsigned char *end);
+void describeReplay(trajectoryReplay *replay, char *text);
+void * allocateStoreArray(size_t count, size_t size);
+
+void randomizePlanets(planetStore *planetData);
+void seedPlanets(planetStore *planetData, unsigned int seed);
+void seedRandom(planetStore *planetData, unsigned int seed);
+double getRandom(planetStore *planetData);
+void clearPlanets(planetStore *planetData);
+void createGravityWell(planetStore *planetData, int cx, int cy);
+void createBinaryWell(planetStore *planetData, int cx, int cy);
+void createHeliocentricSystem(planetStore *planetData, int cx, int cy);
+void createGeocentricSystem(planetStore *planetData, int cx, int cy);
+void createPlanetarySystem(planetStore *planetData, int cx, int cy);
+void createMolniyaOrbit(planetStore *planetData, int cx, int cy);
 
-double getMassMax(planet *planetData[], int count);
-double getMassMin(planet *planetData[], int count);
+void clearPlanetStats(planetStats *stats);
+void measurePlanets(planetStats *stats, planetStore *planetData, int first, int last);
+void addPlanetStats(planetStats *stats, planetStats *partial);
+void finishPlanetStats(planetStats *stats);
+void updatePlanetStats(planetStore *planetData);
 
-void calculateDistance(int p1, int p2, planet *planetData[]);
-void calculateGravitationalForce(int p1, int p2);
-void calculateGravitationalDirection(int p1, int p2, planet *planetData[]);
-void addGravitationalAcceleration(int p1, int p2, planet *planetData[]);
+double calculateDistance(int p1, int p2, planetStore *planetData);
+double calculateGravitationalAcceleration(double distance, int p1, int p2, planetStore *planetData);
+double calculateGravitationalDirection(int p1, int p2, planetStore *planetData);
+void addGravitationalAcceleration(int p1, int p2, planetStore *planetData, accelerationVector *acceleration, double *nearestDistance);
+
+extern char *kernelNames[KERNEL_COUNT];
+extern int benchCounts[BENCH_COUNTS];
+extern int tuneChunks[TUNE_CHUNKS];
+extern char *integratorNames[INTEGRATOR_COUNT];
+extern char *affinityNames[AFFINITY_COUNT];
+extern int profileFlags;
+extern profileSlot profileSlots[PROFILE_SLOTS];
+extern char *zoneNames[ZONE_COUNT];
+extern char *counterNames[COUNTER_COUNT];
+extern int shmError;
+extern int batchOrder[COLOR_COUNT];
+int getForceKernelByName(char *name);
+int isForceKernelSupported(int kernel);
+int selectForceKernel(void);
+forceKernel getForceKernel(int kernel);
+void forceKernelScalar(planetStore *planetData, int p, int first, int last, accelerationVector *acceleration, double *nearestDistance);
+void forceKernelGeneric(planetStore *planetData, int p, int first, int last, accelerationVector *acceleration, double *nearestDistance);
+void forceKernelSSE2(planetStore *planetData, int p, int first, int last, accelerationVector *acceleration, double *nearestDistance);
+void forceKernelAVX2(planetStore *planetData, int p, int first, int last, accelerationVector *acceleration, double *nearestDistance);
+void forceKernelAVX512(planetStore *planetData, int p, int first, int last, accelerationVector *acceleration, double *nearestDistance);
+mixedTiles * createMixedTiles(int count, forceKernel kernel);
+void growMixedTiles(mixedTiles *tiles, int capacity);
+void prepareMixedTiles(calcArgs *threadArgs);
+mixedKernel getMixedKernel(int kernel);
+void forceKernelMixedGeneric(planetStore *planetData, mixedTiles *tiles, int p, int first, int last, accelerationVector *acceleration, double *nearestDistance);
+void forceKernelMixedAVX2(planetStore *planetData, mixedTiles *tiles, int p, int first, int last, accelerationVector *acceleration, double *nearestDistance);
+void forceKernelMixedAVX512(planetStore *planetData, mixedTiles *tiles, int p, int first, int last, accelerationVector *acceleration, double *nearestDistance);
+
+double getCollisionRadius(double mass);
 int inCollisionRange(double mass1, double mass2, double distance);
-void movePlanets(double timeFactor, planet *planetData[], int count);
-void calculateCollisions(planet *planetData[], int count);
+void movePlanets(double timeFactor, planetStore *planetData);
+void kickPlanets(double timeFactor, planetStore *planetData);
+void driftPlanets(double timeFactor, planetStore *planetData);
+int getIntegratorByName(char *name);
+
+collisionGrid * createCollisionGrid(int count, int threads);
+void sizeCollisionGrid(collisionGrid *grid, int count);
+int getCollisionBucket(collisionGrid *grid, long long ix, long long iy);
+long long getCollisionCell(double cellSize, double position);
+void sortCollisionGrid(collisionGrid *grid, planetStore *planetData);
+int comparePlanetIndex(const void *a, const void *b);
+void addCollisionPair(collisionThread *ct, int pi, int vi);
+void findCollisionPairs(collisionGrid *grid, collisionThread *ct, planetStore *planetData, int pi);
+int findMergeGroup(int *parent, int pi);
+int addMergeMember(collisionGrid *grid, int pi, int count);
+int resolveCollisions(collisionGrid *grid, planetStore *planetData, int threads);
+void calculateCollisions(calcArgs *threadArgs);
 
 void * calcWorker(void *args);
-int getNextCalcIndex(int p, calcArgs *calcThreadArgs);
+void calculateAccelerations(calcArgs *threadArgs);
+
+int getAffinityByName(char *name);
+threadPlacement * createThreadPlacement(int policy, int threads);
+int readCpuList(char *path, cpu_set_t *set);
+void createNodeReplicas(threadPlacement *placement, int capacity);
+void growNodeReplicas(threadPlacement *placement, int capacity);
+int placeCalcStorage(calcArgs *threadArgs);
+void placeStoreArray(void *data, size_t count, size_t first, size_t last, size_t size, char *buffer);
+void getNodeShare(calcArgs *threadArgs, int count, int *first, int *last);
+void refreshNodeReplica(calcArgs *threadArgs);
+
+calcSchedule * createCalcSchedule(int count, int threads, int chunk, int steal);
+void resetCalcSchedule(calcSchedule *schedule, int count);
+int getNextCalcChunk(calcSchedule *schedule, int *range, int *first, int *last);
+
+quadTree * createQuadTree(int count, int threads);
+void buildQuadTree(calcArgs *threadArgs);
+int addQuadTreeAcceleration(int p, calcArgs *threadArgs);
+
+fmmTree * createFmmTree(int order);
+void getFmmDerivatives(double x, double y, int order, double *derivatives);
+void formFmmMultipole(fmmTree *fmm, quadTree *tree, planetStore *planetData, int node, int depth, int stopDepth);
+void shiftFmmMultipole(fmmTree *fmm, int target, int source, double tx, double ty);
+void addFmmInteraction(fmmTree *fmm, int target, int source, double rx, double ry);
+void shiftFmmLocal(fmmTree *fmm, int target, int source, double sx, double sy);
+void addFmmDirect(quadTree *tree, planetStore *planetData, int target, int source);
+void interactFmmCells(calcArgs *threadArgs, int target, int source);
+void clearFmmCell(fmmTree *fmm, quadTree *tree, planetStore *planetData, int node);
+void passFmmLocal(fmmTree *fmm, quadTree *tree, planetStore *planetData, int node);
+void calculateFmmAccelerations(calcArgs *threadArgs);